@@ -12,6 +12,7 @@
 
 #include "hal.h"
 #include "sha.h"
+#include "tweetnacl.h"
 #include "dbcrypt.h"
 #include "storage.h"
 #include "block.h"
@@ -19,14 +20,24 @@
 #include "debug.h"
 
 
-PSRAM_NOINIT uint8_t io_buf[STORAGE_BLOCK_SIZE];
+#define	NONCE_OFFSET	32	/* after the writer's public key */
 
-static PSRAM_NOINIT uint8_t bc[STORAGE_BLOCK_SIZE];
+
+PSRAM_NOINIT uint8_t io_buf[STORAGE_BLOCK_MAX];
+
+static PSRAM_NOINIT uint8_t bc[STORAGE_BLOCK_MAX];
 	// @@@ beyond-worst-case size
 
 
+unsigned block_safe_payload(void)
+{
+	return storage_block_size() / 2;
+}
+
+
 static enum block_type classify_block(const uint8_t *b)
 {
+	unsigned size = storage_block_size();
 	unsigned i;
 
 	switch (*b++) {
@@ -39,7 +50,7 @@ static enum block_type classify_block(const uint8_t *b)
 		for (i = 1; i != DB_NONCE_SIZE; i++)
 			if (*b++ != 0xff)
 				return bt_data;
-		while (i++ != STORAGE_BLOCK_SIZE)
+		while (i++ != size)
 			if (*b++ != 0xff)
 				return bt_invalid;
 		return bt_erased;
@@ -49,19 +60,195 @@ static enum block_type classify_block(const uint8_t *b)
 }
 
 
-enum block_type block_read(const struct dbcrypt *c, uint16_t *seq,
-    void *payload, unsigned *payload_len, unsigned n)
+/*
+ * The content of blocks we have recently decrypted or written is kept in the
+ * cache, so that reading them again does not have to decrypt them. An entry
+ * is found by block number, nonce, and the public key of the reader. Since
+ * each write uses a new random nonce, a stale entry can never match. The
+ * public key makes sure that a hit is only possible with the key that
+ * decrypted the block, so that block_validate keeps its meaning.
+ *
+ * An entry can also hold the state of the log area and the records in it, if
+ * we know them, i.e., after writing the block, or after reading it with
+ * block_read_log. block_append changes the log without changing the nonce, so
+ * it makes us forget the log. Reads that return the log only hit entries that
+ * have it.
+ *
+ * Entries are cleared when evicted, and block_cache_clear clears all of them.
+ */
+
+#ifdef TARGET_m0p
+#define	BLOCK_CACHE_ENTRIES	2	/* BL618, keep RAM use low */
+#else
+#define	BLOCK_CACHE_ENTRIES	8
+#endif
+
+
+struct cache_entry {
+	bool		valid;
+	unsigned	block;
+	uint8_t		nonce[DB_NONCE_SIZE];
+	uint8_t		pk[crypto_box_PUBLICKEYBYTES];
+	unsigned	len;		/* bytes of content in cache_buf */
+	bool		has_log;	/* "log" is valid */
+	struct db_log	log;		/* records follow the content */
+	unsigned	last_use;	/* 0 if never used */
+};
+
+static struct cache_entry cache[BLOCK_CACHE_ENTRIES];
+static PSRAM_NOINIT uint8_t
+    cache_buf[BLOCK_CACHE_ENTRIES][STORAGE_BLOCK_MAX];
+static unsigned cache_clock = 0;
+static unsigned cache_hits = 0;
+static unsigned cache_misses = 0;
+
+
+static void cache_drop(struct cache_entry *e)
+{
+	memset(cache_buf[e - cache], 0, e->len + e->log.len);
+	memset(e, 0, sizeof(*e));
+}
+
+
+/*
+ * If "log" is set, cache_find only returns an entry that has the log.
+ */
+
+static struct cache_entry *cache_find(const struct dbcrypt *c, unsigned n,
+    const uint8_t *b, bool log)
+{
+	struct cache_entry *e;
+
+	for (e = cache; e != cache + BLOCK_CACHE_ENTRIES; e++)
+		if (e->valid && e->block == n && (e->has_log || !log) &&
+		    !memcmp(e->nonce, b + NONCE_OFFSET, DB_NONCE_SIZE) &&
+		    !memcmp(e->pk, dbcrypt_pubkey(c), sizeof(e->pk))) {
+			e->last_use = ++cache_clock;
+			cache_hits++;
+			return e;
+		}
+	cache_misses++;
+	return NULL;
+}
+
+
+/*
+ * cache_put adds the "len" bytes at "content", followed by zeroes up to
+ * "size" bytes, and the log, if "log" is not NULL.
+ */
+
+static void cache_put(const struct dbcrypt *c, unsigned n, const uint8_t *b,
+    const void *content, unsigned len, unsigned size,
+    const struct db_log *log)
+{
+	struct cache_entry *e, *victim = cache;
+
+	/* replace an older copy of the block, else the least recently used */
+	for (e = cache; e != cache + BLOCK_CACHE_ENTRIES; e++) {
+		if (e->valid && e->block == n) {
+			victim = e;
+			break;
+		}
+		if (e->last_use < victim->last_use)
+			victim = e;
+	}
+	cache_drop(victim);
+	victim->valid = 1;
+	victim->block = n;
+	memcpy(victim->nonce, b + NONCE_OFFSET, DB_NONCE_SIZE);
+	memcpy(victim->pk, dbcrypt_pubkey(c), sizeof(victim->pk));
+	victim->len = size;
+	victim->last_use = ++cache_clock;
+	memcpy(cache_buf[victim - cache], content, len);
+	memset(cache_buf[victim - cache] + len, 0, size - len);
+	if (log) {
+		assert(size + log->len <= STORAGE_BLOCK_MAX);
+		victim->has_log = 1;
+		victim->log = *log;
+		victim->log.buf = NULL;
+		if (log->len)
+			memcpy(cache_buf[victim - cache] + size, log->buf,
+			    log->len);
+	}
+}
+
+
+/*
+ * cache_get_log returns the log like log_read in dbcrypt.c, i.e., it only
+ * stores the records that fit into log->buf.
+ */
+
+static void cache_get_log(const struct cache_entry *e, struct db_log *log)
+{
+	const uint8_t *r = cache_buf[e - cache] + e->len;
+
+	log->offset = e->log.offset;
+	log->size = e->log.size;
+	log->used = e->log.used;
+	log->len = 0;
+	for (; r != cache_buf[e - cache] + e->len + e->log.len; r += 1 + *r)
+		if (log->buf && log->len + 1 + *r <= log->buf_size) {
+			memcpy(log->buf + log->len, r, 1 + *r);
+			log->len += 1 + *r;
+		}
+}
+
+
+static void cache_forget_log(unsigned n)
+{
+	struct cache_entry *e;
+
+	for (e = cache; e != cache + BLOCK_CACHE_ENTRIES; e++)
+		if (e->valid && e->block == n && e->has_log) {
+			memset(cache_buf[e - cache] + e->len, 0, e->log.len);
+			memset(&e->log, 0, sizeof(e->log));
+			e->has_log = 0;
+		}
+}
+
+
+static void cache_forget(unsigned n)
+{
+	struct cache_entry *e;
+
+	for (e = cache; e != cache + BLOCK_CACHE_ENTRIES; e++)
+		if (e->valid && e->block == n)
+			cache_drop(e);
+}
+
+
+void block_cache_clear(void)
+{
+	struct cache_entry *e;
+
+	for (e = cache; e != cache + BLOCK_CACHE_ENTRIES; e++)
+		cache_drop(e);
+}
+
+
+void block_cache_stats(unsigned *hits, unsigned *misses)
+{
+	*hits = cache_hits;
+	*misses = cache_misses;
+}
+
+
+/*
+ * block_decode looks up the content in the cache, and adds it after
+ * decrypting, unless "n" is negative. We only add the log if "log" could hold
+ * all the records.
+ */
+
+static enum block_type block_decode(const struct dbcrypt *c, uint16_t *seq,
+    void *payload, unsigned *payload_len, struct db_log *log, const uint8_t *b,
+    int n)
 {
 	const struct block_header *hdr = (const void *) bc;
+	const struct cache_entry *e;
 	enum block_type type;
 	int got;
 
-	assert(n >= RESERVED_BLOCKS);
-	assert(n < storage_blocks());
-
-	if (!storage_read_block(io_buf, n))
-		return bt_error;
-	type = classify_block(io_buf);
+	type = classify_block(b);
 	if (!payload)
 		return type;
 	switch (type) {
@@ -72,10 +259,22 @@ enum block_type block_read(const struct dbcrypt *c, uint16_t *seq,
 	default:
 		break;
 	}
-	got = db_decrypt(c, bc, sizeof(bc), io_buf);
-	if (got < 0) {
-		memset(bc, 0, sizeof(bc));
-		return bt_invalid;
+	e = n < 0 ? NULL : cache_find(c, n, b, log);
+	if (e) {
+		got = e->len;
+		memcpy(bc, cache_buf[e - cache], got);
+		if (log)
+			cache_get_log(e, log);
+	} else {
+		got = db_decrypt(c, bc, sizeof(bc), b, log);
+		if (got < 0) {
+			memset(bc, 0, storage_block_size());
+			return bt_invalid;
+		}
+		if (n >= 0)
+			cache_put(c, n, b, bc, got, got,
+			    log && log->buf_size >= storage_block_size() ?
+			    log : NULL);
 	}
 	assert((unsigned) got >= sizeof(*hdr));
 	assert((unsigned) got <= sizeof(*hdr) + *payload_len);
@@ -83,6 +282,12 @@ enum block_type block_read(const struct dbcrypt *c, uint16_t *seq,
 	switch (hdr->type) {
 	case bt_data:
 	case bt_settings:
+	case bt_index:
+	case bt_wear:
+	case bt_patch:
+	case bt_packed:
+	case bt_first:
+	case bt_next:
 		if (seq)
 			*seq = hdr->seq;
 		memcpy(payload, bc + sizeof(*hdr), got - sizeof(*hdr));
@@ -96,34 +301,189 @@ enum block_type block_read(const struct dbcrypt *c, uint16_t *seq,
 		*payload_len = 0;
 		break;
 	}
-	memset(bc, 0, sizeof(bc));
+	memset(bc, 0, storage_block_size());
 	return type;
 }
 
 
+enum block_type block_read_log(const struct dbcrypt *c, uint16_t *seq,
+    void *payload, unsigned *payload_len, struct db_log *log, unsigned n)
+{
+	const uint8_t *b;
+
+	assert(n >= RESERVED_BLOCKS);
+	assert(n < storage_blocks());
+
+	if (log) {
+		log->size = 0;
+		log->used = 0;
+		log->len = 0;
+	}
+	b = storage_map_block(n);
+	if (b)
+		return block_decode(c, seq, payload, payload_len, log, b, n);
+	if (!storage_read_block(io_buf, n))
+		return bt_error;
+	return block_decode(c, seq, payload, payload_len, log, io_buf, n);
+}
+
+
+enum block_type block_read(const struct dbcrypt *c, uint16_t *seq,
+    void *payload, unsigned *payload_len, unsigned n)
+{
+	return block_read_log(c, seq, payload, payload_len, NULL, n);
+}
+
+
+/*
+ * Pipelined reading: the blocks are read in batches of BLOCK_PIPE_BATCH
+ * blocks, with each batch going to pipe_buf[batch % BLOCK_PIPE_BATCHES]. While
+ * we decrypt the blocks of one batch, the reads of the following batches are
+ * pending. The blocks of a batch are consecutive in the buffer, whatever the
+ * block size.
+ *
+ * If the backend does not accept a request, we read the batch immediately,
+ * and pipe_ok holds the result.
+ */
+
+static PSRAM_NOINIT uint8_t
+    pipe_buf[BLOCK_PIPE_BATCHES][BLOCK_PIPE_BATCH * STORAGE_BLOCK_MAX];
+static bool pipe_async[BLOCK_PIPE_BATCHES];
+static bool pipe_ok[BLOCK_PIPE_BATCHES];
+static bool pipe_busy = 0;
+
+
+static inline unsigned pipe_batch(const struct block_pipe *p, unsigned n)
+{
+	return (n - p->from) / BLOCK_PIPE_BATCH % BLOCK_PIPE_BATCHES;
+}
+
+
+static inline unsigned batch_size(const struct block_pipe *p, unsigned n)
+{
+	return p->end - n < BLOCK_PIPE_BATCH ? p->end - n : BLOCK_PIPE_BATCH;
+}
+
+
+static void pipe_submit(struct block_pipe *p)
+{
+	while (p->submitted != p->end &&
+	    (p->submitted - p->from) / BLOCK_PIPE_BATCH -
+	    (p->next - p->from) / BLOCK_PIPE_BATCH != BLOCK_PIPE_BATCHES) {
+		unsigned b = pipe_batch(p, p->submitted);
+		unsigned n = batch_size(p, p->submitted);
+
+		pipe_async[b] = storage_read_submit(pipe_buf[b], p->submitted,
+		    n);
+		if (!pipe_async[b]) {
+			struct storage_vec v[BLOCK_PIPE_BATCH];
+			unsigned i;
+
+			for (i = 0; i != n; i++) {
+				v[i].buf = pipe_buf[b] +
+				    i * storage_block_size();
+				v[i].n = p->submitted + i;
+			}
+			pipe_ok[b] = storage_read_blocks(v, n);
+		}
+		p->submitted += n;
+	}
+}
+
+
+void block_pipe_begin(struct block_pipe *p, unsigned from, unsigned to)
+{
+	assert(!pipe_busy);
+	assert(BLOCK_PIPE_BATCHES <= STORAGE_READ_QUEUE);
+	assert(from >= RESERVED_BLOCKS);
+	assert(to <= storage_blocks());
+	pipe_busy = 1;
+	p->from = p->next = p->ready = p->submitted = from;
+	p->end = to;
+	p->mapped = from != to && storage_map_block(from);
+	if (!p->mapped)
+		pipe_submit(p);
+}
+
+
+enum block_type block_pipe_next(struct block_pipe *p, const struct dbcrypt *c,
+    uint16_t *seq, void *payload, unsigned *payload_len)
+{
+	unsigned size = storage_block_size();
+	unsigned batch = pipe_batch(p, p->next);
+	uint8_t *b = pipe_buf[batch] +
+	    (p->next - p->from) % BLOCK_PIPE_BATCH * size;
+	enum block_type type;
+
+	assert(p->next != p->end);
+	if (p->mapped)
+		return block_decode(c, seq, payload, payload_len, NULL,
+		    storage_map_block(p->next++), -1);
+	if (p->next == p->ready) {
+		assert(p->ready != p->submitted);
+		if (pipe_async[batch])
+			pipe_ok[batch] = storage_read_wait();
+		p->ready += batch_size(p, p->ready);
+	}
+	type = pipe_ok[batch] ?
+	    block_decode(c, seq, payload, payload_len, NULL, b, -1) : bt_error;
+	memset(b, 0, size);
+	p->next++;
+	pipe_submit(p);
+	return type;
+}
+
+
+void block_pipe_end(struct block_pipe *p)
+{
+	while (p->ready != p->submitted) {
+		if (pipe_async[pipe_batch(p, p->ready)])
+			storage_read_wait();
+		p->ready += batch_size(p, p->ready);
+	}
+	pipe_busy = 0;
+}
+
+
 bool block_validate(const struct dbcrypt *c, unsigned n)
 {
+	const uint8_t *b;
 	int got;
 
 	assert(n < storage_blocks());
-	if (!storage_read_block(io_buf, n))
-		return 0;
-	got =  db_decrypt(c, bc, sizeof(bc), io_buf);
-	memset(bc, 0, sizeof(bc));
+	b = storage_map_block(n);
+	if (!b) {
+		if (!storage_read_block(io_buf, n))
+			return 0;
+		b = io_buf;
+	}
+	if (cache_find(c, n, b, 0))
+		return 1;
+	got =  db_decrypt(c, bc, sizeof(bc), b, NULL);
+	if (got >= 0)
+		cache_put(c, n, b, bc, got, got, NULL);
+	memset(bc, 0, storage_block_size());
 	return got >= 0;
 }
 
 
-bool block_write(const struct dbcrypt *c, enum block_type type, uint16_t seq,
-    const void *payload, unsigned length, unsigned n)
+static bool do_block_write(const struct dbcrypt *c, enum block_type type,
+    uint16_t seq, const void *payload, unsigned length, bool log, unsigned n)
 {
 	struct block_header *hdr = (void *) bc;
+	/* without a log area, db_decrypt returns this state */
+	struct db_log state = {
+		.offset	= storage_block_size(),
+		.buf	= NULL,
+	};
+	int size;
+	bool ok;
 
 	assert(n >= RESERVED_BLOCKS);
 	assert(n < storage_blocks());
 	assert(sizeof(*hdr) + length <= sizeof(bc));
 
-	memset(io_buf, 0, sizeof(io_buf));
+	memset(io_buf, 0, storage_block_size());
 	memset(hdr, 0, sizeof(*hdr));
 	hdr->type = type;
 	hdr->seq = seq;
@@ -133,15 +493,69 @@ bool block_write(const struct dbcrypt *c, enum block_type type, uint16_t seq,
 		break;
 	case bt_data:
 	case bt_settings:
+	case bt_index:
+	case bt_wear:
+	case bt_packed:
+	case bt_first:
+	case bt_next:
 		memcpy(bc + sizeof(*hdr), payload, length);
 		break;
+	case bt_patch:
+		/* the payload of patch blocks is empty */
+		assert(!length);
+		break;
 	default:
 		ABORT();
 	}
-	if (!db_encrypt(c, io_buf, bc, sizeof(*hdr) + length))
+	size = db_encrypt(c, io_buf, bc, sizeof(*hdr) + length,
+	    log ? &state : NULL);
+	ok = size >= 0 && storage_write_block(io_buf, n);
+	if (ok)
+		cache_put(c, n, io_buf, bc, sizeof(*hdr) + length, size,
+		    &state);
+	else
+		cache_forget(n);
+	memset(bc, 0, sizeof(*hdr) + length);
+	return ok;
+}
+
+
+bool block_write(const struct dbcrypt *c, enum block_type type, uint16_t seq,
+    const void *payload, unsigned length, unsigned n)
+{
+	return do_block_write(c, type, seq, payload, length, 0, n);
+}
+
+
+bool block_write_log(const struct dbcrypt *c, enum block_type type,
+    uint16_t seq, const void *payload, unsigned length, unsigned n)
+{
+	return do_block_write(c, type, seq, payload, length, 1, n);
+}
+
+
+bool block_append(const struct dbcrypt *c, const void *record, unsigned len,
+    unsigned n)
+{
+	const uint8_t *b;
+	bool ok;
+
+	assert(n >= RESERVED_BLOCKS);
+	assert(n < storage_blocks());
+
+	cache_forget_log(n);
+	b = storage_map_block(n);
+	if (!b) {
+		if (!storage_read_block(io_buf, n))
+			return 0;
+		b = io_buf;
+	}
+	if (!db_log_append(c, bc, b, record, len))
 		return 0;
-	memset(bc, 0, sizeof(bc));
-	return storage_write_block(io_buf, n);
+	/* "bc" only has the bits of the new record cleared */
+	ok = storage_write_block(bc, n);
+	memset(bc, 0, storage_block_size());
+	return ok;
 }
 
 
@@ -150,6 +564,25 @@ bool block_delete(unsigned n)
 	assert(n >= RESERVED_BLOCKS);
 	assert(n < storage_blocks());
 
-	memset(io_buf, 0, sizeof(io_buf));
+	cache_forget(n);
+	memset(io_buf, 0, storage_block_size());
 	return storage_write_block(io_buf, n);
 }
+
+
+bool block_tag(void *tag, unsigned n)
+{
+	const uint8_t *b;
+
+	assert(n >= RESERVED_BLOCKS);
+	assert(n < storage_blocks());
+
+	b = storage_map_block(n);
+	if (!b) {
+		if (!storage_read_block(io_buf, n))
+			return 0;
+		b = io_buf;
+	}
+	memcpy(tag, b + NONCE_OFFSET, BLOCK_TAG_SIZE);
+	return 1;
+}
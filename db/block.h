@@ -17,30 +17,46 @@
 #include "storage.h"
 
 
-#define	PAD_BLOCKS	8
-#define	RESERVED_BLOCKS	PAD_BLOCKS
+/*
+ * The pads occupy the first PAD_UNITS erase units. The number of blocks this
+ * corresponds to depends on the block size. The hints where to find the index
+ * are kept in the blocks after the pad block (see secrets.c). If a block fills
+ * the whole erase unit, there are no such blocks, and the hints get an erase
+ * unit of their own, after the pads.
+ */
+
+#define	PAD_UNITS	2
+#define	PAD_BLOCKS	(PAD_UNITS * storage_erase_size())
+#define	HINT_BLOCKS	(storage_erase_size() == 1 ? 1 : 0)
+#define	RESERVED_BLOCKS	(PAD_BLOCKS + HINT_BLOCKS)
 
 /*
  * Block structure:
  *
  * Offset
  * |	Size
- * 0	32	Writer's public key
+ * 0	32	Writer's public key (MSB of the last byte set: version 2)
  * 32	24	Nonce (all-zero: block is deleted)
  * 56	For each reader:
  *	32	Encrypted record key
+ *	4	Encrypted hint (only in version 2, see dbcrypt.c)
  * Encrypted data:
  *	16	Hash
- *	*	Payload (zero-padded to fill the block)
- *	1	  Content type (empty, data)
+ *	*	Payload (zero-padded to fill the block or the space before
+ *		the log area)
+ *	1	  Content type (empty, data, first, next)
  *	1	  Reserved (set to zero when writing, ignore when reading)
  *	2	  Sequence number (little-endian)
+ * Log area (optional, see dbcrypt.c):
+ *	*	Records (length byte and secretbox), then all-ones
  */
 
 enum content_type {
 	ct_empty		= 3,	/* the block is allocated but does not
 					   contain valid data */
 	ct_data			= 4,	/* only block in a sequence */
+	ct_first		= 10,	/* first block of a sequence */
+	ct_next			= 11,	/* any other block of a sequence */
 };
 
 /*
@@ -56,6 +72,12 @@ enum block_type {
 	bt_empty	= ct_empty,
 	bt_data		= ct_data,
 	bt_settings	= 5,	/* block contains settings */
+	bt_index	= 6,	/* block contains (part of) the index */
+	bt_wear		= 7,	/* block contains erase counts */
+	bt_patch	= 8,	/* log area contains changes to entries */
+	bt_packed	= 9,	/* block contains several small entries */
+	bt_first	= ct_first,
+	bt_next		= ct_next,
 };
 
 struct block_header {
@@ -66,7 +88,16 @@ struct block_header {
 
 
 /* shared with secrets.c */
-extern PSRAM_NOINIT uint8_t io_buf[STORAGE_BLOCK_SIZE];
+extern PSRAM_NOINIT uint8_t io_buf[STORAGE_BLOCK_MAX];
+
+
+/*
+ * block_safe_payload returns a payload size that can be written with the
+ * current block size without having to worry about the number of readers. With
+ * blocks of 1 kB or more, this holds for up to DB_MAX_READERS readers. Smaller
+ * blocks fit fewer readers, and block_write fails if there are too many.
+ */
+unsigned block_safe_payload(void);
 
 
 /*
@@ -86,8 +117,51 @@ extern PSRAM_NOINIT uint8_t io_buf[STORAGE_BLOCK_SIZE];
 enum block_type block_read(const struct dbcrypt *c, uint16_t *seq,
     void *payload, unsigned *payload_len, unsigned n);
 
+/*
+ * block_read_log is like block_read, but also returns the state of the
+ * block's log area in "log".
+ */
+enum block_type block_read_log(const struct dbcrypt *c, uint16_t *seq,
+    void *payload, unsigned *payload_len, struct db_log *log, unsigned n);
+
+/*
+ * Pipelined reading of consecutive blocks: block_pipe_begin starts reading the
+ * blocks from "from" to "to" - 1. block_pipe_next then returns them one by
+ * one, with the same semantics as block_read. Blocks are read in batches of
+ * BLOCK_PIPE_BATCH, and while the caller processes one batch, the following
+ * ones are already being read. block_pipe_end must be called when done, also
+ * if not all blocks were retrieved. Only one pipe can be active at a time.
+ */
+
+#define	BLOCK_PIPE_BATCH	4	/* blocks per read request */
+#define	BLOCK_PIPE_BATCHES	2	/* read requests in flight */
+
+struct block_pipe {
+	bool mapped;		/* decrypt directly from storage_map_block */
+	unsigned from;
+	unsigned next;		/* next block to return */
+	unsigned ready;		/* first block that has not been read yet */
+	unsigned submitted;	/* next block to submit for reading */
+	unsigned end;
+};
+
+void block_pipe_begin(struct block_pipe *p, unsigned from, unsigned to);
+enum block_type block_pipe_next(struct block_pipe *p, const struct dbcrypt *c,
+    uint16_t *seq, void *payload, unsigned *payload_len);
+void block_pipe_end(struct block_pipe *p);
+
 bool block_validate(const struct dbcrypt *c, unsigned n);
 
+/*
+ * block_read, block_read_log, block_validate, and block_write keep the
+ * decrypted content of recently used blocks in a small cache.
+ * block_cache_clear removes (and zeroes) all entries, e.g., when closing the
+ * database. block_cache_stats returns how often a lookup in the cache
+ * succeeded and failed.
+ */
+void block_cache_clear(void);
+void block_cache_stats(unsigned *hits, unsigned *misses);
+
 /*
  * block_write requires the block to be erased. Note that attempting to write
  * to a block that is not completelly erased is likely to produce an invalid
@@ -96,6 +170,28 @@ bool block_validate(const struct dbcrypt *c, unsigned n);
 bool block_write(const struct dbcrypt *c, enum block_type type, uint16_t seq,
     const void *payload, unsigned length, unsigned n);
 
+/*
+ * block_write_log also leaves the space not used by the payload as a log area,
+ * to which block_append can later add records of up to DB_MAX_RECORD bytes,
+ * without erasing the block. block_append returns 0 if the block has no log
+ * area, if the log is full, or if writing failed. The record may then still
+ * have been partially written, but is ignored when reading.
+ */
+bool block_write_log(const struct dbcrypt *c, enum block_type type,
+    uint16_t seq, const void *payload, unsigned length, unsigned n);
+bool block_append(const struct dbcrypt *c, const void *record, unsigned len,
+    unsigned n);
+
 bool block_delete(unsigned n);
 
+/*
+ * block_tag returns the first BLOCK_TAG_SIZE bytes of the block's nonce. Since
+ * each write uses a new random nonce, this tells different contents of the
+ * same block apart.
+ */
+
+#define	BLOCK_TAG_SIZE	4
+
+bool block_tag(void *tag, unsigned n);
+
 #endif /* !BLOCK_H */
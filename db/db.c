@@ -22,1162 +22,5050 @@
 #include "storage.h"
 #include "block.h"
 #include "settings.h"
+#include "secrets.h"
 #include "db.h"
 
 
 static bool update_entry(struct db_entry *de, unsigned new);
+static bool patch_apply(struct db_entry *de);
+static bool set_id(struct db_entry *parent, struct db_entry *de,
+    const char *name, bool (*fn)(struct db_entry *de, enum field_type type,
+    const void *data, unsigned len));
+static bool tree_id_update(struct db *db, struct db_entry *dir);
+static unsigned tsort_dir(struct db_entry **anchor);
+static unsigned sort_dir(struct db *db, struct db_entry *dir);
 
 
-PSRAM_NOINIT uint8_t payload_buf[STORAGE_BLOCK_SIZE];
+PSRAM_NOINIT uint8_t payload_buf[STORAGE_BLOCK_MAX];
 	// @@@ beyond-worst-case size
 
+/* records from log areas */
+static PSRAM_NOINIT uint8_t log_buf[STORAGE_BLOCK_MAX];
+
+/* new content of a pack (see "Packed entries" below) */
+#define	PACK_SIZE	512	/* maximum payload of a pack */
+
+static PSRAM_NOINIT uint8_t pack_buf[PACK_SIZE];
+
 struct db main_db;
 const enum field_type order2ft[] = {
-    ft_end, ft_id, ft_prev, ft_dir, ft_user, ft_email, ft_pw, ft_pw2,
-    ft_hotp_secret, ft_hotp_counter, ft_totp_secret, ft_comment };
+    ft_end, ft_id, ft_prev, ft_dir, ft_parent, ft_user, ft_email, ft_pw,
+    ft_pw2, ft_hotp_secret, ft_hotp_counter, ft_totp_secret, ft_comment };
 uint8_t ft2order[ARRAY_ENTRIES(order2ft)];
 const unsigned field_types = sizeof(ft2order);
 
 
-/* --- Get an erased block, erasing if needed ------------------------------ */
+/* --- Index invalidation -------------------------------------------------- */
 
 
-static int get_erased_block(struct db *db)
+/*
+ * The index (see below) describes the database as it is in storage. We
+ * therefore delete it before making any change. Only the first part really
+ * matters, since the index is only found through it. Any other parts we fail
+ * to delete are cleaned up by the next full scan.
+ */
+
+static bool invalidate_index(struct db *db)
 {
-	unsigned erase_size = storage_erase_size();
-	int n;
+	unsigned i;
 
-	while (1) {
-		n = span_pull_one(&db->erased);
-		if (n >= 0) {
-			db->stats.erased--;
-			break;
-		}
-		n = span_pull_erase_block(&db->empty, erase_size);
-		if (n >= 0) {
-			db->stats.empty -= erase_size;
-			if (storage_erase_blocks(n, erase_size)) {
-				db->stats.erased += erase_size;
-				continue;
-			}
-			db->stats.error += erase_size;
-		}
-		n = span_pull_erase_block(&db->deleted, erase_size);
-		if (n >= 0) {
-			db->stats.deleted -= erase_size;
-			if (storage_erase_blocks(n, erase_size)) {
-				db->stats.erased += erase_size;
-				continue;
+	for (i = 0; i != db->index_parts; i++) {
+		unsigned n = db->index_blocks[i];
+
+		db->stats.special--;
+		if (block_delete(n)) {
+			span_add(&db->deleted, n, 1);
+			db->stats.deleted++;
+		} else {
+			if (!i) {
+				db->stats.special++;
+				return 0;
 			}
-			db->stats.error += erase_size;
+			db->stats.error++;
 		}
-		return -1;
 	}
-	return n;
+	db->index_parts = 0;
+	return 1;
 }
 
 
-/* --- Helper functions ---------------------------------------------------- */
-
+/* --- Erase counts -------------------------------------------------------- */
 
-static void free_field(struct db_field *f)
-{
-	free(f->data);
-	free(f);
-}
 
+/*
+ * We count how often each erase unit has been erased, and use the counts to
+ * spread erases evenly (see "Wear leveling" below).
+ */
 
-static void free_fields(struct db_entry *de)
+static uint32_t *wear_counts(struct db *db)
 {
-	while (de->fields) {
-		struct db_field *this = de->fields;
+	unsigned units = db->stats.total / storage_erase_size();
 
-		de->fields = this->next;
-		free_field(this);
+	if (!db->wear) {
+		db->wear = alloc_type_n(uint32_t, units);
+		memset(db->wear, 0, units * sizeof(uint32_t));
 	}
+	return db->wear;
 }
 
 
-static void free_entry(struct db_entry *de)
-{
-	free(de->name);
-	free_fields(de);
-	free(de);
-}
+/* --- Get an erased block, erasing if needed ------------------------------ */
 
 
 /*
- * @@@ We return NULL in two cases:
- * 1) if the parent is the root directory, and
- * 2) if we don't find "de" in the tree.
- * The latter should be a fatal error.
+ * Erase the least worn erase unit that contains only empty or deleted blocks.
+ * We don't need to invalidate the index for this: blocks the index considers
+ * deleted or empty may just as well be erased, and the next db_open will
+ * simply erase them again when needed.
  */
 
-static struct db_entry *find_parent(const struct db *db,
-    struct db_entry *dir, const struct db_entry *de)
+static bool erase_unit(struct db *db)
 {
-	struct db_entry *e, *parent;
+	unsigned erase_size = storage_erase_size();
+	uint32_t *counts = wear_counts(db);
+	int empty, deleted, n;
 
-	for (e = dir ? dir->children : db->entries; e; e = e->next) {
-		if (e == de)
-			return dir;
-		parent = find_parent(db, e, de);
-		if (parent)
-			return parent;
+	while (1) {
+		empty = span_pick_unit(db->empty, counts, 1, 0, -1);
+		deleted = span_pick_unit(db->deleted, counts, 1, 0, -1);
+		if (empty >= 0 && (deleted < 0 ||
+		    counts[empty / erase_size] <= counts[deleted / erase_size])) {
+			n = empty;
+			span_remove(&db->empty, n, erase_size);
+			db->stats.empty -= erase_size;
+		} else {
+			n = deleted;
+			if (n < 0)
+				return 0;
+			span_remove(&db->deleted, n, erase_size);
+			db->stats.deleted -= erase_size;
+		}
+		if (storage_erase_blocks(n, erase_size)) {
+			counts[n / erase_size]++;
+			db->wear_dirty++;
+			db->wear_balanced = 0;
+			span_add(&db->erased, n, erase_size);
+			db->stats.erased += erase_size;
+			return 1;
+		}
+		db->stats.error += erase_size;
 	}
-	return NULL;
 }
 
 
-bool db_is_descendent(const struct db_entry *dir, const struct db_entry *de)
+/*
+ * Blocks are placed according to how often we expect them to be rewritten.
+ * "Hot" blocks (HOTP counters, settings, and the index and erase counts) go
+ * to the least worn erase unit with erased blocks, "cold" blocks (everything
+ * else) to the most worn one. Each class allocates from its own unit until it
+ * is used up, so that units of hot blocks become fully deleted quickly and can
+ * be erased without first moving live cold blocks out of the way.
+ */
+
+enum placement {
+	pl_hot,
+	pl_cold,
+};
+
+
+static int get_erased_block(struct db *db, enum placement pl)
 {
-	const struct db_entry *e;
+	unsigned erase_size = storage_erase_size();
+	int *unit = pl == pl_hot ? &db->hot_unit : &db->cold_unit;
+	int other = pl == pl_hot ? db->cold_unit : db->hot_unit;
+	int n;
 
-	for (e = dir ? dir->children : dir->db->entries; e; e = e->next) {
-		if (e == de)
-			return 1;
-		if (e->children && db_is_descendent(e->children, de))
-			return 1;
+	if (!invalidate_index(db))
+		return -1;
+	while (1) {
+		if (*unit >= 0) {
+			n = span_pull_range(&db->erased, *unit, erase_size);
+			if (n >= 0) {
+				db->stats.erased--;
+				return n;
+			}
+		}
+		*unit = span_pick_unit(db->erased, wear_counts(db), 0,
+		    pl == pl_cold, other);
+		/* share the other class' unit rather than erase */
+		if (*unit < 0)
+			*unit = span_pick_unit(db->erased, wear_counts(db), 0,
+			    pl == pl_cold, -1);
+		if (*unit >= 0)
+			continue;
+		if (!erase_unit(db))
+			return -1;
+		db->stats.fg_erases++;
 	}
-	return 0;
 }
 
 
-/* --- Fields of database entries ------------------------------------------ */
-
+/*
+ * Delete block "n", whose content has been superseded by a new block. While
+ * db_commit writes entries, we only remember the block, and delete it after
+ * all the new blocks have been written.
+ */
 
-static bool add_field(struct db_entry *de, enum field_type type,
-    const void *data, unsigned len)
+static bool retire_block(struct db *db, unsigned n)
 {
-	struct db_field **anchor;
-	struct db_field *f;
-
-	for (anchor = &de->fields; *anchor; anchor = &(*anchor)->next)
-		if ((*anchor)->type > type)
-			break;
-	f = alloc_type(struct db_field);
-	f->type = type;
-	f->len = len;
-	f->data = len ? alloc_size(len) : NULL;
-	memcpy(f->data, data, len);
-	f->next = *anchor;
-	*anchor = f;
-	de->db->generation++;
+	if (db->committing) {
+		span_add(&db->retired, n, 1);
+		return 1;
+	}
+	if (!block_delete(n))
+		return 0;
+	span_add(&db->deleted, n, 1);
+	db->stats.deleted++;
 	return 1;
 }
 
 
-bool db_change_field(struct db_entry *de, enum field_type type,
-    const void *data, unsigned size)
-{
-	struct db *db = de->db;
-	struct db_field **anchor;
-	struct db_field *f;
-	int new = -1;
-
-	if (debugging)
-		printf("db_change_field: %s.%u -> \"%.*s\"\n",
-		    de->name, type, size, (char *) data);
-	if (!de->defer) {
-		new = get_erased_block(db);
-		if (new < 0)
-			return 0;
-	}
+/* --- Helper functions ---------------------------------------------------- */
 
-	for (anchor = &de->fields; *anchor; anchor = &(*anchor)->next)
-		if ((*anchor)->type >= type)
-			break;
-	if (*anchor && (*anchor)->type == type) {
-		f = *anchor;
-		free(f->data);
-	} else {
-		f = alloc_type(struct db_field);
-		f->type = type;
-		f->next = *anchor;
-		*anchor = f;
-	}
-	f->len = size;
-	f->data = size ? alloc_size(size) : NULL;
-	memcpy(f->data, data, size);
 
-	switch (type) {
-	case ft_id:
-		free(de->name);
+static inline void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
 
-		/*
-		 * It is safe for the caller to use de->name as "data" in the
-		 * call to db_change_field, since the new content is copied
-		 * before the free(3) above. We must use f->data (and not
-		 * "data") to avoid accessing deallocated memory.
-		 */
-		const void *z = memrchr(f->data, 0, size);
 
-		if (z) {
-			unsigned name_len = size - (z + 1 - f->data);
+static inline uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
 
-			de->name = alloc_size(name_len + 1);
-			memcpy(de->name, z + 1, name_len);
-			de->name[name_len] = 0;
-		} else {
-			de->name = alloc_size(size + 1);
-			memcpy(de->name, f->data, size);
-			de->name[size] = 0;
-		}
-		db_tsort(db);
-		break;
-	case ft_prev:
-		db_tsort(db);
-		break;
-	default:
-		db->generation++;
-		break;
-	}
 
-	return de->defer || update_entry(de, new);
+static inline void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
 }
 
 
-bool db_delete_field(struct db_entry *de, struct db_field *f)
+static inline uint32_t get32(const uint8_t *p)
 {
-	struct db *db = de->db;
-	struct db_field **anchor;
-	int new = -1;
+	return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
 
-	if (!de->defer) {
-		new = get_erased_block(db);
-		if (new < 0)
-			return 0;
-	}
 
-	for (anchor = &de->fields; *anchor != f; anchor = &(*anchor)->next);
-	*anchor = f->next;
-	free_field(f);
+/*
+ * Entries and fields come from the slabs of the database, so db_close can
+ * release them all at once. Names and field data are kept in the entry or the
+ * field if they are short enough, and are allocated separately otherwise.
+ */
+
+#define	ENTRY_SLAB	16	/* entries per slab chunk */
+#define	FIELD_SLAB	32	/* fields per slab chunk */
 
-	/* just in case we deleted ft_prev */
-	if (!db_tsort(db))
-		db->generation++;
 
-	return de->defer || update_entry(de, new);
+static void set_name(struct db_entry *de, const char *name, unsigned len)
+{
+	de->name = len < sizeof(de->name_buf) ?
+	    de->name_buf : alloc_size(len + 1);
+	memcpy(de->name, name, len);
+	de->name[len] = 0;
 }
 
 
-static bool patch_one(struct db_entry *de, const char *new_prefix,
-    unsigned new_prefix_len, unsigned old_prefix_len)
+static void free_name(struct db_entry *de)
 {
-	const struct db_field *id = de->fields;
-	bool ok;
-
-	assert(id->type == ft_id);
-	assert(id->len >= old_prefix_len);
-	if (id->len == old_prefix_len) {
-		ok = db_change_field(de, ft_id, new_prefix, new_prefix_len);
-	} else {
-		unsigned new_len =
-		    id->len - old_prefix_len + new_prefix_len;
-		char *tmp;
-
-		assert(!((const uint8_t *) id->data)[old_prefix_len]);
-		tmp = alloc_size(new_len);
-		memcpy(tmp, new_prefix, new_prefix_len);
-		memcpy(tmp + new_prefix_len, id->data + old_prefix_len,
-		    id->len - old_prefix_len);
-		ok = db_change_field(de, ft_id, tmp, new_len);
-		free(tmp);
-	}
-	return ok;
+	if (de->name != de->name_buf)
+		free(de->name);
 }
 
 
-static bool patch_recursive(struct db_entry *de, const char *new_prefix,
-    unsigned new_prefix_len, unsigned old_prefix_len)
+static struct db_entry *alloc_entry(struct db *db, const char *name,
+    unsigned len)
 {
-	struct db_entry *e;
-
-#if 0
-	const struct db_field *id = de->fields;
+	struct db_entry *de = slab_alloc(&db->entry_slab);
 
-	debug("patch_recursive %s: %.*s -> %.*s,  %u -> %u\n",
-	    de->name, id->len, (const char *) id->data, new_prefix_len,
-	    new_prefix, old_prefix_len, new_prefix_len);
-#endif
-	if (!patch_one(de, new_prefix, new_prefix_len, old_prefix_len))
-		return 0;
-	for (e = de->children; e; e = e->next)
-		if (!patch_recursive(e, new_prefix, new_prefix_len,
-		    old_prefix_len))
-			return 0;
-	return 1;
+	memset(de, 0, sizeof(*de));
+	de->db = db;
+	set_name(de, name, len);
+	return de;
 }
 
 
-bool db_rename(struct db_entry *de, const char *name)
+static struct db_field *alloc_field(struct db *db, enum field_type type)
 {
-	const struct db_field *id = de->fields;
-	unsigned name_len = strlen(name);
-	const void *z;
-	bool ok;
+	struct db_field *f = slab_alloc(&db->field_slab);
 
-	assert(id->type == ft_id);
-	z = memrchr(id->data, 0, id->len);
-	if (!z)
-		return patch_recursive(de, name, name_len, id->len);
-
-	unsigned pos = z - id->data + 1;
-	unsigned new_len = pos + name_len;
-	char *tmp = alloc_size(new_len);
-
-	assert(pos > 1);
-	assert(id->len > pos);
-	memcpy(tmp, id->data, pos);
-	memcpy(tmp + pos, name, new_len);
-	ok = patch_recursive(de, tmp, new_len, id->len);
-	free(tmp);
-	return ok;
+	f->type = type;
+	return f;
 }
 
 
-struct db_field *db_field_find(const struct db_entry *de, enum field_type type)
+static void free_data(const struct db_field *f)
 {
-	struct db_field *f;
-
-	for (f = de->fields; f; f = f->next)
-		if (f->type == type)
-			return f;
-	return NULL;
+	if (f->data != f->buf)
+		free(f->data);
 }
 
 
-/* --- Database entries: storage operations -------------------------------- */
+static void free_field(struct db *db, struct db_field *f)
+{
+	free_data(f);
+	slab_free(&db->field_slab, f);
+}
 
 
-static bool write_entry(const struct db_entry *de)
+static void free_fields(struct db_entry *de)
 {
-	const void *end = payload_buf + sizeof(payload_buf);
-	uint8_t *p = payload_buf;
-	const struct db_field *f;
-	bool ok;
+	while (de->fields) {
+		struct db_field *this = de->fields;
 
-	assert(de->block);
-	memset(payload_buf, 0, sizeof(payload_buf));
-	for (f = de->fields; f; f = f->next) {
-		if ((const void *) p + f->len + 2 > end) {
-			debug("write_entry: %p + %u + 2 > %p\n",
-			    p, f->len, end);
-			return 0;
-		}
-		*p++ = f->type;
-		*p++ = f->len;
-		memcpy(p, f->data, f->len);
-		p += f->len;
+		de->fields = this->next;
+		free_field(de->db, this);
 	}
-	ok = block_write(de->db->c, bt_data, de->seq, payload_buf,
-	    p - payload_buf, de->block);
-	if (ok)
-		de->db->stats.data++;
-	return ok;
 }
 
 
-static bool update_entry(struct db_entry *de, unsigned new)
+/* list of loaded entries, for evicting fields (see db_entry_load) */
+
+static void lru_unlink(struct db_entry *de)
 {
 	struct db *db = de->db;
-	unsigned old = de->block;
-
-	old = de->block;
-	de->block = new;
-	de->seq++;
 
-	if (!write_entry(de)) {
-		// @@@ complain more if block_delete fails ?
-		if (block_delete(new)) {
-			span_add(&db->deleted, new, 1);
-			db->stats.deleted++;
-		}
-		return 0;
-	}
-	// @@@ complain if block_delete fails ?
-	if (old && block_delete(old)) {
-		span_add(&db->deleted, old, 1);
-		db->stats.data--;
-		db->stats.deleted++;
-	}
-	return 1;
+	if (!de->lru_prev && db->lru != de)
+		return;
+	if (de->lru_prev)
+		de->lru_prev->lru_next = de->lru_next;
+	else
+		db->lru = de->lru_next;
+	if (de->lru_next)
+		de->lru_next->lru_prev = de->lru_prev;
+	else
+		db->lru_tail = de->lru_prev;
+	de->lru_prev = de->lru_next = NULL;
+	db->loaded--;
 }
 
 
-bool db_entry_defer_update(struct db_entry *de, bool defer)
+static void lru_touch(struct db_entry *de)
 {
-	if (!defer) {
-		int new;
+	struct db *db = de->db;
 
-		new = get_erased_block(de->db);
-		if (new < 0)
-			return 0;
-		if (!update_entry(de, new))
-			return 0;
-	}
-	de->defer = defer;
-	return 1;
+	if (db->lru == de)
+		return;
+	lru_unlink(de);
+	de->lru_next = db->lru;
+	if (db->lru)
+		db->lru->lru_prev = de;
+	else
+		db->lru_tail = de;
+	db->lru = de;
+	db->loaded++;
 }
 
 
-/* --- Database entries: creation  ----------------------------------------- */
+static void free_entry(struct db_entry *de)
+{
+	lru_unlink(de);
+	free_name(de);
+	free_fields(de);
+	free(de->parts);
+	free(de->names.bucket);
+	slab_free(&de->db->entry_slab, de);
+}
+
 
 /*
- * Sorting: "prev" establishes a partial order [1]. The idea is that entries
- * are sorted alphabetically, but that this sort order can be overridden by
- * setting "prev".
- *
- * The algorithm below does this for any new entry that is added, where the new
- * entry may have a pointer (prev) to the previous entry. However, this is only
- * valid under the following conditions:
- * - the entry referenced by "prev" already exists when the new entry is added,
- *   and
- * - no existing entries reference the new entry as their "prev" entry.
- *
- * If these conditions are not met, we could aim for an alphabetic order, and
- * then perform a stable [2] topological sort [1] on the resulting list.
- * "Stable" means that entries on which the partial order imposes no ordering,
- * either directly or via other entries, are left in their original order with
- * respect to each other.
- *
- * Some practical considerations:
- * https://stackoverflow.com/q/11230881/11496135
- *
- * Note: the conditions of this algorithm are met if adding a new entry for
- * which no "prev" references exist in the database. However, already deleting
- * an old entry and creating a new one with the same name would violate this
- * condition. (I.e., when deleting entries, we don't try to maintain
- * referential integrity [3] by also removing all "prev" entries pointing to
- * it, which can cause the corresponding ordering relations to "come back"
- * later.)
- *
- * Also, given that entries need to be copied when making changes, including
- * automatic ones, like incrementing the HOTP counter, and thus generally move
- * around, we can easily end up with a database where entries are stored in a
- * sequence where the current algorithm fails to produce the expected results.
- *
- * [1] https://en.wikipedia.org/wiki/Topological_sorting#Relation_to_partial_orders
- * [2] https://en.wikipedia.org/wiki/Sorting_algorithm#Stability
- * [3] https://en.wikipedia.org/wiki/Referential_integrity
+ * Fields are stored as type (8), length (8), data. Fields longer than 255
+ * bytes are split into several such items, all of which but the last have
+ * FT_MORE set in the type.
  */
 
+#define	FT_MORE	0x80
+
+
+static const void *tlv_item(const void **p, const void *end,
+    enum field_type *type, unsigned *len)
+{
+	const uint8_t *q = *p;
+
+	if (*p + 2 > end)
+		return NULL;
+	if (*q == ft_end)
+		return NULL;
+	*type = *q++;
+	*len = *q++;
+	*p = q + *len;
+	if (*p > end)
+		return NULL;
+	return q;
+}
+
+
 /*
- * Update:
- * new_entry only sorts alphabetically. We now have db_tsort for proper
- * topological sorting.
+ * Entries in packs: seq (16), length (16), fields. A length of zero ends the
+ * list.
  */
 
-static struct db_entry *new_entry(struct db *db, struct db_entry *dir,
-    const char *name)
+static const void *pack_item(const void **p, const void *end,
+    uint16_t *seq, unsigned *len)
 {
-	struct db_entry *de, **anchor;
+	const uint8_t *q = *p;
 
-	de = alloc_type(struct db_entry);
-	memset(de, 0, sizeof(*de));
-	de->db = db;
-	for (anchor = dir ? &dir->children : &db->entries; *anchor;
-	    anchor = &(*anchor)->next)
-		if (strcmp((*anchor)->name, name) > 0)
-			break;
-	de->next = *anchor;
-	*anchor = de;
-	return de;
+	if (*p + 4 > end)
+		return NULL;
+	*seq = get16(q);
+	*len = get16(q + 2);
+	if (!*len)
+		return NULL;
+	*p = q + 4 + *len;
+	if (*p > end)
+		return NULL;
+	return q + 4;
 }
 
 
-static bool id_to_cwd(struct db_entry *parent, struct db_entry *de,
-    bool (*fn)(struct db_entry *de, enum field_type type,
-    const void *data, unsigned len))
+/*
+ * Directories can have a uid in their ft_dir field. Entries in such a
+ * directory only have their name as id, and refer to the directory with an
+ * ft_parent field, so that renaming or moving the directory does not change
+ * them. Entries in a directory without uid have their whole path as id.
+ *
+ * field_uid returns the uid in field "type" of "de", and tlv_uid the one in
+ * the fields at "p". Both return 0 if there is none.
+ */
+
+static uint32_t field_uid(const struct db_entry *de, enum field_type type)
 {
-	unsigned name_len = strlen(de->name);
-	bool ok;
+	const struct db_field *f;
 
-	if (parent) {
-		struct db_field *id = parent->fields;
-		unsigned path_len = id->len + 1 + name_len;
-		char *tmp = alloc_size(path_len);
-
-		assert(id);
-		assert(id->type == ft_id);
-		memcpy(tmp, id->data, id->len);
-		tmp[id->len] = 0;
-		memcpy(tmp + id->len + 1, de->name, name_len);
-		ok = fn(de, ft_id, tmp, path_len);
-		free(tmp);
-	} else {
-		/*
-		 * db_change_field copies the new id before deallocating the 
-		 * old name.
-		 */
-		ok = fn(de, ft_id, de->name, name_len);
-	}
-	return ok;
+	for (f = de->fields; f; f = f->next)
+		if (f->type == type)
+			return f->len == 4 ? get32(f->data) : 0;
+	return 0;
 }
 
 
-struct db_entry *db_new_entry(struct db *db, const char *name)
+static uint32_t tlv_uid(const void *p, const void *end, enum field_type type)
 {
-	struct db_entry *de;
-	int new;
+	enum field_type t;
+	unsigned len;
+	const void *q;
 
-	new = get_erased_block(db);
-	if (new < 0)
-		return NULL;
-	db->generation++;
-	de = new_entry(db, db->dir, name);
-	de->name = stralloc(name);
-	de->block = new;
-	rnd_bytes(&de->seq, sizeof(de->seq));
+	while ((q = tlv_item(&p, end, &t, &len)))
+		if (t == type)
+			return len == 4 ? get32(q) : 0;
+	return 0;
+}
 
-	id_to_cwd(db->dir, de, add_field);
 
-	db_tsort(db);
-	if (write_entry(de))
-		return de;
-	// @@@ complain
-	if (block_delete(new)) {
-		span_add(&db->deleted, new, 1);
-		db->stats.deleted++;
-	}
-	return NULL;
+/*
+ * Return 1 if the fields at "p" have the same id (and parent) as "de".
+ */
+
+static bool same_id(const struct db_entry *de, const void *p, unsigned len)
+{
+	const struct db_field *id = de->fields;
+	const void *end = p + len;
+	enum field_type type;
+	unsigned id_len;
+	const void *q;
+
+	q = tlv_item(&p, end, &type, &id_len);
+	return q && type == ft_id && id && id->type == ft_id &&
+	    id->len == id_len && !memcmp(q, id->data, id_len) &&
+	    tlv_uid(p, end, ft_parent) == field_uid(de, ft_parent);
 }
 
 
-struct db_entry *db_dummy_entry(struct db *db, const char *name,
-    const char *prev)
+static const void *pack_find(const struct db_entry *de, const void *payload,
+    unsigned size, unsigned *len)
 {
-	struct db_entry *de;
+	const void *p = payload;
+	const void *q;
+	uint16_t seq;
 
-	db->generation++;
-	de = new_entry(db, db->dir, name);
-	de->name = stralloc(name);
-	de->block = -1;
-	de->defer = 1;
-	id_to_cwd(db->dir, de, add_field);
+	while ((q = pack_item(&p, payload + size, &seq, len)))
+		if (seq == de->seq && same_id(de, q, *len))
+			return q;
+	return NULL;
+}
 
-	if (prev)
-		add_field(de, ft_prev, prev, strlen(prev));
-	return de;
+
+/*
+ * Entries that don't fit into one block are stored as a chain: a bt_first
+ * block followed by up to DB_MAX_PARTS bt_next blocks ("parts"). Each block
+ * begins with the chain id (32) and a count (8), followed by fields. The count
+ * is the number of parts in bt_first, and the position of the part, starting
+ * at 1, in bt_next. (See "Database entries: chains" below.)
+ */
+
+#define	CHAIN_HDR	5
+
+
+static bool chain_header(const struct db_entry *de, const uint8_t *p,
+    unsigned size, unsigned i)
+{
+	return size >= CHAIN_HDR && get32(p) == de->chain &&
+	    p[4] == (i ? i : de->n_parts);
 }
 
 
-/* --- Database entries: sorting ------------------------------------------- */
+bool db_is_descendent(const struct db_entry *dir, const struct db_entry *de)
+{
+	const struct db_entry *e;
+
+	for (e = de ? de->parent : NULL; e; e = e->parent)
+		if (e == dir)
+			return 1;
+	return 0;
+}
 
 
-static unsigned tsort_dir(struct db_entry **anchor)
+/*
+ * find_anchor returns the pointer to "de" in the list of its directory, or
+ * NULL if "de" is not in the tree.
+ */
+
+static struct db_entry **find_anchor(struct db_entry *de)
 {
-	struct tmp {
-		struct db_entry *in;
-		const struct db_entry *prev;
-		struct db_entry *out;
-	} *tmp, *t, *t2;
-	struct db_entry *e, *e2;
-	unsigned total = 0;
-	unsigned n = 0;
-	unsigned i;
+	struct db_entry **anchor;
 
-	for (e = *anchor; e; e = e->next) {
-		if (e->children)
-			total += tsort_dir(&e->children);
-		total++;
-		n++;
-	}
-	if (!n)
-		return 0;
+	for (anchor = de->parent ? &de->parent->children : &de->db->entries;
+	    *anchor; anchor = &(*anchor)->next)
+		if (*anchor == de)
+			return anchor;
+	return NULL;
+}
 
-	/* allocate temporary variables */
-	tmp = t = alloc_type_n(struct tmp, n);
-	for (e = *anchor; e; e = e->next) {
-		struct db_field *f;
 
-		t->in = e;
-		t->prev = NULL;
-		for (f = e->fields; f; f = f->next)
-			if (f->type == ft_prev)
-				break;
-		if (f)
-			for (e2 = *anchor; e2; e2 = e2->next)
-				if (f->len == strlen(e2->name) &&
-				    !memcmp(f->data, e2->name, f->len)) {
-					t->prev = e2;
-					break;
-				}
-			/* ignore unmatched references */
-		t++;
-	}
+/* --- Name lookup --------------------------------------------------------- */
 
-	/*
-	 * Based on Kahn's algorithm
-	 * https://en.wikipedia.org/wiki/Topological_sorting#Kahn's_algorithm
-	 */
-	i = 0;
-	while (1) {
-		bool more = 0;
-		bool progress = 0;
 
-		for (t = tmp; t != tmp + n; t++) {
-			if (!t->in)
-				continue;
-			if (t->prev) {
-				more = 1;
-			} else {
-				progress = 1;
-				tmp[i].out = t->in;
-				i++;
-				for (t2 = tmp; t2 != tmp + n; t2++)
-					if (t2->prev == t->in)
-						t2->prev = NULL;
-				t->in = NULL;
-			}
-		}
-		if (!more)
-			break;
+/*
+ * Each directory, and the top level, has a hash table of the names of its
+ * entries. The table grows when it is full, so lookups take constant time on
+ * average. Entries are in the table of their directory while they are in the
+ * tree, but not while they are on db->pending.
+ */
 
-		/* break cycles */
-		if (!progress)
-			for (t = tmp; t != tmp + n; t++)
-				if (t->in && t->prev) {
-					t->prev = NULL;
-					break;
-				}
-	}
-	assert(i == n);
+#define	NAMES_MIN	8	/* initial number of buckets */
 
-	/* apply new order */
-	*anchor = tmp[0].out;
-	for (t = tmp; t != tmp + n; t++)
-		t->out->next = t + 1 == tmp + n ? NULL : t[1].out;
 
-	free(tmp);
+static uint32_t name_hash(const char *name, unsigned len)
+{
+	uint32_t h = 2166136261;	/* FNV-1a */
 
-	return total;
+	while (len--) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619;
+	}
+	return h;
 }
 
 
-unsigned db_tsort(struct db *db)
+static struct db_names *names_of(struct db *db, struct db_entry *dir)
 {
-	unsigned n;
+	return dir ? &dir->names : &db->names;
+}
 
-	n = tsort_dir(&db->entries);
-	if (n)
-		db->generation++;
-	return n;
+
+static void names_resize(struct db_names *t, unsigned size)
+{
+	struct db_entry **bucket = alloc_type_n(struct db_entry *, size);
+	unsigned i;
+
+	memset(bucket, 0, size * sizeof(struct db_entry *));
+	for (i = 0; i != t->size; i++)
+		while (t->bucket[i]) {
+			struct db_entry *e = t->bucket[i];
+			struct db_entry **b = bucket +
+			    (name_hash(e->name, strlen(e->name)) & (size - 1));
+
+			t->bucket[i] = e->name_next;
+			e->name_next = *b;
+			*b = e;
+		}
+	free(t->bucket);
+	t->bucket = bucket;
+	t->size = size;
 }
 
 
-/* --- Database entries: reordering ---------------------------------------- */
+static void names_add(struct db_names *t, struct db_entry *de)
+{
+	struct db_entry **b;
+
+	if (t->n >= t->size)
+		names_resize(t, t->size ? 2 * t->size : NAMES_MIN);
+	b = t->bucket + (name_hash(de->name, strlen(de->name)) & (t->size - 1));
+	de->name_next = *b;
+	*b = de;
+	t->n++;
+}
 
 
 /*
- * is_prev determines if "prev" is the immediate predecessor of "e". If "prev"
- * is NULL, we return "1" if "e" has no predecessor.
+ * names_remove returns 0 if "de" is not in the table.
  */
 
-static bool is_prev(const struct db_entry *prev, const struct db_entry *e)
+static bool names_remove(struct db_names *t, struct db_entry *de)
 {
-	const struct db_field *f = db_field_find(e, ft_prev);
+	struct db_entry **anchor;
 
-	if (!prev && !f)
-		return 1;
-	if (!prev || !f)
-		return 0;
-	if (strlen(prev->name) != f->len)
+	if (!t->size)
 		return 0;
-	return !memcmp(prev->name, f->data, f->len);
+	for (anchor = t->bucket +
+	    (name_hash(de->name, strlen(de->name)) & (t->size - 1));
+	    *anchor; anchor = &(*anchor)->name_next)
+		if (*anchor == de) {
+			*anchor = de->name_next;
+			de->name_next = NULL;
+			t->n--;
+			return 1;
+		}
+	return 0;
 }
 
 
-static bool tree_id_update(const struct db *db, struct db_entry *dir)
+struct db_entry *db_lookup(const struct db *db, const struct db_entry *dir,
+    const char *name, unsigned len)
 {
+	const struct db_names *t = dir ? &dir->names : &db->names;
 	struct db_entry *e;
-	bool ok = 1;
 
-	for (e = dir ? dir->children : db->entries; e; e = e->next) {
-		if (!id_to_cwd(dir, e, db_change_field))
-			ok = 0;
-		if (!tree_id_update(db, dir->children))
-			ok = 0;
-	}
-	return ok;
+	if (!t->size)
+		return NULL;
+	for (e = t->bucket[name_hash(name, len) & (t->size - 1)]; e;
+	    e = e->name_next)
+		if (strlen(e->name) == len && !memcmp(e->name, name, len))
+			return e;
+	return NULL;
 }
 
 
-static void tree_move(struct db_entry *dir, struct db_entry *e)
-{
-	struct db *db = e->db;
-	struct db_entry **new_anchor;
-	struct db_entry **old_anchor;
-	struct db_entry *parent;
-
-	for (new_anchor = dir ? &dir->children : &db->entries; *new_anchor;
-	    new_anchor = &(*new_anchor)->next)
-		if (*new_anchor == e)
-			return;
+/* --- Field lists --------------------------------------------------------- */
 
-	parent = find_parent(e->db, NULL, e);
-	for (old_anchor = parent ? &parent->children : &db->entries;
-	    *old_anchor; old_anchor = &(*old_anchor)->next)
-		if (*old_anchor == e)
-			break;
-	assert(*old_anchor);
-	
-	*old_anchor = e->next;
-	e->next = *new_anchor;
-	*new_anchor = e;
 
-	/*
-	 * @@@ db_delete_field this runs tsort, so we should not run it again
-	 * after returning.
-	 */
-	if (*old_anchor) {
-		struct db_field *f = db_field_find(*old_anchor, ft_prev);
+static void insert_field(struct db_entry *de, enum field_type type,
+    const void *data, unsigned len)
+{
+	struct db_field **anchor;
+	struct db_field *f;
 
-		if (f)
-			db_delete_field(*old_anchor, f);
-	}
+	for (anchor = &de->fields; *anchor; anchor = &(*anchor)->next)
+		if ((*anchor)->type > type)
+			break;
+	f = alloc_field(de->db, type);
+	f->len = len;
+	f->data = len > DB_FIELD_INLINE ? alloc_size(len) : f->buf;
+	memcpy(f->data, data, len);
+	f->next = *anchor;
+	*anchor = f;
 }
 
 
-void db_move_after(struct db_entry *e, const struct db_entry *after)
+static bool add_field(struct db_entry *de, enum field_type type,
+    const void *data, unsigned len)
 {
-	struct db *db = e->db;
-	struct db_entry *dir = db->dir ? db->dir->children : db->entries;
-	struct db_entry *e2;
-	struct db_field *f = db_field_find(e, ft_prev);
+	insert_field(de, type, data, len);
+	de->db->generation++;
+	return 1;
+}
 
-	assert(e != db->dir);
-	assert(!db_is_descendent(e, db->dir));
 
-	assert(!after || e->db == after->db);
-	if (after) {
-		if (debugging)
-			printf("move_after: %s -> %s\n", e->name, after->name);
+/*
+ * set_field replaces the content of the field, or adds the field if the entry
+ * does not have it yet. The data is copied before freeing the old content.
+ */
+
+static struct db_field *set_field(struct db_entry *de, enum field_type type,
+    const void *data, unsigned size)
+{
+	struct db_field **anchor;
+	struct db_field *f;
+	void *tmp = size > DB_FIELD_INLINE ? alloc_size(size) : NULL;
+
+	if (tmp)
+		memcpy(tmp, data, size);
+	for (anchor = &de->fields; *anchor; anchor = &(*anchor)->next)
+		if ((*anchor)->type >= type)
+			break;
+	if (*anchor && (*anchor)->type == type) {
+		f = *anchor;
+		/* "data" may be in f->buf */
+		if (!tmp)
+			memmove(f->buf, data, size);
+		free_data(f);
 	} else {
-		if (debugging)
-			printf("move_after: %s -> TOP\n", e->name);
+		f = alloc_field(de->db, type);
+		f->next = *anchor;
+		*anchor = f;
+		if (!tmp)
+			memcpy(f->buf, data, size);
 	}
+	f->len = size;
+	f->data = tmp ? tmp : f->buf;
+	return f;
+}
 
-	/* @@@ is this the right place to handle moving after itself ? */
-	if (e == after) {
-		if (debugging)
-			printf("to self\n");
-		return;
-	}
 
-	if (debugging)
-		printf("followers:\n");
-	/*
-	 * db_change_field and db_delete_entry sort the database, so we just
-	 * restart to be safe.
-	 */
-again:
-	f = db_field_find(e, ft_prev);
-	for (e2 = dir; e2; e2 = e2->next)
-		if (e2 != e && is_prev(e, e2)) {
-			if (f) {
-				db_change_field(e2, ft_prev, f->data, f->len);
-			} else {
-				struct db_field *f2 =
-				    db_field_find(e2, ft_prev);
+static void remove_field(struct db_entry *de, enum field_type type)
+{
+	struct db_field **anchor;
+	struct db_field *f;
 
-				assert(f2);
-				db_delete_field(e2, f2);
-			}
-			goto again;
+	for (anchor = &de->fields; *anchor; anchor = &(*anchor)->next)
+		if ((*anchor)->type == type) {
+			f = *anchor;
+			*anchor = f->next;
+			free_field(de->db, f);
+			return;
 		}
+}
 
-	if (debugging)
-		printf("followers2:\n");
-again2:
-	for (e2 = dir; e2; e2 = e2->next) {
-		if (debugging)
-			printf("\t%s: %p =? %p, (%s) %u\n",
-			    e2->name, e2, e, e->name, is_prev(e, e2));
-		if (e2 != e && is_prev(after, e2)) {
-			db_change_field(e2, ft_prev, e->name, strlen(e->name));
-			goto again2;
+
+/* --- Lazy loading of fields ---------------------------------------------- */
+
+
+/*
+ * When opening the database, we only keep the fields that define its
+ * structure. We load the other fields when they are first needed, and keep the
+ * fields we already have, so that pointers to them remain valid.
+ *
+ * To limit memory use, we keep the fields of at most db->max_loaded entries
+ * (0 means no limit), and drop the fields of the least recently used entry
+ * when loading another one. Loaded entries are kept in a list, most recently
+ * used first. Entries with deferred updates, entries changed in a transaction
+ * that has not been committed yet, and entries held with db_entry_hold, are
+ * never evicted.
+ */
+
+static bool structural_field(enum field_type type)
+{
+	return type == ft_id || type == ft_prev || type == ft_dir ||
+	    type == ft_parent;
+}
+
+
+static bool evictable(const struct db_entry *e, const struct db_entry *keep)
+{
+	if (e->held || e->defer || e->dirty || e == keep)
+		return 0;
+	return e->block && e->block != (unsigned) -1;
+}
+
+
+static void evict_fields(struct db_entry *de)
+{
+	struct db_field **anchor = &de->fields;
+
+	while (*anchor) {
+		struct db_field *f = *anchor;
+
+		if (structural_field(f->type)) {
+			anchor = &f->next;
+		} else {
+			*anchor = f->next;
+			free_field(de->db, f);
 		}
 	}
+	de->lazy = 1;
+	lru_unlink(de);
+}
 
-	if (after) {
-		db_change_field(e, ft_prev, after->name,
-		    strlen(after->name));
-	} else {
-		if (f)
-			db_delete_field(e, f);
+
+static void evict(struct db *db, const struct db_entry *keep)
+{
+	struct db_entry *e = db->lru_tail;
+
+	if (!db->max_loaded)
+		return;
+	while (e && db->loaded > db->max_loaded) {
+		struct db_entry *prev = e->lru_prev;
+
+		if (evictable(e, keep))
+			evict_fields(e);
+		e = prev;
 	}
+}
 
-	id_to_cwd(db->dir, e, db_change_field);
-	tree_id_update(db, e);
-	tree_move(db->dir, e);
 
-	db_tsort(db);
+void db_entry_hold(const struct db_entry *de)
+{
+	/* holding does not change the entry, so we can cast away "const" */
+	((struct db_entry *) de)->held++;
 }
 
 
-void db_move_before(struct db_entry *e, const struct db_entry *before)
+void db_entry_release(const struct db_entry *de)
 {
-	struct db *db = e->db;
-	struct db_entry *dir = db->dir ? db->dir->children : db->entries;
-	const struct db_entry *prev;
+	struct db_entry *e = (struct db_entry *) de;
 
-	assert(!before || e->db == before->db);
-	if (before == dir) {
-		prev = NULL;
-	} else if (before) {
-		if (debugging)
-			printf("move_before: %s -> %s\n",
-			    e->name, before->name);
-		for (prev = dir; prev; prev = prev->next)
-			if (prev->next == before)
-				break;
-		assert(prev);
-	} else {
-		if (debugging)
-			printf("move_before: %s -> END\n", e->name);
-		for (prev = dir; prev && prev->next; prev = prev->next);
-	}
-	db_move_after(e, prev);
+	assert(e->held);
+	e->held--;
 }
 
 
-/* --- Database entries: deletion ------------------------------------------ */
+/*
+ * Fields split into several items (see FT_MORE) are assembled in "dec". The
+ * items of a field may be in different blocks of a chain.
+ */
 
+struct field_dec {
+	enum field_type	type;
+	uint8_t		*data;	/* NULL if there is no incomplete field */
+	unsigned	len;
+};
 
-static struct db_entry **find_anchor(struct db_entry **anchor,
-    const struct db_entry *de)
-{
-	struct db_entry **found;
 
-	while (*anchor) {
-		if (*anchor == de)
-			return anchor;
-		if ((*anchor)->children) {
-			found = find_anchor(&(*anchor)->children, de);
-			if (found)
-				return found;
+static bool load_fields(struct db_entry *de, struct field_dec *dec,
+    const void *p, unsigned size, const uint8_t *counter,
+    unsigned counter_len)
+{
+	const void *end = p + size;
+	enum field_type type;
+	unsigned len;
+	const void *q;
+
+	while ((q = tlv_item(&p, end, &type, &len))) {
+		bool more = type & FT_MORE;
+
+		type &= ~FT_MORE;
+		if (dec->data || more) {
+			uint8_t *tmp;
+
+			if (dec->data && type != dec->type)
+				return 0;
+			if (!len || dec->len + len > UINT16_MAX)
+				return 0;
+			tmp = alloc_size(dec->len + len);
+			if (dec->data)
+				memcpy(tmp, dec->data, dec->len);
+			memcpy(tmp + dec->len, q, len);
+			free(dec->data);
+			dec->type = type;
+			dec->data = tmp;
+			dec->len += len;
+			if (more)
+				continue;
+			q = dec->data;
+			len = dec->len;
+		}
+		if (!structural_field(type)) {
+			if (type == ft_hotp_counter && counter) {
+				q = counter;
+				len = counter_len;
+			}
+			insert_field(de, type, q, len);
 		}
-		anchor = &(*anchor)->next;
+		free(dec->data);
+		dec->data = NULL;
+		dec->len = 0;
 	}
-	return NULL;
+	return 1;
 }
 
 
-bool db_delete_entry(struct db_entry *de)
+bool db_entry_load(const struct db_entry *de)
 {
+	/* loading does not change the entry, so we can cast away "const" */
+	struct db_entry *e = (struct db_entry *) de;
 	struct db *db = de->db;
-	struct db_entry **anchor;
+	const void *p = payload_buf;
+	unsigned size = sizeof(payload_buf);
+	const uint8_t *counter = NULL;
+	const uint8_t *r;
+	struct field_dec dec = { .data = NULL, .len = 0 };
+	struct db_log log = {
+		.buf		= log_buf,
+		.buf_size	= sizeof(log_buf),
+	};
+	unsigned counter_len = 0;
+	unsigned i;
+	uint16_t seq;
 
-	anchor = find_anchor(&db->entries, de);
-	*anchor = de->next;
+	if (!de->lazy) {
+		lru_touch(e);
+		return 1;
+	}
+	switch (block_read_log(de->db->c, &seq, payload_buf, &size, &log,
+	    de->block)) {
+	case bt_data:
+		if (!de->packed && !de->n_parts && seq == de->seq)
+			break;
+		goto fail;
+	case bt_first:
+		if (de->n_parts && seq == de->seq &&
+		    chain_header(de, payload_buf, size, 0)) {
+			p += CHAIN_HDR;
+			size -= CHAIN_HDR;
+			break;
+		}
+		goto fail;
+	case bt_packed:
+		if (de->packed) {
+			p = pack_find(de, payload_buf, size, &size);
+			if (p)
+				break;
+		}
+		/* fall through */
+	default:
+		goto fail;
+	}
 
-	db_tsort(db);
+	/* the most recent record in the log is the HOTP counter */
+	for (r = log_buf; r != log_buf + log.len; r += 1 + *r) {
+		counter = r + 1;
+		counter_len = *r;
+	}
 
-	if (!block_delete(de->block))
+	if (!load_fields(e, &dec, p, size, counter, counter_len))
+		goto fail;
+	for (i = 0; i != de->n_parts; i++) {
+		const struct db_part *part = de->parts + i;
+
+		/* a part we did not find when scanning */
+		if (!part->block)
+			goto fail;
+		size = sizeof(payload_buf);
+		if (block_read(db->c, &seq, payload_buf, &size, part->block) !=
+		    bt_next || seq != part->seq ||
+		    !chain_header(de, payload_buf, size, i + 1))
+			goto fail;
+		if (!load_fields(e, &dec, payload_buf + CHAIN_HDR,
+		    size - CHAIN_HDR, counter, counter_len))
+			goto fail;
+	}
+	if (dec.data)
+		goto fail;
+	memset(payload_buf, 0, sizeof(payload_buf));
+	memset(log_buf, 0, log.len);
+	e->lazy = 0;
+	if (e->patched && !patch_apply(e)) {
+		debug("db_entry_load: cannot apply patches to %s\n",
+		    de->name);
+		evict_fields(e);
 		return 0;
-	span_add(&db->deleted, de->block, 1);
-	free_entry(de);
-	db->stats.data--;
-	db->stats.deleted++;
+	}
+	lru_touch(e);
+	evict(db, de);
 	return 1;
+
+fail:
+	debug("db_entry_load: cannot load %s from block %u\n",
+	    de->name, de->block);
+	free(dec.data);
+	/* drop what we got from the blocks we could read */
+	evict_fields(e);
+	memset(payload_buf, 0, sizeof(payload_buf));
+	memset(log_buf, 0, sizeof(log_buf));
+	return 0;
 }
 
 
-/* --- Database entries: iteration ----------------------------------------- */
+/* --- Patch blocks -------------------------------------------------------- */
 
 
-bool db_iterate(struct db *db, bool (*fn)(void *user, struct db_entry *de),
-    void *user)
+/*
+ * Changes to fields other than id, prev, dir, and parent are recorded in the
+ * log areas (see dbcrypt.c) of bt_patch blocks, instead of rewriting the whole
+ * entry.
+ * A patch block can hold changes to any number of entries. Each record
+ * contains one change:
+ *
+ * block (16), seq (16), tag (BLOCK_TAG_SIZE * 8), field type (8), data
+ *
+ * Block and sequence number identify the entry version the change applies to,
+ * and the tag distinguishes it from other data that may later be written to
+ * the same block. If the field is deleted, the field type has PATCH_DELETE set,
+ * and there is no data.
+ *
+ * There are at most DB_PATCH_BLOCKS patch blocks. We add to the most recent
+ * one, and start a new one when it is full. Changes are applied in the order
+ * of the patch blocks' sequence numbers, and the order of the records in each
+ * block, after the entry's own log.
+ *
+ * Once all patch blocks are in use, db_reclaim folds the changes back into
+ * the entries, by rewriting one entry with changes per call, and deletes the
+ * patch blocks when no such entries are left. Until then, changes that don't
+ * fit into the patch blocks rewrite the entry, as they would without patches.
+ *
+ * Rewriting an entry for any other reason also makes its changes obsolete.
+ *
+ * Changes must not make packed entries (see below) larger, or their pack may
+ * no longer fit when it is rewritten. Such changes rewrite the pack instead.
+ *
+ * When opening the database, we only mark entries that have changes, and apply
+ * the changes when loading the entry.
+ */
+
+#define	PATCH_HDR	(5 + BLOCK_TAG_SIZE)
+#define	PATCH_DELETE	0x80	/* in the field type */
+
+
+static bool patch_read(struct db *db, unsigned i, struct db_log *log)
 {
-	struct db_entry *de, *next;
+	unsigned len = sizeof(payload_buf);
+	uint16_t seq;
 
-	for (de = db->dir ? db->dir->children : db->entries; de; de = next) {
-		next = de->next;
-		if (!fn(user, de))
-			return 0;
-	}
-	return 1;
+	log->buf = log_buf;
+	log->buf_size = sizeof(log_buf);
+	return block_read_log(db->c, &seq, payload_buf, &len, log,
+	    db->patch_block[i]) == bt_patch;
 }
 
 
-/* --- Directory operations ------------------------------------------------ */
+static bool patch_matches(const struct db_entry *de, const uint8_t *rec,
+    unsigned len, const uint8_t *tag)
+{
+	if (len < PATCH_HDR)
+		return 0;
+	if (get16(rec) != de->block || get16(rec + 2) != de->seq)
+		return 0;
+	return !tag || !memcmp(rec + 4, tag, BLOCK_TAG_SIZE);
+}
 
 
-bool db_is_dir(const struct db_entry *de)
+/*
+ * For marking, we don't check the tag, since this would mean reading every
+ * entry's block. A false match only causes an unnecessary rewrite when
+ * folding.
+ */
+
+static void patch_mark(struct db_entry *e, const uint8_t *buf, unsigned len)
 {
-	const struct db_field *f;
+	const uint8_t *p;
 
-	for (f = de->fields; f; f = f->next)
-		if (f->type == ft_dir)
-			return 1;
-	return !!de->children;
+	for (; e; e = e->next) {
+		patch_mark(e->children, buf, len);
+		if (!e->block)
+			continue;
+		for (p = buf; p != buf + len; p += 1 + *p)
+			if (patch_matches(e, p + 1, *p, NULL))
+				e->patched = 1;
+	}
 }
 
 
-bool db_is_account(const struct db_entry *de)
+static bool patch_mark_all(struct db *db)
 {
-	const struct db_field *f;
+	struct db_log log;
+	unsigned i;
+	bool ok = 1;
 
-	if (de->children)
-		return 0;
-	for (f = de->fields; f; f = f->next)
-		switch (f->type) {
-		case ft_id:
-		case ft_prev:
+	for (i = 0; i != db->patch_blocks; i++) {
+		if (!patch_read(db, i, &log)) {
+			ok = 0;
 			break;
-		case ft_dir:
-			return 0;
-		default:
-			return 1;
 		}
-	return 0;
+		patch_mark(db->entries, log_buf, log.len);
+	}
+	memset(payload_buf, 0, sizeof(payload_buf));
+	memset(log_buf, 0, sizeof(log_buf));
+	return ok;
 }
 
 
-void db_mkdir(struct db_entry *de)
+static bool patch_apply(struct db_entry *de)
 {
-	assert(!db_is_dir(de));
-	assert(!db_is_account(de));
-	db_change_field(de, ft_dir, NULL, 0);
-}
-
+	struct db *db = de->db;
+	uint8_t tag[BLOCK_TAG_SIZE];
+	struct db_log log;
+	unsigned i;
+	bool ok = 1;
 
-void db_mkentry(struct db_entry *de)
-{
-	assert(db_is_dir(de));
-	assert(!de->children);
-	db_delete_field(de, db_field_find(de, ft_dir));
-}
+	if (!block_tag(tag, de->block))
+		return 0;
+	for (i = 0; ok && i != db->patch_blocks; i++) {
+		const uint8_t *p;
 
+		if (!patch_read(db, i, &log)) {
+			ok = 0;
+			break;
+		}
+		for (p = log_buf; p != log_buf + log.len; p += 1 + *p) {
+			const uint8_t *rec = p + 1;
+			enum field_type type = rec[4 + BLOCK_TAG_SIZE];
 
-void db_chdir(struct db *db, struct db_entry *de)
-{
-	db->dir = de;
+			if (!patch_matches(de, rec, *p, tag))
+				continue;
+			if (structural_field(type & ~PATCH_DELETE)) {
+				ok = 0;
+				break;
+			}
+			if (type & PATCH_DELETE)
+				remove_field(de, type & ~PATCH_DELETE);
+			else
+				set_field(de, type, rec + PATCH_HDR,
+				    *p - PATCH_HDR);
+		}
+	}
+	memset(payload_buf, 0, sizeof(payload_buf));
+	memset(log_buf, 0, sizeof(log_buf));
+	return ok;
 }
 
 
-struct db_entry *db_dir_parent(const struct db *db)
+static void patch_sort(struct db *db)
 {
-	return find_parent(db, NULL, db->dir);
+	unsigned i, j;
+
+	for (i = 1; i < db->patch_blocks; i++)
+		for (j = i; j && (int16_t) (db->patch_seq[j] -
+		    db->patch_seq[j - 1]) < 0; j--) {
+			uint16_t tmp;
+
+			tmp = db->patch_block[j];
+			db->patch_block[j] = db->patch_block[j - 1];
+			db->patch_block[j - 1] = tmp;
+			tmp = db->patch_seq[j];
+			db->patch_seq[j] = db->patch_seq[j - 1];
+			db->patch_seq[j - 1] = tmp;
+		}
 }
 
 
-const char *db_pwd(const struct db *db)
+static bool patch_new(struct db *db)
 {
-	return db->dir ? db->dir->name : NULL;
-}
-
+	uint16_t seq = db->patch_blocks ?
+	    db->patch_seq[db->patch_blocks - 1] + 1 : 0;
+	int new;
 
-/* --- Settings ------------------------------------------------------------ */
+	assert(db->patch_blocks < DB_PATCH_BLOCKS);
+	new = get_erased_block(db, pl_hot);
+	if (new < 0)
+		return 0;
+	if (!block_write_log(db->c, bt_patch, seq, NULL, 0, new)) {
+		if (block_delete(new)) {
+			span_add(&db->deleted, new, 1);
+			db->stats.deleted++;
+		}
+		return 0;
+	}
+	db->patch_block[db->patch_blocks] = new;
+	db->patch_seq[db->patch_blocks] = seq;
+	db->patch_blocks++;
+	db->stats.special++;
+	return 1;
+}
+
+
+static struct db_entry *find_patched(struct db_entry *e)
+{
+	struct db_entry *found;
+
+	for (; e; e = e->next) {
+		if (e->patched)
+			return e;
+		found = find_patched(e->children);
+		if (found)
+			return found;
+	}
+	return NULL;
+}
+
+
+/*
+ * Rewrite one entry that has changes, or delete the patch blocks if there is
+ * none left.
+ */
+
+static bool patch_fold(struct db *db)
+{
+	struct db_entry *de;
+	int new;
+
+	de = find_patched(db->entries);
+	if (de) {
+		if (de->defer || !db_entry_load(de))
+			return 0;
+		new = get_erased_block(db, pl_cold);
+		if (new < 0 || !update_entry(de, new))
+			return 0;
+		db->stats.folded++;
+		return 1;
+	}
+	if (!invalidate_index(db))
+		return 0;
+	while (db->patch_blocks) {
+		unsigned n = db->patch_block[--db->patch_blocks];
+
+		db->stats.special--;
+		if (block_delete(n)) {
+			span_add(&db->deleted, n, 1);
+			db->stats.deleted++;
+		} else {
+			db->stats.error++;
+		}
+	}
+	return 1;
+}
+
+
+static bool patch_record(const struct db_entry *de, uint8_t *rec,
+    enum field_type type, const void *data, unsigned size, bool delete)
+{
+	put16(rec, de->block);
+	put16(rec + 2, de->seq);
+	if (!block_tag(rec + 4, de->block))
+		return 0;
+	rec[4 + BLOCK_TAG_SIZE] = type | (delete ? PATCH_DELETE : 0);
+	if (size)
+		memcpy(rec + PATCH_HDR, data, size);
+	return 1;
+}
+
+
+static bool patch_write(struct db_entry *de, enum field_type type,
+    const void *data, unsigned size, bool delete)
+{
+	struct db *db = de->db;
+	uint8_t rec[DB_MAX_RECORD];
+	const struct db_field *f;
+	bool ok = 0;
+
+	if (de->defer || !de->block || PATCH_HDR + size > DB_MAX_RECORD)
+		return 0;
+	if (de->packed && !delete) {
+		f = db_field_find(de, type);
+		if (!f || size > f->len)
+			return 0;
+	}
+	if (!patch_record(de, rec, type, data, size, delete))
+		goto out;
+	if (db->patch_blocks && block_append(db->c, rec, PATCH_HDR + size,
+	    db->patch_block[db->patch_blocks - 1]))
+		goto done;
+	if (db->patch_blocks == DB_PATCH_BLOCKS)
+		goto out;
+	if (!patch_new(db) || !block_append(db->c, rec, PATCH_HDR + size,
+	    db->patch_block[db->patch_blocks - 1]))
+		goto out;
+
+done:
+	de->patched = 1;
+	db->stats.patched++;
+	ok = 1;
+out:
+	memset(rec, 0, sizeof(rec));
+	return ok;
+}
+
+
+/* --- Fields of database entries ------------------------------------------ */
+
+
+/*
+ * Entries with a HOTP counter are written with a log area (see dbcrypt.c), and
+ * we record changes of the counter in the log, without rewriting the entry.
+ * This only programs the bits of one small record, so the block does not need
+ * to be erased, and the index remains valid. Once the log is full, we rewrite
+ * the entry, which also starts a new, empty log.
+ *
+ * Records in patch blocks are applied after the log, so once an entry has
+ * patches, counter changes have to go there as well.
+ */
+
+static bool append_counter(struct db_entry *de, const void *data,
+    unsigned size)
+{
+	if (de->defer || !de->block || de->patched || size > DB_MAX_RECORD)
+		return 0;
+	if (!block_append(de->db->c, data, size, de->block))
+		return 0;
+	de->db->stats.appended++;
+	return 1;
+}
+
+
+/*
+ * Sort directory "dir" (NULL for the top level) after a change to the name or
+ * prev field of one of its entries. In a transaction, db_commit sorts once all
+ * the changes have been made.
+ */
+
+static unsigned resort(struct db *db, struct db_entry *dir)
+{
+	if (!db->txn)
+		return sort_dir(db, dir);
+	if (dir)
+		dir->unsorted = 1;
+	else
+		db->txn_sort = 1;
+	return 0;
+}
+
+
+bool db_change_field(struct db_entry *de, enum field_type type,
+    const void *data, unsigned size)
+{
+	struct db *db = de->db;
+	struct db_field *f;
+	bool logged = 0;
+	int new = -1;
+
+	if (debugging)
+		printf("db_change_field: %s.%u -> \"%.*s\"\n",
+		    de->name, type, size, (char *) data);
+	if (size > UINT16_MAX)
+		return 0;
+	if (!db_entry_load(de))
+		return 0;
+	if (db->txn) {
+		/* db_commit writes the entry */
+		f = db_field_find(de, type);
+		if (f && f->len == size && !memcmp(f->data, data, size))
+			return 1;
+		de->dirty = 1;
+	} else if (type == ft_hotp_counter && db_field_find(de, type) &&
+	    append_counter(de, data, size))
+		logged = 1;
+	else if (!structural_field(type) &&
+	    patch_write(de, type, data, size, 0))
+		logged = 1;
+	else if (!de->defer) {
+		new = get_erased_block(db,
+		    type == ft_hotp_counter ? pl_hot : pl_cold);
+		if (new < 0)
+			return 0;
+	}
+
+	f = set_field(de, type, data, size);
+
+	switch (type) {
+	case ft_id:
+		/*
+		 * It is safe for the caller to use de->name as "data" in the
+		 * call to db_change_field, since the new content is copied
+		 * before the free(3) below. We must use f->data (and not
+		 * "data") to avoid accessing deallocated memory.
+		 */
+		const void *z = memrchr(f->data, 0, size);
+		const char *name = z ? z + 1 : f->data;
+		unsigned name_len = size - (name - (const char *) f->data);
+
+		/* the order only depends on the name, not the full id */
+		if (strlen(de->name) != name_len ||
+		    memcmp(de->name, name, name_len)) {
+			struct db_names *t = names_of(db, de->parent);
+			bool hashed = names_remove(t, de);
+
+			free_name(de);
+			set_name(de, name, name_len);
+			if (hashed)
+				names_add(t, de);
+			resort(db, de->parent);
+		} else {
+			db->generation++;
+		}
+		break;
+	case ft_prev:
+		resort(db, de->parent);
+		break;
+	default:
+		db->generation++;
+		break;
+	}
+
+	return de->defer || db->txn ||
+	    ((logged || update_entry(de, new)) && storage_sync());
+}
+
+
+bool db_delete_field(struct db_entry *de, struct db_field *f)
+{
+	struct db *db = de->db;
+	struct db_field **anchor;
+	enum field_type type = f->type;
+	bool logged = 0;
+	int new = -1;
+
+	if (!db_entry_load(de))
+		return 0;
+	if (db->txn)
+		de->dirty = 1;
+	else if (!structural_field(f->type) &&
+	    patch_write(de, f->type, NULL, 0, 1))
+		logged = 1;
+	else if (!de->defer) {
+		new = get_erased_block(db, pl_cold);
+		if (new < 0)
+			return 0;
+	}
+
+	for (anchor = &de->fields; *anchor != f; anchor = &(*anchor)->next);
+	*anchor = f->next;
+	free_field(db, f);
+
+	if (type != ft_prev || !resort(db, de->parent))
+		db->generation++;
+
+	return de->defer || db->txn ||
+	    ((logged || update_entry(de, new)) && storage_sync());
+}
+
+
+/*
+ * Entries in a directory with a uid only contain their name, so renaming a
+ * directory normally changes just its own block. If the directory has no uid
+ * yet, tree_id_update gives it one, and converts its children.
+ */
+
+bool db_rename(struct db_entry *de, const char *name)
+{
+	struct db *db = de->db;
+	bool ok;
+
+	db_begin(db);
+	ok = set_id(de->parent, de, name, db_change_field) &&
+	    tree_id_update(db, de);
+	return db_commit(db) && ok;
+}
+
+
+struct db_field *db_field_find(const struct db_entry *de, enum field_type type)
+{
+	struct db_field *f;
+
+	if (!structural_field(type))
+		db_entry_load(de);
+	for (f = de->fields; f; f = f->next)
+		if (f->type == type)
+			return f;
+	return NULL;
+}
+
+
+/* --- Database entries: encoding ------------------------------------------ */
+
+
+/*
+ * Fields are encoded in two rounds: first the fields that have to be in the
+ * first block of a chain (see "Database entries: chains" below), then all
+ * others. Within each round, fields are in the order of the field list.
+ *
+ * enc_fields stores as many items as fit into a block that can hold "size"
+ * bytes, beginning at position "pos", and returns the new position. It splits
+ * fields longer than 255 bytes into several items (see FT_MORE), and also
+ * splits fields at the end of a block, unless they would fit into the next
+ * block as a whole. With "head" set, it only stores the fields of the first
+ * round. If "buf" is NULL, enc_fields only counts.
+ */
+
+struct field_enc {
+	const struct db_entry *de;
+	const struct db_field *f;	/* next field, NULL if done */
+	unsigned off;			/* bytes of "f" already stored */
+	bool head;			/* first round */
+};
+
+
+static bool head_field(enum field_type type)
+{
+	return structural_field(type) || type == ft_hotp_counter;
+}
+
+
+static void enc_skip(struct field_enc *enc)
+{
+	while (1) {
+		for (; enc->f; enc->f = enc->f->next)
+			if (head_field(enc->f->type) == enc->head)
+				return;
+		if (!enc->head)
+			return;
+		enc->head = 0;
+		enc->f = enc->de->fields;
+	}
+}
+
+
+static void enc_begin(struct field_enc *enc, const struct db_entry *de)
+{
+	assert(!de->lazy);
+	enc->de = de;
+	enc->f = de->fields;
+	enc->off = 0;
+	enc->head = 1;
+	enc_skip(enc);
+}
+
+
+static unsigned field_bytes(const struct db_field *f)
+{
+	return f->len + 2 * (f->len ? (f->len + 254) / 255 : 1);
+}
+
+
+static unsigned enc_fields(struct field_enc *enc, uint8_t *buf, unsigned pos,
+    unsigned size, bool head)
+{
+	while (enc->f && (!head || enc->head)) {
+		const struct db_field *f = enc->f;
+		unsigned left = f->len - enc->off;
+		unsigned chunk = left < 255 ? left : 255;
+
+		if (pos + 2 + chunk > size) {
+			if (!enc->off && pos && field_bytes(f) <= size)
+				break;
+			if (pos + 3 > size)
+				break;
+			chunk = size - pos - 2;
+		}
+		if (buf) {
+			buf[pos] = f->type | (chunk == left ? 0 : FT_MORE);
+			buf[pos + 1] = chunk;
+			memcpy(buf + pos + 2, f->data + enc->off, chunk);
+		}
+		pos += 2 + chunk;
+		enc->off += chunk;
+		if (enc->off == f->len) {
+			enc->f = f->next;
+			enc->off = 0;
+			enc_skip(enc);
+		}
+	}
+	return pos;
+}
+
+
+/*
+ * Store the fields of "de" in "buf". Returns the number of bytes, or -1 if
+ * they don't fit.
+ */
+
+static int encode_entry(const struct db_entry *de, uint8_t *buf,
+    unsigned size)
+{
+	struct field_enc enc;
+	unsigned len;
+
+	enc_begin(&enc, de);
+	len = enc_fields(&enc, buf, 0, size, 0);
+	return enc.f ? -1 : (int) len;
+}
+
+
+/* --- Database entries: packing ------------------------------------------- */
+
+
+/*
+ * Small entries without a HOTP counter are stored together in bt_packed blocks
+ * ("packs"), instead of each occupying a block of its own. This saves space,
+ * and opening the database has fewer blocks to decrypt. The payload of a pack
+ * is a list of entries (see pack_item), each with its own sequence number.
+ *
+ * A pack is always rewritten as a whole: changing one of its entries writes a
+ * new pack with the new content of the entry and copies of the others, and
+ * then deletes the old pack. All entries in the new pack get a new sequence
+ * number, so that they replace the copies in the old pack if we crash before
+ * deleting it. Copies of entries that have moved elsewhere are dropped.
+ *
+ * New entries, and entries we rewrite for other reasons, join the pack we last
+ * added to (db->pack_block), or start a new one if it is full. An entry that
+ * no longer qualifies, e.g., because it has grown, moves to a block of its
+ * own, and its old pack is rewritten without it.
+ *
+ * Sequence numbers are unique within a pack, so that patch records, which
+ * identify entries by block and sequence number, can tell its entries apart.
+ */
+
+#define	PACK_MAX_ENTRY		128	/* maximum size of an entry to add */
+#define	PACK_MAX_ENTRIES	32	/* maximum number of entries per pack */
+
+
+/*
+ * Packs are limited to a payload that fits any number of readers. With small
+ * blocks, this is less than PACK_SIZE.
+ */
+
+static unsigned pack_size(void)
+{
+	unsigned safe = block_safe_payload();
+
+	return safe < PACK_SIZE ? safe : PACK_SIZE;
+}
+
+
+/*
+ * We only pack entries if at least two of them fit in a pack.
+ */
+
+static bool packable(const struct db_entry *de)
+{
+	const struct db_field *f;
+	unsigned size = 0;
+
+	for (f = de->fields; f; f = f->next) {
+		if (f->type == ft_hotp_counter)
+			return 0;
+		size += f->len + 2;
+	}
+	return size <= PACK_MAX_ENTRY && 4 + size <= pack_size() / 2;
+}
+
+
+struct pack {
+	struct db_entry	*member[PACK_MAX_ENTRIES];
+	unsigned	n;
+	bool		ok;	/* 0 if there were too many members */
+};
+
+
+static void pack_members(struct pack *pk, struct db_entry *e, unsigned n,
+    const struct db_entry *skip)
+{
+	for (; e; e = e->next) {
+		pack_members(pk, e->children, n, skip);
+		if (!e->packed || e->block != n || e == skip)
+			continue;
+		if (pk->n == PACK_MAX_ENTRIES)
+			pk->ok = 0;
+		else
+			pk->member[pk->n++] = e;
+	}
+}
+
+
+/*
+ * Find the member whose copy in the old pack we can use.
+ */
+
+static struct db_entry *pack_member(const struct pack *pk, uint16_t seq,
+    const void *p, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i != pk->n; i++) {
+		struct db_entry *e = pk->member[i];
+
+		if (!e->patched && e->seq == seq && same_id(e, p, len))
+			return e;
+	}
+	return NULL;
+}
+
+
+/*
+ * Return a sequence number for an entry joining the pack that is newer than
+ * "seq", and that does not clash with the new sequence numbers of the members.
+ */
+
+static uint16_t pack_seq(const struct pack *pk, uint16_t seq)
+{
+	unsigned i = 0;
+
+	seq++;
+	while (i != pk->n)
+		if ((uint16_t) (pk->member[i]->seq + 1) == seq) {
+			seq++;
+			i = 0;
+		} else {
+			i++;
+		}
+	return seq;
+}
+
+
+static bool pack_add(unsigned *pos, uint16_t seq, const void *fields,
+    unsigned len)
+{
+	if (*pos + 4 + len > pack_size())
+		return 0;
+	put16(pack_buf + *pos, seq);
+	put16(pack_buf + *pos + 2, len);
+	memcpy(pack_buf + *pos + 4, fields, len);
+	*pos += 4 + len;
+	return 1;
+}
+
+
+static bool pack_encode(unsigned *pos, const struct db_entry *de,
+    uint16_t seq)
+{
+	int len;
+
+	if (*pos + 4 > pack_size())
+		return 0;
+	len = encode_entry(de, pack_buf + *pos + 4, pack_size() - *pos - 4);
+	if (len <= 0)
+		return 0;
+	put16(pack_buf + *pos, seq);
+	put16(pack_buf + *pos + 2, len);
+	*pos += 4 + len;
+	return 1;
+}
+
+
+static void pack_delete(struct db *db, unsigned n)
+{
+	span_remove(&db->packs, n, 1);
+	db->stats.data--;
+	db->stats.packs--;
+	if (!retire_block(db, n))
+		db->stats.error++;
+	if (db->pack_block == (int) n)
+		db->pack_block = -1;
+}
+
+
+/*
+ * Write a new version of pack "old" (-1 for a new pack) to block "new", adding
+ * or updating "de" if it is not NULL. Members with patches, and members
+ * db_commit has yet to write, are loaded and stored with their current fields,
+ * all others are copied.
+ *
+ * Returns 1 on success, 0 if the entries don't fit into a pack, and -1 on
+ * error. On error, the caller has to delete "new".
+ *
+ * We don't evict fields while building the pack, since this could drop the
+ * changes to "de".
+ */
+
+static int pack_write(struct db *db, int old, struct db_entry *de,
+    unsigned new)
+{
+	unsigned max_loaded = db->max_loaded;
+	struct pack pk = { .n = 0, .ok = 1 };
+	unsigned pos = 0, copy = 0;
+	uint16_t seq = 0;
+	unsigned i;
+	int ret = -1;
+
+	if (old >= 0)
+		pack_members(&pk, db->entries, old, de);
+	if (!pk.ok)
+		return -1;
+	if (de && pk.n == PACK_MAX_ENTRIES)
+		return 0;
+	memset(pack_buf, 0, sizeof(pack_buf));
+	db->max_loaded = 0;
+
+	if (de) {
+		seq = pack_seq(&pk, de->seq);
+		if (!pack_encode(&pos, de, seq)) {
+			ret = 0;
+			goto out;
+		}
+	}
+	for (i = 0; i != pk.n; i++) {
+		struct db_entry *e = pk.member[i];
+
+		if (!e->patched && (!e->dirty || e->defer)) {
+			copy++;
+			continue;
+		}
+		/* we would store changes that are still deferred */
+		if (e->defer || !db_entry_load(e))
+			goto out;
+		if (!pack_encode(&pos, e, e->seq + 1)) {
+			ret = 0;
+			goto out;
+		}
+	}
+	if (copy) {
+		unsigned size = sizeof(payload_buf);
+		const void *p = payload_buf;
+		const void *q;
+		unsigned len;
+		uint16_t s;
+
+		if (block_read(db->c, NULL, payload_buf, &size, old) !=
+		    bt_packed)
+			goto out;
+		while ((q = pack_item(&p, payload_buf + size, &s, &len))) {
+			if (!pack_member(&pk, s, q, len))
+				continue;
+			if (!pack_add(&pos, s + 1, q, len)) {
+				ret = 0;
+				goto out;
+			}
+			copy--;
+		}
+		/* some members are missing from the old pack */
+		if (copy)
+			goto out;
+	}
+
+	assert(pos);
+	if (!block_write(db->c, bt_packed, 0, pack_buf, pos, new))
+		goto out;
+	for (i = 0; i != pk.n; i++) {
+		pk.member[i]->block = new;
+		pk.member[i]->seq++;
+		pk.member[i]->patched = 0;
+		pk.member[i]->dirty = 0;
+	}
+	if (de) {
+		de->block = new;
+		de->seq = seq;
+		de->packed = 1;
+		de->patched = 0;
+		/* the caller deletes the parts of a chain */
+		de->n_parts = 0;
+		de->parts = NULL;
+	}
+	span_add(&db->packs, new, 1);
+	db->stats.data++;
+	db->stats.packs++;
+	if (old >= 0)
+		pack_delete(db, old);
+	if (old < 0 || db->pack_block == -1)
+		db->pack_block = new;
+	ret = 1;
+
+out:
+	db->max_loaded = max_loaded;
+	memset(pack_buf, 0, sizeof(pack_buf));
+	memset(payload_buf, 0, sizeof(payload_buf));
+	evict(db, de);
+	return ret;
+}
+
+
+/*
+ * Rewrite pack "n" after an entry has left it, or delete the pack if no
+ * entries are left.
+ */
+
+static bool pack_remove(struct db *db, unsigned n)
+{
+	struct pack pk = { .n = 0, .ok = 1 };
+	int new;
+
+	pack_members(&pk, db->entries, n, NULL);
+	if (!pk.n) {
+		pack_delete(db, n);
+		return 1;
+	}
+	new = get_erased_block(db, pl_cold);
+	if (new < 0)
+		return 0;
+	if (pack_write(db, n, NULL, new) > 0)
+		return 1;
+	if (block_delete(new)) {
+		span_add(&db->deleted, new, 1);
+		db->stats.deleted++;
+	}
+	return 0;
+}
+
+
+/* --- Database entries: chains -------------------------------------------- */
+
+
+/*
+ * Entries whose fields don't fit into block_safe_payload bytes are stored as a
+ * chain (see chain_header). The fields of the first round of encoding (id,
+ * prev, dir, and the HOTP counter) always go into the first block, so that
+ * opening the database only needs this block, and so that counter changes can
+ * be recorded in its log area. The other fields follow, filling one block
+ * after the other.
+ *
+ * If a change only affects one block of the chain, we only rewrite this block.
+ * The first block keeps the chain id, and a part gets a new sequence number,
+ * so that the new copy wins if we crash before deleting the old one. If more
+ * than one block changes, or the number of parts changes, we write a new chain
+ * with a new id, and then delete the old one. The old chain remains valid
+ * until the first block of the new chain is written, and parts not belonging
+ * to any entry are deleted when scanning.
+ */
+
+
+static unsigned chain_size(void)
+{
+	return block_safe_payload() - CHAIN_HDR;
+}
+
+
+/*
+ * Return the number of parts "de" needs, or -1 if it does not fit into a
+ * chain.
+ */
+
+static int chain_parts(const struct db_entry *de)
+{
+	struct field_enc enc;
+	unsigned pos;
+	int n = 0;
+
+	enc_begin(&enc, de);
+	pos = enc_fields(&enc, NULL, 0, chain_size(), 1);
+	if (enc.f && enc.head)
+		return -1;
+	enc_fields(&enc, NULL, pos, chain_size(), 0);
+	while (enc.f) {
+		if (n == DB_MAX_PARTS)
+			return -1;
+		enc_fields(&enc, NULL, 0, chain_size(), 0);
+		n++;
+	}
+	return n;
+}
+
+
+/*
+ * Store block "i" (0 for the first block) of a chain with "n" parts in
+ * payload_buf, and return the size of the payload.
+ */
+
+static unsigned chain_encode(const struct db_entry *de, uint32_t chain,
+    unsigned n, unsigned i)
+{
+	uint8_t *buf = payload_buf + CHAIN_HDR;
+	struct field_enc enc;
+	unsigned pos, k;
+
+	memset(payload_buf, 0, sizeof(payload_buf));
+	enc_begin(&enc, de);
+	pos = enc_fields(&enc, i ? NULL : buf, 0, chain_size(), 1);
+	pos = enc_fields(&enc, i ? NULL : buf, pos, chain_size(), 0);
+	for (k = 1; k <= i; k++)
+		pos = enc_fields(&enc, k == i ? buf : NULL, 0, chain_size(),
+		    0);
+	put32(payload_buf, chain);
+	payload_buf[4] = i ? i : n;
+	return CHAIN_HDR + pos;
+}
+
+
+static bool has_log(const struct db_entry *de)
+{
+	const struct db_field *f;
+
+	for (f = de->fields; f; f = f->next)
+		if (f->type == ft_hotp_counter && f->len <= DB_MAX_RECORD)
+			return 1;
+	return 0;
+}
+
+
+static void part_delete(struct db *db, unsigned n)
+{
+	db->stats.data--;
+	db->stats.parts--;
+	if (!retire_block(db, n))
+		db->stats.error++;
+}
+
+
+/*
+ * Delete the parts of a chain, and free the list. Parts we did not find when
+ * scanning have block 0.
+ */
+
+static void chain_drop(struct db *db, struct db_part *parts, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i != n; i++)
+		if (parts[i].block)
+			part_delete(db, parts[i].block);
+	free(parts);
+}
+
+
+/*
+ * Write "de" as a new chain, with the first block in de->block. The caller
+ * deletes the old chain.
+ */
+
+static bool write_chain(struct db_entry *de)
+{
+	struct db *db = de->db;
+	struct db_part *parts;
+	uint32_t chain;
+	unsigned len, i;
+	bool ok;
+	int n;
+
+	n = chain_parts(de);
+	if (n < 0) {
+		debug("write_chain: %s does not fit\n", de->name);
+		return 0;
+	}
+	assert(n);
+	parts = alloc_type_n(struct db_part, n);
+	rnd_bytes(&chain, sizeof(chain));
+	for (i = 0; i != (unsigned) n; i++) {
+		int new = get_erased_block(db, pl_cold);
+
+		if (new < 0)
+			goto fail;
+		len = chain_encode(de, chain, n, i + 1);
+		if (!block_write(db->c, bt_next, 0, payload_buf, len, new)) {
+			if (block_delete(new)) {
+				span_add(&db->deleted, new, 1);
+				db->stats.deleted++;
+			}
+			goto fail;
+		}
+		parts[i].block = new;
+		parts[i].seq = 0;
+		db->stats.data++;
+		db->stats.parts++;
+	}
+	len = chain_encode(de, chain, n, 0);
+	if (has_log(de))
+		ok = block_write_log(db->c, bt_first, de->seq, payload_buf,
+		    len, de->block);
+	else
+		ok = block_write(db->c, bt_first, de->seq, payload_buf, len,
+		    de->block);
+	if (!ok)
+		goto fail;
+	memset(payload_buf, 0, sizeof(payload_buf));
+	db->stats.data++;
+	de->chain = chain;
+	de->n_parts = n;
+	de->parts = parts;
+	return 1;
+
+fail:
+	memset(payload_buf, 0, sizeof(payload_buf));
+	chain_drop(db, parts, i);
+	return 0;
+}
+
+
+/*
+ * Return 1 if block "i" of the chain of "de" (0 for the first block), stored
+ * in block "n" with sequence number "seq", has to be written, because its
+ * content changes, or because it is in the range "from" to "to" - 1.
+ */
+
+static bool chain_changed(const struct db_entry *de, unsigned i, unsigned n,
+    uint16_t seq, unsigned from, unsigned to)
+{
+	unsigned size = sizeof(log_buf);
+	bool changed = 1;
+	unsigned len, j;
+	uint16_t s;
+
+	if (!n || (n >= from && n < to))
+		return 1;
+	if (block_read(de->db->c, &s, log_buf, &size, n) !=
+	    (i ? bt_next : bt_first) || s != seq)
+		goto out;
+	len = chain_encode(de, de->chain, de->n_parts, i);
+	if (len > size || memcmp(payload_buf, log_buf, len))
+		goto out;
+	/* the rest of the payload is padding */
+	for (j = len; j != size; j++)
+		if (log_buf[j])
+			goto out;
+	changed = 0;
+
+out:
+	memset(payload_buf, 0, sizeof(payload_buf));
+	memset(log_buf, 0, sizeof(log_buf));
+	return changed;
+}
+
+
+/*
+ * Rewrite the one block of the chain of "de" that has to be written (see
+ * chain_changed) to block "new". If nothing has to be written, "new" goes back
+ * to the erased blocks. Returns 1 on success, 0 if we have to write a new
+ * chain, and -1 on error. On error, the caller has to delete "new".
+ */
+
+static int chain_update(struct db_entry *de, unsigned new, unsigned from,
+    unsigned to)
+{
+	struct db *db = de->db;
+	int changed = -1;
+	unsigned old, len, i;
+	bool ok;
+
+	if (chain_parts(de) != (int) de->n_parts)
+		return 0;
+	/* rewriting the first block also makes patches obsolete */
+	if (de->patched || chain_changed(de, 0, de->block, de->seq, from, to))
+		changed = 0;
+	for (i = 0; i != de->n_parts; i++) {
+		if (!chain_changed(de, i + 1, de->parts[i].block,
+		    de->parts[i].seq, from, to))
+			continue;
+		if (changed >= 0)
+			return 0;
+		changed = i + 1;
+	}
+	if (changed < 0) {
+		span_add(&db->erased, new, 1);
+		db->stats.erased++;
+		return 1;
+	}
+
+	len = chain_encode(de, de->chain, de->n_parts, changed);
+	if (changed) {
+		struct db_part *part = de->parts + changed - 1;
+
+		old = part->block;
+		ok = block_write(db->c, bt_next, part->seq + 1, payload_buf,
+		    len, new);
+		if (ok) {
+			part->block = new;
+			part->seq++;
+			db->stats.data++;
+			db->stats.parts++;
+			if (old)
+				part_delete(db, old);
+		}
+	} else {
+		old = de->block;
+		if (has_log(de))
+			ok = block_write_log(db->c, bt_first, de->seq + 1,
+			    payload_buf, len, new);
+		else
+			ok = block_write(db->c, bt_first, de->seq + 1,
+			    payload_buf, len, new);
+		if (ok) {
+			de->block = new;
+			de->seq++;
+			de->patched = 0;
+			// @@@ complain if block_delete fails ?
+			if (!retire_block(db, old))
+				db->stats.data++;
+		}
+	}
+	memset(payload_buf, 0, sizeof(payload_buf));
+	return ok ? 1 : -1;
+}
+
+
+/* --- Database entries: storage operations -------------------------------- */
+
+
+/*
+ * Write "de" to de->block, as a single block if it fits, as a chain otherwise.
+ * The caller deletes the parts of a previous chain.
+ */
+
+static bool write_entry(struct db_entry *de)
+{
+	int len;
+	bool ok;
+
+	assert(de->block);
+	memset(payload_buf, 0, sizeof(payload_buf));
+	len = encode_entry(de, payload_buf, block_safe_payload());
+	if (len < 0)
+		return write_chain(de);
+	if (has_log(de))
+		ok = block_write_log(de->db->c, bt_data, de->seq, payload_buf,
+		    len, de->block);
+	else
+		ok = block_write(de->db->c, bt_data, de->seq, payload_buf,
+		    len, de->block);
+	if (ok) {
+		de->db->stats.data++;
+		de->n_parts = 0;
+		de->parts = NULL;
+	}
+	return ok;
+}
+
+
+/*
+ * Write "de" to block "new", either on its own, or by adding it to a pack.
+ * The caller takes care of the entry's old block. Returns 1 on success, -1 on
+ * error. On error, the caller has to delete "new".
+ */
+
+static int place_entry(struct db_entry *de, unsigned new)
+{
+	struct db *db = de->db;
+	unsigned old = de->block;
+	bool packed = de->packed;
+	int ret;
+
+	if (packable(de)) {
+		if (db->pack_block >= 0 &&
+		    (!packed || old != (unsigned) db->pack_block)) {
+			ret = pack_write(db, db->pack_block, de, new);
+			if (ret)
+				return ret;
+		}
+		return pack_write(db, -1, de, new) > 0 ? 1 : -1;
+	}
+	de->block = new;
+	de->seq++;
+	de->packed = 0;
+	if (write_entry(de))
+		return 1;
+	de->block = old;
+	de->seq--;
+	de->packed = packed;
+	return -1;
+}
+
+
+/*
+ * Write the current content of "de" to block "new", and delete the old block.
+ * Blocks of a chain in the range "from" to "to" - 1 are moved even if they
+ * don't change (see move_unit).
+ */
+
+static bool do_update_entry(struct db_entry *de, unsigned new, unsigned from,
+    unsigned to)
+{
+	struct db *db = de->db;
+	unsigned old = de->block;
+	bool packed = de->packed;
+	struct db_part *parts = de->parts;
+	unsigned n_parts = de->n_parts;
+	bool moved = 1;
+	int ret = 0;
+
+	if (n_parts) {
+		ret = chain_update(de, new, from, to);
+		if (ret > 0)
+			return 1;
+	}
+	/* try to stay in the same pack */
+	if (packed && packable(de)) {
+		ret = pack_write(db, old, de, new);
+		moved = !ret;
+	}
+	if (!ret)
+		ret = place_entry(de, new);
+	if (ret < 0) {
+		// @@@ complain more if block_delete fails ?
+		if (block_delete(new)) {
+			span_add(&db->deleted, new, 1);
+			db->stats.deleted++;
+		}
+		return 0;
+	}
+	de->patched = 0;
+	chain_drop(db, parts, n_parts);
+	if (packed)
+		return !moved || pack_remove(db, old);
+	// @@@ complain if block_delete fails ?
+	if (old && retire_block(db, old))
+		db->stats.data--;
+	return 1;
+}
+
+
+static bool update_entry(struct db_entry *de, unsigned new)
+{
+	return do_update_entry(de, new, 0, 0);
+}
+
+
+bool db_entry_defer_update(struct db_entry *de, bool defer)
+{
+	if (!defer) {
+		int new;
+
+		if (!db_entry_load(de))
+			return 0;
+		new = get_erased_block(de->db, pl_cold);
+		if (new < 0)
+			return 0;
+		if (!update_entry(de, new) || !storage_sync())
+			return 0;
+	}
+	de->defer = defer;
+	return 1;
+}
+
+
+/* --- Database entries: transactions -------------------------------------- */
+
+
+/*
+ * A transaction collects changes to several entries, and then writes them all
+ * at once. While the transaction is open, db_change_field and db_delete_field
+ * only mark entries as dirty, and the database is not sorted. db_commit sorts
+ * the directories that changed, and writes the dirty entries. Blocks that are
+ * superseded while doing this are only deleted after all the new blocks have
+ * been written (see retire_block). If we lose power before that, scanning
+ * finds the old and the new copies, and keeps the new ones, like it does after
+ * any other update that did not complete. (An entry whose id changed, e.g.,
+ * when renaming it, can then appear under both names, but no entry is lost.)
+ */
+
+void db_begin(struct db *db)
+{
+	db->txn++;
+}
+
+
+static void sort_unsorted(struct db_entry *list)
+{
+	struct db_entry *de;
+
+	for (de = list; de; de = de->next) {
+		if (de->unsorted)
+			tsort_dir(&de->children);
+		de->unsorted = 0;
+		sort_unsorted(de->children);
+	}
+}
+
+
+static bool commit_entries(struct db_entry *list)
+{
+	struct db_entry *de;
+	bool ok = 1;
+
+	for (de = list; de; de = de->next) {
+		/* pack_write may already have written the entry */
+		if (de->dirty && !de->defer) {
+			int new = get_erased_block(de->db, pl_cold);
+
+			if (new < 0 || !update_entry(de, new))
+				ok = 0;
+		}
+		de->dirty = 0;
+		if (!commit_entries(de->children))
+			ok = 0;
+	}
+	return ok;
+}
+
+
+static bool delete_retired(void *user, unsigned start, unsigned len)
+{
+	struct db *db = user;
+	unsigned n;
+
+	for (n = start; n != start + len; n++)
+		if (block_delete(n)) {
+			span_add(&db->deleted, n, 1);
+			db->stats.deleted++;
+		} else {
+			db->stats.error++;
+		}
+	return 1;
+}
+
+
+bool db_commit(struct db *db)
+{
+	bool ok;
+
+	assert(db->txn);
+	if (--db->txn)
+		return 1;
+	if (db->txn_sort)
+		tsort_dir(&db->entries);
+	db->txn_sort = 0;
+	sort_unsorted(db->entries);
+	db->generation++;
+
+	db->committing = 1;
+	ok = commit_entries(db->entries);
+	db->committing = 0;
+
+	/*
+	 * If the new blocks may not be in storage, we keep the old ones. They
+	 * are deleted when we next scan the database.
+	 */
+	if (storage_sync())
+		span_iterate(db->retired, delete_retired, db);
+	else
+		ok = 0;
+	span_free_all(db->retired);
+	db->retired = NULL;
+	return storage_sync() && ok;
+}
+
+
+/* --- Database entries: creation  ----------------------------------------- */
+
+/*
+ * Sorting: "prev" establishes a partial order [1]. The idea is that entries
+ * are sorted alphabetically, but that this sort order can be overridden by
+ * setting "prev".
+ *
+ * The algorithm below does this for any new entry that is added, where the new
+ * entry may have a pointer (prev) to the previous entry. However, this is only
+ * valid under the following conditions:
+ * - the entry referenced by "prev" already exists when the new entry is added,
+ *   and
+ * - no existing entries reference the new entry as their "prev" entry.
+ *
+ * If these conditions are not met, we could aim for an alphabetic order, and
+ * then perform a stable [2] topological sort [1] on the resulting list.
+ * "Stable" means that entries on which the partial order imposes no ordering,
+ * either directly or via other entries, are left in their original order with
+ * respect to each other.
+ *
+ * Some practical considerations:
+ * https://stackoverflow.com/q/11230881/11496135
+ *
+ * Note: the conditions of this algorithm are met if adding a new entry for
+ * which no "prev" references exist in the database. However, already deleting
+ * an old entry and creating a new one with the same name would violate this
+ * condition. (I.e., when deleting entries, we don't try to maintain
+ * referential integrity [3] by also removing all "prev" entries pointing to
+ * it, which can cause the corresponding ordering relations to "come back"
+ * later.)
+ *
+ * Also, given that entries need to be copied when making changes, including
+ * automatic ones, like incrementing the HOTP counter, and thus generally move
+ * around, we can easily end up with a database where entries are stored in a
+ * sequence where the current algorithm fails to produce the expected results.
+ *
+ * [1] https://en.wikipedia.org/wiki/Topological_sorting#Relation_to_partial_orders
+ * [2] https://en.wikipedia.org/wiki/Sorting_algorithm#Stability
+ * [3] https://en.wikipedia.org/wiki/Referential_integrity
+ */
+
+/*
+ * Update:
+ * new_entry only sorts alphabetically. We now have db_tsort for proper
+ * topological sorting.
+ */
+
+static struct db_entry *new_entry(struct db *db, struct db_entry *dir,
+    const char *name)
+{
+	struct db_entry *de, **anchor;
+
+	de = alloc_entry(db, name, strlen(name));
+	de->parent = dir;
+	for (anchor = dir ? &dir->children : &db->entries; *anchor;
+	    anchor = &(*anchor)->next)
+		if (strcmp((*anchor)->name, name) > 0)
+			break;
+	de->next = *anchor;
+	*anchor = de;
+	names_add(names_of(db, dir), de);
+	return de;
+}
+
+
+/*
+ * new_uid returns a uid for a directory. Uids are not zero, and we make sure
+ * no other directory uses the same one.
+ */
+
+static bool uid_used(const struct db_entry *e, uint32_t uid)
+{
+	for (; e; e = e->next)
+		if (field_uid(e, ft_dir) == uid || uid_used(e->children, uid))
+			return 1;
+	return 0;
+}
+
+
+static uint32_t new_uid(const struct db *db)
+{
+	uint32_t uid;
+
+	do rnd_bytes(&uid, sizeof(uid));
+	while (!uid || uid_used(db->entries, uid));
+	return uid;
+}
+
+
+/*
+ * entry_path returns the path of "de", in the form used for ids, and sets *len
+ * to its length. The caller has to free the path.
+ */
+
+static char *entry_path(const struct db *db, const struct db_entry *de,
+    unsigned *len)
+{
+	const struct db_entry *parent = de->parent;
+	unsigned name_len = strlen(de->name);
+	char *path;
+
+	if (parent) {
+		char *tmp = entry_path(db, parent, len);
+
+		path = alloc_size(*len + 1 + name_len);
+		memcpy(path, tmp, *len);
+		path[(*len)++] = 0;
+		free(tmp);
+	} else {
+		path = alloc_size(name_len);
+		*len = 0;
+	}
+	memcpy(path + *len, de->name, name_len);
+	*len += name_len;
+	return path;
+}
+
+
+/*
+ * set_id sets the id of "de" for name "name" in directory "parent" (NULL for
+ * the top level). "fn" is add_field for new entries, and db_change_field
+ * otherwise.
+ */
+
+static bool set_id(struct db_entry *parent, struct db_entry *de,
+    const char *name, bool (*fn)(struct db_entry *de, enum field_type type,
+    const void *data, unsigned len))
+{
+	uint32_t uid = parent ? field_uid(parent, ft_dir) : 0;
+	unsigned name_len = strlen(name);
+	struct db_field *f;
+	bool ok;
+
+	if (uid) {
+		uint8_t buf[4];
+
+		put32(buf, uid);
+		/*
+		 * db_change_field copies the new id before deallocating the
+		 * old name, so "name" can be de->name.
+		 */
+		return fn(de, ft_id, name, name_len) &&
+		    fn(de, ft_parent, buf, sizeof(buf));
+	}
+	if (parent) {
+		unsigned path_len;
+		char *path = entry_path(de->db, parent, &path_len);
+		char *tmp = alloc_size(path_len + 1 + name_len);
+
+		memcpy(tmp, path, path_len);
+		tmp[path_len] = 0;
+		memcpy(tmp + path_len + 1, name, name_len);
+		ok = fn(de, ft_id, tmp, path_len + 1 + name_len);
+		free(tmp);
+		free(path);
+	} else {
+		ok = fn(de, ft_id, name, name_len);
+	}
+	/* only entries we change can have a parent field */
+	f = db_field_find(de, ft_parent);
+	return ok && (!f || db_delete_field(de, f));
+}
+
+
+struct db_entry *db_new_entry(struct db *db, const char *name)
+{
+	struct db_entry *de;
+	int new;
+
+	new = get_erased_block(db, pl_cold);
+	if (new < 0)
+		return NULL;
+	db->generation++;
+	de = new_entry(db, db->dir, name);
+	rnd_bytes(&de->seq, sizeof(de->seq));
+
+	set_id(db->dir, de, de->name, add_field);
+
+	sort_dir(db, db->dir);
+	if (place_entry(de, new) > 0 && storage_sync())
+		return de;
+	// @@@ complain
+	if (block_delete(new)) {
+		span_add(&db->deleted, new, 1);
+		db->stats.deleted++;
+	}
+	return NULL;
+}
+
+
+struct db_entry *db_dummy_entry(struct db *db, const char *name,
+    const char *prev)
+{
+	struct db_entry *de;
+
+	db->generation++;
+	de = new_entry(db, db->dir, name);
+	de->block = -1;
+	de->defer = 1;
+	set_id(db->dir, de, de->name, add_field);
+
+	if (prev)
+		add_field(de, ft_prev, prev, strlen(prev));
+	return de;
+}
+
+
+/* --- Database entries: sorting ------------------------------------------- */
+
+
+/*
+ * tsort_dir sorts the entries of one directory, and returns their number. It
+ * is based on Kahn's algorithm
+ * https://en.wikipedia.org/wiki/Topological_sorting#Kahn's_algorithm
+ * and places the entries in rounds: each round goes through the entries in the
+ * current order, and places those whose "prev" has already been placed. An
+ * entry therefore joins the round of its "prev" if it comes after the "prev",
+ * and the next round if it comes before. If a round places nothing, we break a
+ * cycle at the first entry not yet placed.
+ *
+ * Instead of going through all the entries in each round, we keep the entries
+ * that can be placed in a heap, ordered by round and then by their position.
+ * A hash table of the names finds the "prev" entries. Sorting n entries thus
+ * takes O(n log n) time.
+ */
+
+#define	TSORT_NONE	(~0u)
+
+struct tsort {
+	struct db_entry	*e;
+	unsigned	prev;		/* index of the "prev" entry */
+	unsigned	deps;		/* first entry with this "prev" */
+	unsigned	next_dep;	/* next entry with the same "prev" */
+	unsigned	round;		/* in which we place the entry */
+	bool		placed;
+};
+
+
+static unsigned tsort_slot(const struct tsort *t, const unsigned *names,
+    unsigned mask, const char *name, unsigned len)
+{
+	unsigned i = name_hash(name, len) & mask;
+
+	while (names[i]) {
+		const char *s = t[names[i] - 1].e->name;
+
+		if (strlen(s) == len && !memcmp(s, name, len))
+			break;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+
+static bool tsort_before(const struct tsort *t, unsigned a, unsigned b)
+{
+	return t[a].round != t[b].round ? t[a].round < t[b].round : a < b;
+}
+
+
+static void heap_push(const struct tsort *t, unsigned *heap, unsigned *n,
+    unsigned v)
+{
+	unsigned i = (*n)++;
+
+	while (i && tsort_before(t, v, heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = v;
+}
+
+
+static unsigned heap_pop(const struct tsort *t, unsigned *heap, unsigned *n)
+{
+	unsigned top = heap[0];
+	unsigned v = heap[--*n];
+	unsigned i = 0;
+
+	while (2 * i + 1 < *n) {
+		unsigned c = 2 * i + 1;
+
+		if (c + 1 < *n && tsort_before(t, heap[c + 1], heap[c]))
+			c++;
+		if (!tsort_before(t, heap[c], v))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = v;
+	return top;
+}
+
+
+static unsigned tsort_dir(struct db_entry **anchor)
+{
+	struct tsort *t;
+	struct db_entry *e;
+	unsigned *names, *heap;
+	unsigned n = 0, n_heap = 0, next = 0, round = 0;
+	unsigned size, i, j, k;
+
+	for (e = *anchor; e; e = e->next)
+		n++;
+	if (!n)
+		return 0;
+
+	/* allocate temporary variables */
+	t = alloc_type_n(struct tsort, n);
+	heap = alloc_type_n(unsigned, n);
+	for (size = 1; size < 2 * n; size <<= 1);
+	names = alloc_type_n(unsigned, size);
+	memset(names, 0, size * sizeof(unsigned));
+
+	/* if two entries have the same name, "prev" refers to the first one */
+	for (i = 0, e = *anchor; e; i++, e = e->next) {
+		unsigned *slot = names + tsort_slot(t, names, size - 1,
+		    e->name, strlen(e->name));
+
+		t[i].e = e;
+		t[i].deps = TSORT_NONE;
+		t[i].round = 0;
+		t[i].placed = 0;
+		if (!*slot)
+			*slot = i + 1;
+	}
+	for (i = 0; i != n; i++) {
+		const struct db_field *f = db_field_find(t[i].e, ft_prev);
+
+		j = f ? names[tsort_slot(t, names, size - 1, f->data, f->len)] :
+		    0;
+		if (j) {
+			t[i].prev = j - 1;
+			t[i].next_dep = t[j - 1].deps;
+			t[j - 1].deps = i;
+		} else {
+			/* ignore unmatched references */
+			t[i].prev = TSORT_NONE;
+			heap_push(t, heap, &n_heap, i);
+		}
+	}
+
+	/* place the entries, and apply the new order */
+	for (j = 0; j != n; j++) {
+		if (!n_heap) {
+			/* break cycles */
+			while (t[next].placed)
+				next++;
+			t[next].prev = TSORT_NONE;
+			t[next].round = round + 1;
+			heap_push(t, heap, &n_heap, next);
+		}
+		k = heap_pop(t, heap, &n_heap);
+		round = t[k].round;
+		t[k].placed = 1;
+		*anchor = t[k].e;
+		anchor = &t[k].e->next;
+		for (i = t[k].deps; i != TSORT_NONE; i = t[i].next_dep)
+			if (t[i].prev != TSORT_NONE) {
+				t[i].prev = TSORT_NONE;
+				t[i].round = i < k ? round + 1 : round;
+				heap_push(t, heap, &n_heap, i);
+			}
+	}
+	*anchor = NULL;
+
+	free(names);
+	free(heap);
+	free(t);
+
+	return n;
+}
+
+
+static unsigned tsort_tree(struct db_entry **anchor)
+{
+	struct db_entry *e;
+	unsigned total;
+
+	total = tsort_dir(anchor);
+	for (e = *anchor; e; e = e->next)
+		if (e->children)
+			total += tsort_tree(&e->children);
+	return total;
+}
+
+
+/*
+ * sort_dir sorts only directory "dir" (NULL for the top level). We use it
+ * after changes that cannot affect the order of other directories.
+ */
+
+static unsigned sort_dir(struct db *db, struct db_entry *dir)
+{
+	unsigned n;
+
+	n = tsort_dir(dir ? &dir->children : &db->entries);
+	if (n)
+		db->generation++;
+	return n;
+}
+
+
+unsigned db_tsort(struct db *db)
+{
+	unsigned n;
+
+	n = tsort_tree(&db->entries);
+	if (n)
+		db->generation++;
+	return n;
+}
+
+
+/* --- Database entries: reordering ---------------------------------------- */
+
+
+/*
+ * is_prev determines if "prev" is the immediate predecessor of "e". If "prev"
+ * is NULL, we return "1" if "e" has no predecessor.
+ */
+
+static bool is_prev(const struct db_entry *prev, const struct db_entry *e)
+{
+	const struct db_field *f = db_field_find(e, ft_prev);
+
+	if (!prev && !f)
+		return 1;
+	if (!prev || !f)
+		return 0;
+	if (strlen(prev->name) != f->len)
+		return 0;
+	return !memcmp(prev->name, f->data, f->len);
+}
+
+
+/*
+ * Update the ids below "dir" after renaming or moving it. Entries whose id does
+ * not change are not written. If "dir" has no uid yet, we give it one, so that
+ * we don't have to rewrite its children again next time.
+ */
+
+static bool tree_id_update(struct db *db, struct db_entry *dir)
+{
+	struct db_entry *e;
+	bool ok = 1;
+
+	if (!dir->children)
+		return 1;
+	if (!field_uid(dir, ft_dir)) {
+		uint8_t uid[4];
+
+		put32(uid, new_uid(db));
+		if (!db_change_field(dir, ft_dir, uid, sizeof(uid)))
+			return 0;
+	}
+	for (e = dir->children; e; e = e->next) {
+		if (!set_id(dir, e, e->name, db_change_field))
+			ok = 0;
+		if (!tree_id_update(db, e))
+			ok = 0;
+	}
+	return ok;
+}
+
+
+static void tree_move(struct db_entry *dir, struct db_entry *e)
+{
+	struct db *db = e->db;
+	struct db_entry **new_anchor = dir ? &dir->children : &db->entries;
+	struct db_entry **old_anchor;
+
+	if (e->parent == dir)
+		return;
+
+	old_anchor = find_anchor(e);
+	assert(old_anchor);
+	
+	*old_anchor = e->next;
+	e->next = *new_anchor;
+	*new_anchor = e;
+	names_remove(names_of(db, e->parent), e);
+	names_add(names_of(db, dir), e);
+	e->parent = dir;
+	resort(db, dir);
+
+	/* db_move_after runs in a transaction, so this does not sort yet */
+	if (*old_anchor) {
+		struct db_field *f = db_field_find(*old_anchor, ft_prev);
+
+		if (f)
+			db_delete_field(*old_anchor, f);
+	}
+}
+
+
+void db_move_after(struct db_entry *e, const struct db_entry *after)
+{
+	struct db *db = e->db;
+	struct db_entry *dir = db->dir ? db->dir->children : db->entries;
+	struct db_entry *e2;
+	struct db_field *f = db_field_find(e, ft_prev);
+
+	assert(e != db->dir);
+	assert(!db_is_descendent(e, db->dir));
+
+	assert(!after || e->db == after->db);
+	if (after) {
+		if (debugging)
+			printf("move_after: %s -> %s\n", e->name, after->name);
+	} else {
+		if (debugging)
+			printf("move_after: %s -> TOP\n", e->name);
+	}
+
+	/* @@@ is this the right place to handle moving after itself ? */
+	if (e == after) {
+		if (debugging)
+			printf("to self\n");
+		return;
+	}
+
+	/*
+	 * All the changes are written (and the database is sorted) when we
+	 * commit. Until then, the order of the list does not change.
+	 */
+	db_begin(db);
+
+	if (debugging)
+		printf("followers:\n");
+again:
+	f = db_field_find(e, ft_prev);
+	for (e2 = dir; e2; e2 = e2->next)
+		if (e2 != e && is_prev(e, e2)) {
+			if (f) {
+				db_change_field(e2, ft_prev, f->data, f->len);
+			} else {
+				struct db_field *f2 =
+				    db_field_find(e2, ft_prev);
+
+				assert(f2);
+				db_delete_field(e2, f2);
+			}
+			goto again;
+		}
+
+	if (debugging)
+		printf("followers2:\n");
+again2:
+	for (e2 = dir; e2; e2 = e2->next) {
+		if (debugging)
+			printf("\t%s: %p =? %p, (%s) %u\n",
+			    e2->name, e2, e, e->name, is_prev(e, e2));
+		if (e2 != e && is_prev(after, e2)) {
+			db_change_field(e2, ft_prev, e->name, strlen(e->name));
+			goto again2;
+		}
+	}
+
+	if (after) {
+		db_change_field(e, ft_prev, after->name,
+		    strlen(after->name));
+	} else {
+		if (f)
+			db_delete_field(e, f);
+	}
+
+	set_id(db->dir, e, e->name, db_change_field);
+	tree_id_update(db, e);
+	tree_move(db->dir, e);
+
+	db_commit(db);
+}
+
+
+void db_move_before(struct db_entry *e, const struct db_entry *before)
+{
+	struct db *db = e->db;
+	struct db_entry *dir = db->dir ? db->dir->children : db->entries;
+	const struct db_entry *prev;
+
+	assert(!before || e->db == before->db);
+	if (before == dir) {
+		prev = NULL;
+	} else if (before) {
+		if (debugging)
+			printf("move_before: %s -> %s\n",
+			    e->name, before->name);
+		for (prev = dir; prev; prev = prev->next)
+			if (prev->next == before)
+				break;
+		assert(prev);
+	} else {
+		if (debugging)
+			printf("move_before: %s -> END\n", e->name);
+		for (prev = dir; prev && prev->next; prev = prev->next);
+	}
+	db_move_after(e, prev);
+}
+
+
+/* --- Database entries: deletion ------------------------------------------ */
+
+
+bool db_delete_entry(struct db_entry *de)
+{
+	struct db *db = de->db;
+	struct db_entry **anchor;
+
+	if (!invalidate_index(db))
+		return 0;
+	names_remove(names_of(db, de->parent), de);
+	anchor = find_anchor(de);
+	*anchor = de->next;
+
+	sort_dir(db, de->parent);
+
+	if (de->packed) {
+		bool ok = pack_remove(db, de->block);
+
+		free_entry(de);
+		return ok && storage_sync();
+	}
+	if (!block_delete(de->block))
+		return 0;
+	span_add(&db->deleted, de->block, 1);
+	db->stats.data--;
+	db->stats.deleted++;
+	/* without the first block, the parts are no longer used */
+	chain_drop(db, de->parts, de->n_parts);
+	de->parts = NULL;
+	free_entry(de);
+	return storage_sync();
+}
+
+
+/* --- Database entries: iteration ----------------------------------------- */
+
+
+bool db_iterate(struct db *db, bool (*fn)(void *user, struct db_entry *de),
+    void *user)
+{
+	struct db_entry *de, *next;
+
+	for (de = db->dir ? db->dir->children : db->entries; de; de = next) {
+		next = de->next;
+		if (!fn(user, de))
+			return 0;
+	}
+	return 1;
+}
+
+
+/* --- Directory operations ------------------------------------------------ */
+
+
+bool db_is_dir(const struct db_entry *de)
+{
+	const struct db_field *f;
+
+	for (f = de->fields; f; f = f->next)
+		if (f->type == ft_dir)
+			return 1;
+	return !!de->children;
+}
+
+
+bool db_is_account(const struct db_entry *de)
+{
+	const struct db_field *f;
+
+	if (de->children)
+		return 0;
+	db_entry_load(de);
+	for (f = de->fields; f; f = f->next)
+		switch (f->type) {
+		case ft_id:
+		case ft_prev:
+		case ft_parent:
+			break;
+		case ft_dir:
+			return 0;
+		default:
+			return 1;
+		}
+	return 0;
+}
+
+
+void db_mkdir(struct db_entry *de)
+{
+	uint8_t uid[4];
+
+	assert(!db_is_dir(de));
+	assert(!db_is_account(de));
+	put32(uid, new_uid(de->db));
+	db_change_field(de, ft_dir, uid, sizeof(uid));
+}
+
+
+void db_mkentry(struct db_entry *de)
+{
+	assert(db_is_dir(de));
+	assert(!de->children);
+	db_delete_field(de, db_field_find(de, ft_dir));
+}
+
+
+void db_chdir(struct db *db, struct db_entry *de)
+{
+	db->dir = de;
+}
+
+
+struct db_entry *db_dir_parent(const struct db *db)
+{
+	return db->dir ? db->dir->parent : NULL;
+}
+
+
+const char *db_pwd(const struct db *db)
+{
+	return db->dir ? db->dir->name : NULL;
+}
+
+
+/* --- Consistency check --------------------------------------------------- */
+
+
+static bool names_has(const struct db_names *t, const struct db_entry *de)
+{
+	const struct db_entry *e;
+
+	if (!t->size)
+		return 0;
+	for (e = t->bucket[name_hash(de->name, strlen(de->name)) &
+	    (t->size - 1)]; e; e = e->name_next)
+		if (e == de)
+			return 1;
+	return 0;
+}
+
+
+static bool check_dir(const struct db *db, const struct db_entry *dir)
+{
+	const struct db_names *t = dir ? &dir->names : &db->names;
+	const struct db_entry *e;
+	const char *name = dir ? dir->name : "(top)";
+	unsigned n = 0;
+	unsigned i;
+	bool ok = 1;
+
+	for (e = dir ? dir->children : db->entries; e; e = e->next) {
+		if (++n > t->n) {
+			debug("db_check: %s has more than %u entries\n",
+			    name, t->n);
+			return 0;
+		}
+		if (e->db != db) {
+			debug("db_check: %s/%s: wrong database\n",
+			    name, e->name);
+			ok = 0;
+		}
+		if (!names_has(t, e)) {
+			debug("db_check: %s/%s: name not found\n",
+			    name, e->name);
+			ok = 0;
+		}
+		for (i = 0; i != e->n_parts; i++)
+			if (!e->parts[i].block) {
+				debug("db_check: %s/%s: part %u is missing\n",
+				    name, e->name, i + 1);
+				ok = 0;
+			}
+		/* don't follow loops */
+		if (e->parent != dir) {
+			debug("db_check: %s/%s: parent is %s\n", name, e->name,
+			    e->parent ? e->parent->name : "(top)");
+			ok = 0;
+		} else if (!check_dir(db, e)) {
+			ok = 0;
+		}
+	}
+	if (n != t->n) {
+		debug("db_check: %s has %u entries, not %u\n", name, n, t->n);
+		ok = 0;
+	}
+	return ok;
+}
+
+
+bool db_check(const struct db *db)
+{
+	const struct db_entry *e;
+	bool ok;
+
+	ok = check_dir(db, NULL);
+	for (e = db->dir; e; e = e->parent)
+		if (!names_has(e->parent ? &e->parent->names : &db->names, e)) {
+			debug("db_check: current directory %s is not in the "
+			    "tree\n", db->dir->name);
+			ok = 0;
+			break;
+		}
+	if (db->pending) {
+		debug("db_check: entries are still pending\n");
+		ok = 0;
+	}
+	return ok;
+}
+
+
+/* --- Settings ------------------------------------------------------------ */
+
+
+bool db_update_settings(struct db *db, uint16_t seq,
+    const void *payload, unsigned length)
+{
+	int new;
+
+	new = get_erased_block(db, pl_hot);
+	if (new < 0)
+		return 0;
+	if (block_write(db->c, bt_settings, seq, payload, length, new)) {
+		db->stats.special++;
+		if (db->settings_block != -1) {
+			if (block_delete(db->settings_block)) {
+				span_add(&db->deleted, db->settings_block, 1);
+				db->stats.deleted++;
+				db->stats.special--;
+			}
+		}
+		db->settings_block = new;
+		return storage_sync();
+	} else {
+		if (block_delete(new)) {
+			span_add(&db->deleted, new, 1);
+			db->stats.deleted++;
+		}
+		return 0;
+	}
+}
+
+
+/* --- Wear leveling ------------------------------------------------------- */
+
+
+/*
+ * Blocks that are rewritten often cycle through the least worn units. Units
+ * holding entries that never change would never be erased, so relocate_cold
+ * moves such entries to the most worn unit when the difference in erase
+ * counts exceeds WEAR_SPREAD.
+ *
+ * The erase counts of the units after the reserved blocks are stored in
+ * bt_wear blocks. A block contains the lowest count (16 bits), followed by one
+ * byte per erase unit, with the difference to the lowest count, saturated at
+ * 255. For 2 MB of storage, this is 512 bytes, which fits also with the
+ * maximum number of readers, if the blocks are 1 kB or larger.
+ *
+ * If the counts don't fit into one block, they are split into "parts" of
+ * wear_part_units() consecutive units, and each part begins with its number
+ * (8 bits). With 256-byte blocks, 2 MB need five parts. Each part has its own
+ * lowest count, so parts can be read independently.
+ *
+ * We save all parts every WEAR_SAVE_ERASES erases, so a crash may lose a few
+ * erases, and some parts may then be older than others.
+ */
+
+#define	WEAR_SPREAD		64	/* relocate cold data beyond this */
+#define	WEAR_SAVE_ERASES	16	/* save the counts after this many erases */
+
+
+struct db_wear_part {
+	int		block;	/* -1 if not saved */
+	uint16_t	seq;
+};
+
+
+static unsigned wear_first_unit(void)
+{
+	unsigned erase_size = storage_erase_size();
+
+	return (RESERVED_BLOCKS + erase_size - 1) / erase_size;
+}
+
+
+/* number of units with erase counts */
+
+static unsigned wear_units(const struct db *db)
+{
+	return db->stats.total / storage_erase_size() - wear_first_unit();
+}
+
+
+/* bytes before the counts: a part number, unless there is only one part */
+
+static unsigned wear_hdr(const struct db *db)
+{
+	return wear_units(db) + 2 <= block_safe_payload() ? 2 : 3;
+}
+
+
+static unsigned wear_part_units(const struct db *db)
+{
+	return block_safe_payload() - wear_hdr(db);
+}
+
+
+static unsigned wear_parts(const struct db *db)
+{
+	return (wear_units(db) + wear_part_units(db) - 1) /
+	    wear_part_units(db);
+}
+
+
+static struct db_wear_part *wear_part(struct db *db)
+{
+	unsigned n = wear_parts(db);
+	unsigned i;
+
+	if (!db->wear_part) {
+		db->wear_part = alloc_type_n(struct db_wear_part, n);
+		for (i = 0; i != n; i++)
+			db->wear_part[i].block = -1;
+	}
+	return db->wear_part;
+}
+
+
+static bool wear_save_part(struct db *db, unsigned part)
+{
+	struct db_wear_part *p = wear_part(db) + part;
+	unsigned units = db->stats.total / storage_erase_size();
+	unsigned first = wear_first_unit() + part * wear_part_units(db);
+	unsigned end = first + wear_part_units(db);
+	unsigned hdr = wear_hdr(db);
+	const uint32_t *counts = wear_counts(db);
+	uint32_t base = UINT32_MAX;
+	unsigned size, i;
+	int new;
+
+	if (end > units)
+		end = units;
+	size = hdr + end - first;
+	new = get_erased_block(db, pl_hot);
+	if (new < 0)
+		return 0;
+
+	for (i = first; i != end; i++)
+		if (counts[i] < base)
+			base = counts[i];
+	if (base > 0xffff)
+		base = 0xffff;
+	if (hdr == 3)
+		*payload_buf = part;
+	put16(payload_buf + hdr - 2, base);
+	for (i = first; i != end; i++)
+		payload_buf[hdr + i - first] =
+		    counts[i] - base > 255 ? 255 : counts[i] - base;
+
+	if (!block_write(db->c, bt_wear, db->wear_seq + 1, payload_buf, size,
+	    new)) {
+		memset(payload_buf, 0, size);
+		if (block_delete(new)) {
+			span_add(&db->deleted, new, 1);
+			db->stats.deleted++;
+		}
+		return 0;
+	}
+	memset(payload_buf, 0, size);
+	db->stats.special++;
+	if (p->block != -1) {
+		if (block_delete(p->block)) {
+			span_add(&db->deleted, p->block, 1);
+			db->stats.deleted++;
+			db->stats.special--;
+		}
+	}
+	p->block = new;
+	p->seq = db->wear_seq + 1;
+	return 1;
+}
+
+
+static bool wear_save(struct db *db)
+{
+	unsigned i;
+
+	for (i = 0; i != wear_parts(db); i++)
+		if (!wear_save_part(db, i)) {
+			debug("wear_save: cannot save part %u\n", i);
+			return 0;
+		}
+	db->wear_seq++;
+	db->wear_dirty = 0;
+	return 1;
+}
+
+
+/*
+ * wear_part_of returns the part the payload of a bt_wear block belongs to, or
+ * -1 if the payload is not valid.
+ */
+
+static int wear_part_of(const struct db *db, const uint8_t *payload,
+    unsigned len)
+{
+	unsigned part = wear_hdr(db) == 2 ? 0 : *payload;
+	unsigned units = wear_units(db) - part * wear_part_units(db);
+
+	if (part >= wear_parts(db))
+		return -1;
+	if (units > wear_part_units(db))
+		units = wear_part_units(db);
+	/* the payload is padded to fill the block */
+	if (len < wear_hdr(db) + units)
+		return -1;
+	return part;
+}
+
+
+/*
+ * Returns 0 if the block is not usable, e.g., because we already have a newer
+ * one for the same part. If the block replaces an older one, we delete the
+ * latter.
+ */
+
+static bool wear_process(struct db *db, unsigned n, uint16_t seq,
+    const uint8_t *payload, unsigned len)
+{
+	unsigned units = db->stats.total / storage_erase_size();
+	unsigned hdr = wear_hdr(db);
+	int part = wear_part_of(db, payload, len);
+	struct db_wear_part *p;
+	bool saved = 0;
+	uint32_t *counts;
+	unsigned first, end, base, i;
+
+	if (part < 0)
+		return 0;
+	for (i = 0; i != wear_parts(db); i++)
+		if (wear_part(db)[i].block != -1)
+			saved = 1;
+	p = wear_part(db) + part;
+	if (p->block != -1) {
+		if ((int16_t) (seq - p->seq) <= 0)
+			return 0;
+		db->stats.special--;
+		if (block_delete(p->block)) {
+			span_add(&db->deleted, p->block, 1);
+			db->stats.deleted++;
+		} else {
+			db->stats.error++;
+		}
+	}
+	counts = wear_counts(db);
+	first = wear_first_unit() + part * wear_part_units(db);
+	end = first + wear_part_units(db);
+	if (end > units)
+		end = units;
+	base = get16(payload + hdr - 2);
+	for (i = first; i != end; i++)
+		counts[i] = base + payload[hdr + i - first];
+	p->block = n;
+	p->seq = seq;
+	if (!saved || (int16_t) (seq - db->wear_seq) > 0)
+		db->wear_seq = seq;
+	return 1;
+}
+
+
+/* --- Moving entries out of an erase unit --------------------------------- */
+
+
+/*
+ * Find an entry stored in the given range. Entries with deferred updates don't
+ * count, since we can't move them.
+ */
+
+static bool block_in(unsigned block, unsigned n, unsigned size)
+{
+	return block >= n && block < n + size;
+}
+
+
+static struct db_entry *entry_in(struct db_entry *list, unsigned n,
+    unsigned size)
+{
+	struct db_entry *de, *found;
+	unsigned i;
+
+	for (de = list; de; de = de->next) {
+		if (de->block && !de->defer && block_in(de->block, n, size))
+			return de;
+		for (i = 0; i != de->n_parts; i++)
+			if (!de->defer && block_in(de->parts[i].block, n, size))
+				return de;
+		found = entry_in(de->children, n, size);
+		if (found)
+			return found;
+	}
+	return NULL;
+}
+
+
+/*
+ * Count the blocks of entries we can move in each erase unit. Packs are
+ * counted separately, by movable_blocks. A unit with a block of an entry that
+ * has deferred updates, including a pack with such an entry, is marked as
+ * UNIT_PINNED: moving a pack rewrites all its members, and we can't write the
+ * deferred changes yet.
+ */
+
+#define	UNIT_PINNED	0xff
+
+
+static void count_block(uint8_t *entries, unsigned block, bool pin)
+{
+	uint8_t *e = entries + block / storage_erase_size();
+
+	if (pin)
+		*e = UNIT_PINNED;
+	else if (*e != UNIT_PINNED)
+		(*e)++;
+}
+
+
+static void count_entries(const struct db_entry *list, uint8_t *entries)
+{
+	const struct db_entry *de;
+	unsigned i;
+
+	for (de = list; de; de = de->next) {
+		if (de->block && (de->defer || !de->packed))
+			count_block(entries, de->block, de->defer);
+		for (i = 0; i != de->n_parts; i++)
+			if (de->parts[i].block)
+				count_block(entries, de->parts[i].block,
+				    de->defer);
+		count_entries(de->children, entries);
+	}
+}
+
+
+/*
+ * Return the number of live blocks in the erase unit starting at block "n", or
+ * -1 if some of them are not entries we can move (e.g., settings).
+ */
+
+static int movable_blocks(struct db *db, unsigned n, const uint8_t *entries)
+{
+	unsigned erase_size = storage_erase_size();
+	unsigned live;
+
+	if (entries[n / erase_size] == UNIT_PINNED)
+		return -1;
+	live = erase_size - span_count(db->erased, n, erase_size) -
+	    span_count(db->deleted, n, erase_size) -
+	    span_count(db->empty, n, erase_size);
+	return entries[n / erase_size] + span_count(db->packs, n, erase_size) ==
+	    live ? (int) live : -1;
+}
+
+
+/*
+ * Move all entries out of the erase unit starting at block "n", so that
+ * erase_unit can pick it. We give up any erased blocks in the unit, so that we
+ * don't move entries into it. They are erased with the rest of the unit.
+ */
+
+static bool move_unit(struct db *db, unsigned n)
+{
+	unsigned erase_size = storage_erase_size();
+	struct db_entry *de;
+	int i;
+
+	while (1) {
+		i = span_pull_range(&db->erased, n, erase_size);
+		if (i < 0)
+			break;
+		span_add(&db->deleted, i, 1);
+		db->stats.erased--;
+		db->stats.deleted++;
+	}
+	while ((de = entry_in(db->entries, n, erase_size))) {
+		int new;
+
+		if (!db_entry_load(de))
+			return 0;
+		new = get_erased_block(db, pl_cold);
+		if (new < 0)
+			return 0;
+		if (!do_update_entry(de, new, n, n + erase_size))
+			return 0;
+		db->stats.relocated++;
+	}
+	return 1;
+}
+
+
+/*
+ * If no erase unit is free of live blocks, pick the one with the fewest live
+ * blocks (and the lowest erase count) and move them elsewhere.
+ */
+
+static bool compact(struct db *db)
+{
+	unsigned erase_size = storage_erase_size();
+	unsigned units = db->stats.total / erase_size;
+	const uint32_t *counts = wear_counts(db);
+	int best = -1, best_live = 0;
+	uint8_t *entries;
+	unsigned i;
+
+	entries = alloc_size(units);
+	memset(entries, 0, units);
+	count_entries(db->entries, entries);
+	for (i = wear_first_unit(); i != units; i++) {
+		unsigned n = i * erase_size;
+		int live;
+
+		if (!span_count(db->deleted, n, erase_size) &&
+		    !span_count(db->empty, n, erase_size))
+			continue;
+		live = movable_blocks(db, n, entries);
+		if (live < 0)
+			continue;
+		/* we need erased blocks outside the unit to move to */
+		if (live + span_count(db->erased, n, erase_size) >
+		    db->stats.erased)
+			continue;
+		if (best < 0 || live < best_live || (live == best_live &&
+		    counts[i] < counts[best / erase_size])) {
+			best = n;
+			best_live = live;
+		}
+	}
+	free(entries);
+	return best >= 0 && move_unit(db, best);
+}
+
+
+static bool relocate_cold(struct db *db)
+{
+	unsigned erase_size = storage_erase_size();
+	unsigned units = db->stats.total / erase_size;
+	const uint32_t *counts = wear_counts(db);
+	int src = -1, dest;
+	uint8_t *entries;
+	unsigned i;
+
+	/* don't sacrifice the index or the erased blocks for this */
+	if (db->wear_balanced || db->index_parts ||
+	    db->stats.erased < db->erased_high)
+		return 0;
+	dest = span_pick_unit(db->erased, counts, 0, 1, -1);
+	if (dest < 0)
+		return 0;
+	entries = alloc_size(units);
+	memset(entries, 0, units);
+	count_entries(db->entries, entries);
+	for (i = wear_first_unit(); i != units; i++) {
+		unsigned n = i * erase_size;
+
+		if (counts[i] + WEAR_SPREAD > counts[dest / erase_size])
+			continue;
+		if (src >= 0 && counts[i] >= counts[src / erase_size])
+			continue;
+		if (movable_blocks(db, n, entries) > 0)
+			src = n;
+	}
+	free(entries);
+	if (src < 0) {
+		db->wear_balanced = 1;
+		return 0;
+	}
+	return move_unit(db, src);
+}
+
+
+/* --- Background erasing -------------------------------------------------- */
+
+
+/*
+ * We start erasing when the number of erased blocks drops below
+ * db->erased_low, and continue until it reaches db->erased_high, or until
+ * there is nothing left to erase. If no unit can be erased, we move the live
+ * blocks out of the unit that has the fewest. Each call erases at most one
+ * erase unit or moves the content of one unit, so that the caller can check
+ * for user input in between.
+ */
+
+bool db_reclaim(struct db *db)
+{
+	if (!db->reclaiming && db->stats.erased < db->erased_low)
+		db->reclaiming = 1;
+	if (db->reclaiming) {
+		if (db->stats.erased < db->erased_high && erase_unit(db)) {
+			db->stats.bg_erases++;
+			/*
+			 * Saving the counts invalidates the index. We leave it
+			 * to turn_off to write a new one, so that each hint we
+			 * use up saves a full scan.
+			 */
+			if (db->wear_dirty >= WEAR_SAVE_ERASES &&
+			    !wear_save(db))
+				return 0;
+			return storage_sync();
+		}
+		if (db->stats.erased < db->erased_high && compact(db))
+			return storage_sync();
+		db->reclaiming = 0;
+	}
+	if (db->patch_blocks == DB_PATCH_BLOCKS)
+		return patch_fold(db) && storage_sync();
+	return relocate_cold(db) && storage_sync();
+}
+
+
+/* --- Fix remaining virtual entries --------------------------------------- */
+
+
+/*
+ * The database may contain some anomalies we fix here:
+ * - entries in a directory for which no entry exists, or
+ * - directory entries without the ft_dir field.
+ * In both cases, we add an ft_dir field, so that other parts of the system do
+ * not get confused about the status of an entry. (E.g., after deleting all
+ * entries in a directory, it would look like an account record without fields
+ * if it didn't have an ft_dir field.)
+ * Virtual entries also get an id. "dir" is the directory containing "list".
+ */
+
+static void fix_virtual(struct db_entry *dir, struct db_entry *list)
+{
+	struct db_entry *e;
+
+	for (e = list; e; e = e->next) {
+		/*
+		 * @@@ note: we do not assign a block here. This only happens
+		 * if we make changes to the directory entry.
+		 */
+		if (!db_field_find(e, ft_dir) && (e->children || !e->block)) {
+			add_field(e, ft_dir, NULL, 0);
+			if (!e->block)
+				set_id(dir, e, e->name, add_field);
+		}
+		fix_virtual(e, e->children);
+	}
+}
+
+
+/* --- Placing entries that refer to their directory by uid ---------------- */
+
+
+/*
+ * Entries on db->pending refer to their directory by uid (see field_uid).
+ * place_pending moves them into the tree, and finds the directories in a hash
+ * table.
+ *
+ * If we crash while updating entries, we may find two copies of a directory
+ * with the same uid, or two entries with the same name in a directory. In
+ * either case, we keep the newer copy, give it the children of the older one,
+ * and drop the older one. Entries whose directory does not exist, or that
+ * would end up in their own subtree, are put at the top level.
+ *
+ * Unlike process_payload, we delete the blocks of the copies we drop, unless
+ * they are in a pack. (drop_stale_packs deletes packs that no longer contain
+ * any current entries.)
+ */
+
+enum uid_state {
+	us_placed,	/* in the tree */
+	us_pending,	/* not placed yet */
+	us_placing,	/* looking for its own directory */
+};
+
+struct uid_slot {
+	struct db_entry	*de;
+	enum uid_state	state;
+};
+
+struct uid_map {
+	struct uid_slot	*slots;
+	unsigned	mask;
+	struct db_entry	*dropped;	/* free when done */
+};
+
+
+static bool is_newer(const struct db_entry *a, const struct db_entry *b)
+{
+	if (!b->block)
+		return 1;
+	if (!a->block)
+		return 0;
+	return ((a->seq + 0x10000 - b->seq) & 0xffff) < 0x8000;
+}
+
+
+static struct uid_slot *uid_slot(const struct uid_map *map, uint32_t uid)
+{
+	unsigned i = uid & map->mask;
+
+	while (map->slots[i].de && field_uid(map->slots[i].de, ft_dir) != uid)
+		i = (i + 1) & map->mask;
+	return map->slots + i;
+}
+
+
+static void adopt(struct uid_map *map, struct db_entry *dir,
+    struct db_entry *e);
+
+
+/*
+ * "old" is dropped in favour of "e". Children of "old", and entries that still
+ * have to find "old" by its uid, go to "e" instead.
+ */
+
+static void supersede(struct uid_map *map, struct db_entry *e,
+    struct db_entry *old)
+{
+	uint32_t uid = field_uid(old, ft_dir);
+	struct db_entry *children = old->children;
+
+	if (uid) {
+		struct uid_slot *s = uid_slot(map, uid);
+
+		if (s->de == old) {
+			s->de = e;
+			s->state = us_placed;
+		}
+	}
+	old->children = NULL;
+	old->next = map->dropped;
+	map->dropped = old;
+	while (children) {
+		struct db_entry *next = children->next;
+
+		adopt(map, e, children);
+		children = next;
+	}
+}
+
+
+/*
+ * Put "e" into directory "dir", or merge it with the entry of the same name.
+ */
+
+static void adopt(struct uid_map *map, struct db_entry *dir,
+    struct db_entry *e)
+{
+	struct db *db = e->db;
+	struct db_entry **anchor = dir ? &dir->children : &db->entries;
+	struct db_names *t = names_of(db, dir);
+	struct db_entry *old;
+
+	e->parent = dir;
+	old = db_lookup(db, dir, e->name, strlen(e->name));
+	if (!old) {
+		/* sort_tree sorts the directory later */
+		e->next = *anchor;
+		*anchor = e;
+		names_add(t, e);
+	} else if (is_newer(e, old)) {
+		while (*anchor != old)
+			anchor = &(*anchor)->next;
+		e->next = old->next;
+		*anchor = e;
+		names_remove(t, old);
+		names_add(t, e);
+		supersede(map, e, old);
+	} else {
+		supersede(map, old, e);
+	}
+}
+
+
+static void place(struct uid_map *map, struct db_entry *e)
+{
+	uint32_t uid = field_uid(e, ft_parent);
+	struct db_entry *dir = NULL;
+
+	if (uid) {
+		struct uid_slot *s = uid_slot(map, uid);
+
+		if (s->de && s->state == us_pending) {
+			s->state = us_placing;
+			place(map, s->de);
+			s->state = us_placed;
+		}
+		if (s->de && s->state == us_placed)
+			dir = s->de;
+	}
+	adopt(map, dir, e);
+}
+
+
+static unsigned count_uids(const struct db_entry *e)
+{
+	unsigned n = 0;
+
+	for (; e; e = e->next)
+		n += !!field_uid(e, ft_dir) + count_uids(e->children);
+	return n;
+}
+
+
+static void collect_uids(struct db_entry *e, struct db_entry **dirs,
+    unsigned *n)
+{
+	for (; e; e = e->next) {
+		if (field_uid(e, ft_dir))
+			dirs[(*n)++] = e;
+		collect_uids(e->children, dirs, n);
+	}
+}
+
+
+/*
+ * Add the directory "e" to the hash table. If we already have a directory with
+ * the same uid, we keep the newer one, and return the other.
+ */
+
+static struct db_entry *add_uid(struct uid_map *map, struct db_entry *e,
+    enum uid_state state)
+{
+	struct uid_slot *s = uid_slot(map, field_uid(e, ft_dir));
+	struct db_entry *old = s->de;
+
+	if (old && !is_newer(e, old))
+		return e;
+	s->de = e;
+	s->state = state;
+	return old;
+}
+
+
+static void place_pending(struct db *db)
+{
+	struct uid_map map = { .dropped = NULL };
+	struct db_entry **pending, **dirs;
+	unsigned n_pending = 0, n_dirs = 0, n_tree, size, i, j;
+	struct db_entry *e;
+
+	if (!db->pending)
+		return;
+	for (e = db->pending; e; e = e->next)
+		n_pending++;
+	pending = alloc_type_n(struct db_entry *, n_pending);
+	for (i = 0; db->pending; i++) {
+		pending[i] = db->pending;
+		db->pending = db->pending->next;
+	}
+
+	dirs = alloc_type_n(struct db_entry *,
+	    count_uids(db->entries) + n_pending);
+	collect_uids(db->entries, dirs, &n_dirs);
+	n_tree = n_dirs;
+	for (i = 0; i != n_pending; i++)
+		if (field_uid(pending[i], ft_dir))
+			dirs[n_dirs++] = pending[i];
+
+	for (size = 1; size <= 2 * n_dirs; size <<= 1);
+	map.slots = alloc_type_n(struct uid_slot, size);
+	memset(map.slots, 0, size * sizeof(struct uid_slot));
+	map.mask = size - 1;
+
+	/* keep the newest copy of each directory */
+	for (i = 0; i != n_dirs; i++)
+		dirs[i] = add_uid(&map, dirs[i],
+		    i < n_tree ? us_placed : us_pending);
+	for (i = 0; i != n_dirs; i++) {
+		struct db_entry **anchor;
+
+		e = dirs[i];
+		if (!e)
+			continue;
+		for (j = 0; j != n_pending; j++)
+			if (pending[j] == e)
+				break;
+		if (j != n_pending) {
+			pending[j] = NULL;
+		} else {
+			/* may have been dropped while merging */
+			anchor = find_anchor(e);
+			if (!anchor)
+				continue;
+			names_remove(names_of(db, e->parent), e);
+			*anchor = e->next;
+		}
+		supersede(&map, uid_slot(&map, field_uid(e, ft_dir))->de, e);
+	}
+
+	for (i = 0; i != n_pending; i++) {
+		struct uid_slot *s;
+
+		e = pending[i];
+		if (!e)
+			continue;
+		if (!field_uid(e, ft_dir)) {
+			place(&map, e);
+			continue;
+		}
+		s = uid_slot(&map, field_uid(e, ft_dir));
+		if (s->de == e && s->state == us_pending) {
+			s->state = us_placing;
+			place(&map, e);
+			s->state = us_placed;
+		}
+	}
+
+	while (map.dropped) {
+		e = map.dropped;
+		map.dropped = e->next;
+		if (e->block && !e->packed) {
+			if (retire_block(db, e->block))
+				db->stats.data--;
+			else
+				db->stats.error++;
+		}
+		free_entry(e);
+	}
+	free(map.slots);
+	free(dirs);
+	free(pending);
+}
+
+
+/* --- Open/close the account database ------------------------------------- */
+
+
+void db_stats(const struct db *db, struct db_stats *s)
+{
+	unsigned erase_size = storage_erase_size();
+	unsigned units = db->stats.total / erase_size;
+	unsigned i;
+
+	*s = db->stats;
+	s->wear_min = 0;
+	s->wear_max = 0;
+	s->wear_sum = 0;
+	s->wear_units = 0;
+	s->mixed = 0;
+	block_cache_stats(&s->cache_hits, &s->cache_misses);
+	for (i = (RESERVED_BLOCKS + erase_size - 1) / erase_size; i != units;
+	    i++) {
+		unsigned count = db->wear ? db->wear[i] : 0;
+		unsigned n = i * erase_size;
+		unsigned dead = span_count(db->deleted, n, erase_size) +
+		    span_count(db->empty, n, erase_size);
+
+		if (dead && dead + span_count(db->erased, n, erase_size) !=
+		    erase_size)
+			s->mixed++;
+
+		if (!s->wear_units || count < s->wear_min)
+			s->wear_min = count;
+		if (count > s->wear_max)
+			s->wear_max = count;
+		s->wear_sum += count;
+		s->wear_units++;
+	}
+}
+
+
+/*
+ * scan_entry adds an entry to directory "dir". Unlike new_entry, it doesn't
+ * look for the entry's place in the list. Instead, sort_tree sorts all the
+ * directories once we have found all the entries.
+ */
+
+static struct db_entry *scan_entry(struct db *db, struct db_entry *dir,
+    const char *name, unsigned len)
+{
+	struct db_entry **first = dir ? &dir->children : &db->entries;
+	struct db_entry *de;
+
+	de = alloc_entry(db, name, len);
+	de->parent = dir;
+	de->next = *first;
+	*first = de;
+	names_add(names_of(db, dir), de);
+	return de;
+}
+
+
+/*
+ * sort_list sorts a list alphabetically, with a merge sort. sort_tree sorts all
+ * directories below "anchor".
+ */
+
+static struct db_entry *sort_list(struct db_entry *list, unsigned n)
+{
+	struct db_entry *a, *b, *res = NULL;
+	struct db_entry **anchor = &res;
+	unsigned i;
+
+	if (n < 2)
+		return list;
+	a = list;
+	for (i = 1; i != n / 2; i++)
+		list = list->next;
+	b = list->next;
+	list->next = NULL;
+	a = sort_list(a, n / 2);
+	b = sort_list(b, n - n / 2);
+	while (a && b) {
+		struct db_entry **first =
+		    strcmp(a->name, b->name) > 0 ? &b : &a;
+
+		*anchor = *first;
+		anchor = &(*first)->next;
+		*first = *anchor;
+	}
+	*anchor = a ? a : b;
+	return res;
+}
+
+
+static void sort_tree(struct db_entry **anchor)
+{
+	struct db_entry *e;
+	unsigned n = 0;
+
+	for (e = *anchor; e; e = e->next) {
+		sort_tree(&e->children);
+		n++;
+	}
+	*anchor = sort_list(*anchor, n);
+}
+
+
+/*
+ * path_entry returns the entry with the path "id", creating it if necessary.
+ * Missing directories along the path are added as virtual entries (with
+ * block = 0). *created is set to 1 if the entry itself is new.
+ */
+
+static struct db_entry *path_entry(struct db *db, const char *id,
+    unsigned len, bool *created)
+{
+	struct db_entry *dir = NULL;
+	struct db_entry *de;
+
+	while (1) {
+		const char *z;
+
+		z = memchr(id, 0, len);
+		if (!z)
+			break;
+
+		unsigned dir_len = z - id;
+
+		de = db_lookup(db, dir, id, dir_len);
+		if (!de) {
+			/*
+			 * virtual entry with block = 0
+			 */
+			de = scan_entry(db, dir, id, dir_len);
+		}
+		dir = de;
+		len -= dir_len + 1;
+		id = z + 1;
+	}
+
+	de = db_lookup(db, dir, id, len);
+	*created = !de;
+	if (!de)
+		de = scan_entry(db, dir, id, len);
+	return de;
+}
+
+
+/*
+ * pending_entry returns a new entry that refers to its directory by uid. We
+ * put it on db->pending, and place_pending moves it into the directory once we
+ * have found all the entries.
+ */
+
+static struct db_entry *pending_entry(struct db *db, const char *name,
+    unsigned len)
+{
+	struct db_entry *de;
+
+	if (memchr(name, 0, len))
+		return NULL;
+	de = alloc_entry(db, name, len);
+	de->next = db->pending;
+	db->pending = de;
+	return de;
+}
+
+
+static bool process_payload(struct db *db, unsigned block, uint16_t seq,
+    const void *payload, unsigned size, bool packed, uint32_t chain,
+    unsigned n_parts)
+{
+	const void *end = payload + size;
+	struct db_entry *de;
+	const void *p, *q;
+	enum field_type type;
+	unsigned len;
+	bool created = 1;
+
+	p = payload;
+	q = tlv_item(&p, end, &type, &len);
+	if (!q || type != ft_id)
+		return 0;
+
+	if (tlv_uid(p, end, ft_parent)) {
+		/* place_pending handles duplicates */
+		de = pending_entry(db, q, len);
+		if (!de)
+			return 0;
+	} else {
+		de = path_entry(db, q, len, &created);
+	}
+	if (!created) {
+		if (de->block) {
+			/*
+			 * @@@ We lose blocks here. Should either have an
+			 * "obsolete" type or consider it as "empty".
+		 	*/
+			if (((seq + 0x10000 - de->seq) & 0xffff) >= 0x8000)
+				return 1;
+			free_fields(de);
+			free(de->parts);
+		} else {
+			assert(!de->fields);
+			assert(!de->seq);
+		}
+	}
+	de->block = block;
+	de->seq = seq;
+	de->lazy = 1;
+	de->packed = packed;
+	de->chain = chain;
+	de->n_parts = n_parts;
+	de->parts = NULL;
+	if (n_parts) {
+		/* filled in by attach_parts */
+		de->parts = alloc_type_n(struct db_part, n_parts);
+		memset(de->parts, 0, n_parts * sizeof(struct db_part));
+	}
+	p = payload;
+	while (p != end) {
+		q = tlv_item(&p, end, &type, &len);
+		if (!q)
+			break;
+		if (structural_field(type))
+			add_field(de, type, q, len);
+	}
+	return 1;
+}
+
+
+static bool process_pack(struct db *db, unsigned block,
+    const void *payload, unsigned size)
+{
+	const void *p = payload;
+	const void *q;
+	unsigned len;
+	uint16_t seq;
+
+	while ((q = pack_item(&p, payload + size, &seq, &len)))
+		if (!process_payload(db, block, seq, q, len, 1, 0, 0))
+			return 0;
+	return p != payload;
+}
+
+
+static bool process_chain(struct db *db, unsigned block, uint16_t seq,
+    const uint8_t *payload, unsigned size)
+{
+	if (size < CHAIN_HDR || !payload[4] || payload[4] > DB_MAX_PARTS)
+		return 0;
+	return process_payload(db, block, seq, payload + CHAIN_HDR,
+	    size - CHAIN_HDR, 0, get32(payload), payload[4]);
+}
+
+
+/*
+ * We may find the parts of a chain before its first block, so we collect them
+ * while scanning, and attach them to their entries when done.
+ */
+
+struct scan_part {
+	uint32_t	chain;
+	uint16_t	block;
+	uint16_t	seq;
+	uint8_t		pos;
+	struct scan_part *next;
+};
+
+
+static bool process_part(struct scan_part **parts, unsigned block,
+    uint16_t seq, const uint8_t *payload, unsigned size)
+{
+	struct scan_part *sp;
+
+	if (size < CHAIN_HDR || !payload[4] || payload[4] > DB_MAX_PARTS)
+		return 0;
+	sp = alloc_type(struct scan_part);
+	sp->chain = get32(payload);
+	sp->block = block;
+	sp->seq = seq;
+	sp->pos = payload[4];
+	sp->next = *parts;
+	*parts = sp;
+	return 1;
+}
+
+
+static struct db_entry *chain_entry(struct db_entry *e, uint32_t chain)
+{
+	struct db_entry *found;
+
+	for (; e; e = e->next) {
+		if (e->n_parts && e->chain == chain)
+			return e;
+		found = chain_entry(e->children, chain);
+		if (found)
+			return found;
+	}
+	return NULL;
+}
+
+
+/*
+ * Parts of chains that no longer exist, and old copies of parts we have
+ * rewritten, are left behind if we crash before deleting them. We delete them
+ * here.
+ *
+ * If a part is missing, we can't load the entry, but keep it, so that it can
+ * still be deleted. db_check reports such entries.
+ */
+
+static void attach_parts(struct db *db, struct scan_part *parts)
+{
+	while (parts) {
+		struct scan_part *sp = parts;
+		struct db_entry *de = chain_entry(db->entries, sp->chain);
+		struct db_part *part;
+
+		parts = sp->next;
+		if (!de || sp->pos > de->n_parts) {
+			part_delete(db, sp->block);
+		} else {
+			part = de->parts + sp->pos - 1;
+			if (!part->block) {
+				part->block = sp->block;
+				part->seq = sp->seq;
+			} else if ((int16_t) (sp->seq - part->seq) > 0) {
+				part_delete(db, part->block);
+				part->block = sp->block;
+				part->seq = sp->seq;
+			} else {
+				part_delete(db, sp->block);
+			}
+		}
+		free(sp);
+	}
+}
+
+
+/*
+ * Delete packs that no longer contain any current entries. This happens if we
+ * crash before deleting an old pack.
+ */
+
+static void count_packed(const struct db_entry *e, uint8_t *entries)
+{
+	for (; e; e = e->next) {
+		if (e->packed)
+			entries[e->block] = 1;
+		count_packed(e->children, entries);
+	}
+}
+
+
+static void drop_stale_packs(struct db *db)
+{
+	uint8_t *entries;
+	unsigned i;
+
+	if (!db->stats.packs)
+		return;
+	entries = alloc_size(db->stats.total);
+	memset(entries, 0, db->stats.total);
+	count_packed(db->entries, entries);
+	for (i = RESERVED_BLOCKS; i != db->stats.total; i++)
+		if (!entries[i] && span_count(db->packs, i, 1))
+			pack_delete(db, i);
+	free(entries);
+}
+
+
+void db_open_empty(struct db *db, const struct dbcrypt *c)
+{
+	memset(db, 0, sizeof(*db));
+	db->c = c;
+	db->generation = 0;
+	db->stats.total = storage_blocks();
+	db->entries = NULL;
+	db->settings_block = -1;
+	db->dir = NULL;
+	db->max_loaded = DB_MAX_LOADED;
+	db->erased_low = DB_ERASED_LOW;
+	db->erased_high = DB_ERASED_HIGH;
+	db->hot_unit = -1;
+	db->cold_unit = -1;
+	db->pack_block = -1;
+	slab_init(&db->entry_slab, sizeof(struct db_entry), ENTRY_SLAB);
+	slab_init(&db->field_slab, sizeof(struct db_field), FIELD_SLAB);
+}
+
+
+/* --- Index --------------------------------------------------------------- */
+
+
+/*
+ * The index is a snapshot of the structure of the database, which allows us to
+ * open the database without decrypting every block. It is stored in one or
+ * more bt_index blocks ("parts") that are chained together. We find the first
+ * part through a hint stored next to the pad (see secrets.c).
+ *
+ * Since the index is deleted before the first change to the database, any
+ * index we find is current. If anything looks wrong, we fall back to scanning
+ * the whole partition.
+ *
+ * Each part begins with a struct index_header, followed by records of the form
+ * <type (8)> <length (16)> <data>, and zero-padding. All numbers are
+ * little-endian.
+ *
+ * ir_entry	block (16), seq (16), flags (8), id length (8), id, uid (32),
+ *		parent (32), prev
+ * ir_span	span type (8), first block (16), number of blocks (16)
+ * ir_settings	block (16)
+ * ir_wear	part (8), block (16)
+ * ir_patch	block (16), seq (16)
+ * ir_stats	invalid blocks (16), error blocks (16)
+ * ir_chain	block (16), chain id (32), then per part: block (16), seq (16)
+ *
+ * Uid and parent are only present if IE_UID and IE_PARENT are set,
+ * respectively. We only record entries that have a block. Virtual entries are
+ * recreated from the paths, like when scanning. Entries in packs have
+ * IE_PACKED set, and the packs themselves are recorded as a span. Entries
+ * stored as a chain are followed by an ir_chain record, with the block of the
+ * first part.
+ */
+
+#define	INDEX_NO_NEXT	0xffff
+
+#define	IE_DIR		1	/* entry has ft_dir */
+#define	IE_PREV		2	/* entry has ft_prev */
+#define	IE_PACKED	4	/* entry is in a pack */
+#define	IE_UID		8	/* ft_dir contains a uid */
+#define	IE_PARENT	16	/* entry has ft_parent */
+
+enum index_record {
+	ir_end		= 0,
+	ir_entry	= 1,
+	ir_span		= 2,
+	ir_settings	= 3,
+	ir_stats	= 4,
+	ir_wear		= 5,
+	ir_patch	= 6,
+	ir_chain	= 7,
+};
+
+enum index_span {
+	is_erased	= 0,
+	is_deleted	= 1,
+	is_empty	= 2,
+	is_packs	= 3,
+};
+
+struct index_header {
+	uint32_t	id;	/* random, the same in all parts */
+	uint8_t		part;	/* number of this part, starting at 0 */
+	uint8_t		reserved;
+	uint16_t	next;	/* block of the next part, or INDEX_NO_NEXT */
+};
+
+struct index_writer {
+	struct db	*db;
+	const uint16_t	*blocks;	/* NULL if we only count the parts */
+	unsigned	n_blocks;
+	uint32_t	id;
+	unsigned	parts;		/* number of parts started */
+	unsigned	pos;		/* bytes used in the current part */
+	bool		ok;
+};
+
+
+static void index_new_part(struct index_writer *w)
+{
+	if (w->parts == DB_INDEX_PARTS) {
+		w->ok = 0;
+		return;
+	}
+	w->parts++;
+	w->pos = sizeof(struct index_header);
+	if (w->blocks)
+		memset(payload_buf, 0, sizeof(payload_buf));
+}
+
+
+static void index_flush(struct index_writer *w)
+{
+	struct index_header *hdr = (void *) payload_buf;
+	unsigned part = w->parts - 1;
+
+	if (!w->blocks || !w->ok)
+		return;
+	assert(part < w->n_blocks);
+	hdr->id = w->id;
+	hdr->part = part;
+	hdr->reserved = 0;
+	hdr->next = part + 1 == w->n_blocks ? INDEX_NO_NEXT :
+	    w->blocks[part + 1];
+	if (!block_write(w->db->c, bt_index, 0, payload_buf, w->pos,
+	    w->blocks[part]))
+		w->ok = 0;
+}
+
+
+static void index_record(struct index_writer *w, enum index_record type,
+    const void *data, unsigned len)
+{
+	uint8_t *p = payload_buf + w->pos;
+
+	if (!w->ok)
+		return;
+	if (sizeof(struct index_header) + 3 + len > block_safe_payload()) {
+		w->ok = 0;
+		return;
+	}
+	if (w->pos + 3 + len > block_safe_payload()) {
+		index_flush(w);
+		index_new_part(w);
+		if (!w->ok)
+			return;
+		p = payload_buf + w->pos;
+	}
+	if (w->blocks) {
+		*p = type;
+		put16(p + 1, len);
+		memcpy(p + 3, data, len);
+	}
+	w->pos += 3 + len;
+}
+
+
+static void index_chain(struct index_writer *w, const struct db_entry *e)
+{
+	uint8_t rec[6 + 4 * DB_MAX_PARTS];
+	unsigned i;
+
+	put16(rec, e->block);
+	put32(rec + 2, e->chain);
+	for (i = 0; i != e->n_parts; i++) {
+		put16(rec + 6 + 4 * i, e->parts[i].block);
+		put16(rec + 8 + 4 * i, e->parts[i].seq);
+	}
+	index_record(w, ir_chain, rec, 6 + 4 * e->n_parts);
+}
+
+
+static void index_entries(struct index_writer *w, const struct db_entry *e)
+{
+	uint8_t rec[6 + 255 + 4 + 4 + 255];
+
+	for (; e; e = e->next) {
+		const struct db_field *id = e->fields;
+		const struct db_field *prev = NULL;
+		const struct db_field *f;
+		uint8_t *p = rec + 6;
+
+		/* deferred changes are not in storage yet */
+		if (e->defer) {
+			w->ok = 0;
+			return;
+		}
+		index_entries(w, e->children);
+		if (!e->block)
+			continue;
+		assert(id && id->type == ft_id);
+		/* the index only has room for short ids and "prev" */
+		if (id->len > 255) {
+			w->ok = 0;
+			return;
+		}
+		put16(rec, e->block);
+		put16(rec + 2, e->seq);
+		rec[4] = e->packed ? IE_PACKED : 0;
+		rec[5] = id->len;
+		memcpy(p, id->data, id->len);
+		p += id->len;
+		for (f = id->next; f; f = f->next)
+			switch (f->type) {
+			case ft_prev:
+				if (f->len > 255) {
+					w->ok = 0;
+					return;
+				}
+				prev = f;
+				break;
+			case ft_dir:
+				rec[4] |= IE_DIR;
+				if (!f->len)
+					break;
+				if (f->len != 4) {
+					w->ok = 0;
+					return;
+				}
+				rec[4] |= IE_UID;
+				memcpy(p, f->data, 4);
+				p += 4;
+				break;
+			case ft_parent:
+				if (f->len != 4) {
+					w->ok = 0;
+					return;
+				}
+				rec[4] |= IE_PARENT;
+				memcpy(p, f->data, 4);
+				p += 4;
+				break;
+			default:
+				break;
+			}
+		if (prev) {
+			rec[4] |= IE_PREV;
+			memcpy(p, prev->data, prev->len);
+			p += prev->len;
+		}
+		index_record(w, ir_entry, rec, p - rec);
+		if (e->n_parts)
+			index_chain(w, e);
+	}
+}
+
+
+struct index_spans {
+	struct index_writer *w;
+	enum index_span type;
+};
+
+
+static bool index_span(void *user, unsigned start, unsigned len)
+{
+	const struct index_spans *s = user;
+	uint8_t rec[5];
+
+	rec[0] = s->type;
+	put16(rec + 1, start);
+	put16(rec + 3, len);
+	index_record(s->w, ir_span, rec, sizeof(rec));
+	return s->w->ok;
+}
+
+
+static void index_build(struct index_writer *w)
+{
+	struct db *db = w->db;
+	struct index_spans s = { .w = w };
+	uint8_t rec[4];
+	unsigned i;
+
+	w->parts = 0;
+	w->ok = 1;
+	index_new_part(w);
+
+	put16(rec, db->stats.invalid);
+	put16(rec + 2, db->stats.error);
+	index_record(w, ir_stats, rec, 4);
+	if (db->settings_block != -1) {
+		put16(rec, db->settings_block);
+		index_record(w, ir_settings, rec, 2);
+	}
+	if (db->wear_part)
+		for (i = 0; i != wear_parts(db); i++)
+			if (db->wear_part[i].block != -1) {
+				rec[0] = i;
+				put16(rec + 1, db->wear_part[i].block);
+				index_record(w, ir_wear, rec, 3);
+			}
+	for (i = 0; i != db->patch_blocks; i++) {
+		put16(rec, db->patch_block[i]);
+		put16(rec + 2, db->patch_seq[i]);
+		index_record(w, ir_patch, rec, 4);
+	}
+	s.type = is_erased;
+	span_iterate(db->erased, index_span, &s);
+	s.type = is_deleted;
+	span_iterate(db->deleted, index_span, &s);
+	s.type = is_empty;
+	span_iterate(db->empty, index_span, &s);
+	s.type = is_packs;
+	span_iterate(db->packs, index_span, &s);
+	index_entries(w, db->entries);
+
+	/* write the last part, and any unused parts */
+	if (w->blocks)
+		while (w->ok) {
+			index_flush(w);
+			if (w->parts == w->n_blocks)
+				break;
+			index_new_part(w);
+		}
+}
 
 
-bool db_update_settings(struct db *db, uint16_t seq,
-    const void *payload, unsigned length)
+bool db_write_index(struct db *db)
 {
-	int new;
+	uint16_t blocks[DB_INDEX_PARTS];
+	struct index_writer w = {
+		.db		= db,
+		.blocks		= NULL,
+	};
+	unsigned n = 0;
 
-	new = get_erased_block(db);
-	if (new < 0)
+	if (db->index_parts)
+		return 1;
+	if (!secrets_hint_space())
 		return 0;
-	if (block_write(db->c, bt_settings, seq, payload, length, new)) {
-		db->stats.special++;
-		if (db->settings_block != -1) {
-			if (block_delete(db->settings_block)) {
-				span_add(&db->deleted, db->settings_block, 1);
-				db->stats.deleted++;
-				db->stats.special--;
-			}
+	if (db->wear_dirty && !wear_save(db))
+		return 0;
+	rnd_bytes(&w.id, sizeof(w.id));
+
+	/*
+	 * Allocating blocks changes the spans, so we may need another round
+	 * after allocating.
+	 */
+	while (1) {
+		index_build(&w);
+		if (!w.ok)
+			goto fail;
+		if (w.parts <= n)
+			break;
+		while (n != w.parts) {
+			int new = get_erased_block(db, pl_hot);
+
+			if (new < 0)
+				goto fail;
+			blocks[n++] = new;
 		}
-		db->settings_block = new;
-		return 1;
-	} else {
-		if (block_delete(new)) {
-			span_add(&db->deleted, new, 1);
+	}
+
+	w.blocks = blocks;
+	w.n_blocks = n;
+	index_build(&w);
+	memset(payload_buf, 0, sizeof(payload_buf));
+	if (!w.ok || !secrets_put_hint(blocks[0]))
+		goto fail;
+
+	memcpy(db->index_blocks, blocks, n * sizeof(*blocks));
+	db->index_parts = n;
+	db->stats.special += n;
+	return storage_sync();
+
+fail:
+	while (n--)
+		if (block_delete(blocks[n])) {
+			span_add(&db->deleted, blocks[n], 1);
 			db->stats.deleted++;
+		} else {
+			db->stats.error++;
 		}
+	return 0;
+}
+
+
+static bool index_entry(struct db *db, const uint8_t *p, unsigned len)
+{
+	const uint8_t *uid = NULL, *parent = NULL;
+	struct db_entry *de;
+	unsigned block, id_len, pos;
+	bool created = 1;
+
+	if (len < 6)
 		return 0;
+	block = get16(p);
+	id_len = p[5];
+	if (block < RESERVED_BLOCKS || block >= db->stats.total)
+		return 0;
+	if (!id_len || 6 + id_len > len)
+		return 0;
+	pos = 6 + id_len;
+	if (p[4] & IE_UID) {
+		if (!(p[4] & IE_DIR) || pos + 4 > len)
+			return 0;
+		uid = p + pos;
+		pos += 4;
+	}
+	if (p[4] & IE_PARENT) {
+		if (pos + 4 > len)
+			return 0;
+		parent = p + pos;
+		pos += 4;
+	}
+	if (parent) {
+		de = pending_entry(db, (const char *) p + 6, id_len);
+		if (!de)
+			return 0;
+	} else {
+		de = path_entry(db, (const char *) p + 6, id_len, &created);
 	}
+	if (!created && de->block)
+		return 0;
+	assert(!de->fields);
+	de->block = block;
+	de->seq = get16(p + 2);
+	de->lazy = 1;
+	insert_field(de, ft_id, p + 6, id_len);
+	if (p[4] & IE_PREV)
+		insert_field(de, ft_prev, p + pos, len - pos);
+	if (p[4] & IE_DIR)
+		insert_field(de, ft_dir, uid, uid ? 4 : 0);
+	if (parent)
+		insert_field(de, ft_parent, parent, 4);
+	de->packed = p[4] & IE_PACKED;
+	if (!de->packed)
+		db->stats.data++;
+	return 1;
 }
 
 
-/* --- Fix remaining virtual entries --------------------------------------- */
+static struct db_entry *entry_at(struct db_entry *e, unsigned block)
+{
+	struct db_entry *found;
+
+	for (; e; e = e->next) {
+		if (e->block == block && !e->packed)
+			return e;
+		found = entry_at(e->children, block);
+		if (found)
+			return found;
+	}
+	return NULL;
+}
 
 
 /*
- * The database may contain some anomalies we fix here:
- * - entries in a directory for which no entry exists, or
- * - directory entries without the ft_dir field.
- * In both cases, we add an ft_dir field, so that other parts of the system do
- * not get confused about the status of an entry. (E.g., after deleting all
- * entries in a directory, it would look like an account record without fields
- * if it didn't have an ft_dir field.)
+ * Parts we did not find when scanning have block 0.
  */
 
-static void fix_virtual(struct db_entry *dir)
+static bool index_chains(struct db *db, const uint8_t *p, unsigned len)
 {
-	struct db_entry *e;
+	struct db_entry *de;
+	unsigned n, i;
 
-	for (e = dir; e; e = e->next) {
-		fix_virtual(e->children);
-		if (db_field_find(e, ft_dir))
-			continue;
-		/*
-		 * @@@ note: we do not assign a block here. This only happens
-		 * if we make changes to the directory entry.
-		 */
-		if (e->children || !e->block) {
-			add_field(e, ft_dir, NULL, 0);
-			id_to_cwd(dir, e, add_field);
+	if (len < 6 + 4 || (len - 6) % 4)
+		return 0;
+	n = (len - 6) / 4;
+	if (n > DB_MAX_PARTS)
+		return 0;
+	de = entry_at(db->entries, get16(p));
+	if (!de)
+		de = entry_at(db->pending, get16(p));
+	if (!de || de->n_parts)
+		return 0;
+	for (i = 0; i != n; i++) {
+		unsigned block = get16(p + 6 + 4 * i);
+
+		if (block && (block < RESERVED_BLOCKS ||
+		    block >= db->stats.total))
+			return 0;
+	}
+	de->chain = get32(p + 2);
+	de->n_parts = n;
+	de->parts = alloc_type_n(struct db_part, n);
+	for (i = 0; i != n; i++) {
+		de->parts[i].block = get16(p + 6 + 4 * i);
+		de->parts[i].seq = get16(p + 8 + 4 * i);
+		if (de->parts[i].block) {
+			db->stats.data++;
+			db->stats.parts++;
 		}
 	}
+	return 1;
 }
 
 
-/* --- Open/close the account database ------------------------------------- */
-
-
-void db_stats(const struct db *db, struct db_stats *s)
-{
-	*s = db->stats;
-}
-
-
-static const void *tlv_item(const void **p, const void *end,
-    enum field_type *type, unsigned *len)
+static bool index_spans(struct db *db, const uint8_t *p, unsigned len)
 {
-	const uint8_t *q = *p;
+	unsigned start, n;
 
-	if (*p + 2 > end)
-		return NULL;
-	if (*q == ft_end)
-		return NULL;
-	*type = *q++;
-	*len = *q++;
-	*p = q + *len;
-	if (*p > end)
-		return NULL;
-	return q;
+	if (len != 5)
+		return 0;
+	start = get16(p + 1);
+	n = get16(p + 3);
+	if (start < RESERVED_BLOCKS || start + n > db->stats.total || !n)
+		return 0;
+	switch (p[0]) {
+	case is_erased:
+		span_add(&db->erased, start, n);
+		db->stats.erased += n;
+		break;
+	case is_deleted:
+		span_add(&db->deleted, start, n);
+		db->stats.deleted += n;
+		break;
+	case is_empty:
+		span_add(&db->empty, start, n);
+		db->stats.empty += n;
+		break;
+	case is_packs:
+		span_add(&db->packs, start, n);
+		db->stats.data += n;
+		db->stats.packs += n;
+		db->pack_block = start + n - 1;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
 }
 
 
-static char *alloc_string(const char *s, unsigned len)
+static bool index_part(struct db *db, const uint8_t *p, unsigned size,
+    int *first_erased)
 {
-	char *tmp;
+	const uint8_t *end = p + size;
+
+	while (p != end && *p != ir_end) {
+		const uint8_t *q = p + 3;
+		unsigned len;
 
-	tmp = alloc_size(len + 1);
-	memcpy(tmp, s, len);
-	tmp[len] = 0;
-	return tmp;
+		if (p + 3 > end)
+			return 0;
+		len = get16(p + 1);
+		if (q + len > end)
+			return 0;
+		switch (*p) {
+		case ir_entry:
+			if (!index_entry(db, q, len))
+				return 0;
+			break;
+		case ir_span:
+			if (!index_spans(db, q, len))
+				return 0;
+			if (*q == is_erased && *first_erased < 0)
+				*first_erased = get16(q + 1);
+			break;
+		case ir_settings:
+			if (len != 2)
+				return 0;
+			db->settings_block = get16(q);
+			break;
+		case ir_wear:
+			if (len != 3 || *q >= wear_parts(db))
+				return 0;
+			wear_part(db)[*q].block = get16(q + 1);
+			break;
+		case ir_patch:
+			if (len != 4 || db->patch_blocks == DB_PATCH_BLOCKS)
+				return 0;
+			db->patch_block[db->patch_blocks] = get16(q);
+			db->patch_seq[db->patch_blocks] = get16(q + 2);
+			db->patch_blocks++;
+			break;
+		case ir_chain:
+			if (!index_chains(db, q, len))
+				return 0;
+			break;
+		case ir_stats:
+			if (len != 4)
+				return 0;
+			db->stats.invalid += get16(q);
+			db->stats.error += get16(q + 2);
+			break;
+		default:
+			return 0;
+		}
+		p = q + len;
+	}
+	return 1;
 }
 
 
-static bool process_payload(struct db *db, unsigned block, uint16_t seq,
-    const void *payload, unsigned size)
+static bool open_index(struct db *db)
 {
-	const void *end = payload + size;
-	struct db_entry *de;
-	const void *p, *q;
-	enum field_type type;
-	char *name;
-	unsigned len;
+	const struct index_header *hdr = (const void *) payload_buf;
+	int hint = secrets_get_hint();
+	int first_erased = -1;
+	unsigned part = 0;
+	unsigned n, len, i;
+	uint32_t id = 0;
+	uint16_t seq;
 
-	p = payload;
-	q = tlv_item(&p, end, &type, &len);
-	if (!q || type != ft_id)
+	if (hint < 0 || (unsigned) hint < RESERVED_BLOCKS ||
+	    (unsigned) hint >= db->stats.total)
 		return 0;
-
-	struct db_entry *dir = NULL;
-
+	n = hint;
 	while (1) {
-		const char *z;
-
-		z = memchr(q, 0, len);
-		if (!z)
+		if (part == DB_INDEX_PARTS)
+			return 0;
+		len = sizeof(payload_buf);
+		if (block_read(db->c, &seq, payload_buf, &len, n) != bt_index)
+			return 0;
+		if (len < sizeof(*hdr) || hdr->part != part)
+			return 0;
+		if (part && hdr->id != id)
+			return 0;
+		id = hdr->id;
+		db->index_blocks[part++] = n;
+		if (!index_part(db, payload_buf + sizeof(*hdr),
+		    len - sizeof(*hdr), &first_erased))
+			return 0;
+		if (hdr->next == INDEX_NO_NEXT)
 			break;
+		n = hdr->next;
+		if (n < RESERVED_BLOCKS || n >= db->stats.total)
+			return 0;
+	}
 
-		unsigned dir_len = z - (const char *) q;
-		struct db_entry **a;
+	/*
+	 * Cheap sanity check: the next block we'll write to must still be
+	 * erased.
+	 */
+	if (first_erased >= 0 &&
+	    block_read(NULL, NULL, NULL, NULL, first_erased) != bt_erased)
+		return 0;
 
-		for (a = dir ? &dir->children : &db->entries; *a;
-		    a = &(*a)->next)
-			if (!strcmp(q, (*a)->name))
-				break;
-		if (!*a) {
-			/*
-			 * virtual entry with block = 0
-			 */
-			de = alloc_type(struct db_entry);
-			memset(de, 0, sizeof(*de));
-			de->name = alloc_string(q, dir_len);
-			de->db = db;
-			*a = de;
-		}
-		dir = *a;
-		len -= dir_len + 1;
-		q = z + 1;
+	if (db->settings_block != -1) {
+		len = sizeof(payload_buf);
+		if (block_read(db->c, &seq, payload_buf, &len,
+		    db->settings_block) != bt_settings)
+			return 0;
+		if (!settings_process(seq, payload_buf, len))
+			return 0;
+		db->stats.special++;
 	}
 
-	name = alloc_string(q, len);
-	for (de = dir ? dir->children : db->entries; de; de = de->next)
-		if (!strcmp(de->name, name))
-			break;
-	if (de) {
-		free(name);
-		if (de->block) {
-			/*
-			 * @@@ We lose blocks here. Should either have an
-			 * "obsolete" type or consider it as "empty".
-		 	*/
-			if (((seq + 0x10000 - de->seq) & 0xffff) >= 0x8000)
-				return 1;
-			free_fields(de);
-		} else {
-			assert(!de->fields);
-			assert(!de->seq);
-		}
-	} else {
-		de = new_entry(db, dir, name);
-		de->name = name;
-	}
-	de->block = block;
-	de->seq = seq;
-	p = payload;
-	while (p != end) {
-		q = tlv_item(&p, end, &type, &len);
-		if (!q)
-			break;
-		add_field(de, type, q, len);
+	for (i = 0; db->wear_part && i != wear_parts(db); i++) {
+		if (db->wear_part[i].block == -1)
+			continue;
+		n = db->wear_part[i].block;
+		db->wear_part[i].block = -1;
+		if (n < RESERVED_BLOCKS || n >= db->stats.total)
+			return 0;
+		len = sizeof(payload_buf);
+		if (block_read(db->c, &seq, payload_buf, &len, n) != bt_wear)
+			return 0;
+		if (wear_part_of(db, payload_buf, len) != (int) i ||
+		    !wear_process(db, n, seq, payload_buf, len))
+			return 0;
+		db->stats.special++;
 	}
-	return 1;
-}
 
+	for (n = 0; n != db->patch_blocks; n++)
+		if (db->patch_block[n] < RESERVED_BLOCKS ||
+		    db->patch_block[n] >= db->stats.total)
+			return 0;
+	place_pending(db);
+	sort_tree(&db->entries);
+	if (!patch_mark_all(db))
+		return 0;
+	db->stats.special += db->patch_blocks;
 
-void db_open_empty(struct db *db, const struct dbcrypt *c)
-{
-	memset(db, 0, sizeof(*db));
-	db->c = c;
-	db->generation = 0;
-	db->stats.total = storage_blocks();
-	db->entries = NULL;
-	db->settings_block = -1;
-	db->dir = NULL;
+	db->index_parts = part;
+	db->stats.special += part;
+	return 1;
 }
 
 
 bool db_open_progress(struct db *db, const struct dbcrypt *c,
     void (*progress)(void *user, unsigned i, unsigned n), void *user)
 {
+	struct scan_part *parts = NULL;
+	struct block_pipe pipe;
 	unsigned i;
 	uint16_t seq;
 
 	db_open_empty(db, c);
+	if (open_index(db)) {
+		memset(payload_buf, 0, sizeof(payload_buf));
+		if (progress)
+			progress(user, db->stats.total, db->stats.total);
+		goto done;
+	}
+	memset(payload_buf, 0, sizeof(payload_buf));
+	db_close(db);
+	db_open_empty(db, c);
+
+	block_pipe_begin(&pipe, RESERVED_BLOCKS, db->stats.total);
 	for (i = RESERVED_BLOCKS; i != db->stats.total; i++) {
 		unsigned payload_len = sizeof(payload_buf);
 
 		if (progress)
 			progress(user, i, db->stats.total);
-		switch (block_read(c, &seq, payload_buf, &payload_len, i)) {
+		switch (block_pipe_next(&pipe, c, &seq, payload_buf,
+		    &payload_len)) {
 		case bt_error:
 			db->stats.error++;
 			break;
@@ -1198,11 +5086,37 @@ bool db_open_progress(struct db *db, const struct dbcrypt *c,
 			break;
 		case bt_data:
 			if (process_payload(db, i, seq, payload_buf,
+			    payload_len, 0, 0, 0))
+				db->stats.data++;
+			else
+				db->stats.invalid++;
+			break;
+		case bt_first:
+			if (process_chain(db, i, seq, payload_buf,
 			    payload_len))
 				db->stats.data++;
 			else
 				db->stats.invalid++;
 			break;
+		case bt_next:
+			if (process_part(&parts, i, seq, payload_buf,
+			    payload_len)) {
+				db->stats.data++;
+				db->stats.parts++;
+			} else {
+				db->stats.invalid++;
+			}
+			break;
+		case bt_packed:
+			if (process_pack(db, i, payload_buf, payload_len)) {
+				span_add(&db->packs, i, 1);
+				db->stats.data++;
+				db->stats.packs++;
+				db->pack_block = i;
+			} else {
+				db->stats.invalid++;
+			}
+			break;
 		case bt_settings:
 			if (settings_process(seq, payload_buf, payload_len)) {
 				db->stats.special++;
@@ -1211,15 +5125,50 @@ bool db_open_progress(struct db *db, const struct dbcrypt *c,
 				db->stats.invalid++;
 			}
 			break;
+		case bt_patch:
+			if (db->patch_blocks != DB_PATCH_BLOCKS) {
+				db->patch_block[db->patch_blocks] = i;
+				db->patch_seq[db->patch_blocks] = seq;
+				db->patch_blocks++;
+				db->stats.special++;
+			} else {
+				db->stats.invalid++;
+			}
+			break;
+		case bt_wear:
+			if (wear_process(db, i, seq, payload_buf,
+			    payload_len)) {
+				db->stats.special++;
+				break;
+			}
+			/* fall through */
+		case bt_index:
+			/* an index we could not use is stale */
+			if (block_delete(i)) {
+				span_add(&db->deleted, i, 1);
+				db->stats.deleted++;
+			} else {
+				db->stats.error++;
+			}
+			break;
 		default:
 			ABORT();
 		}
 	}
+	block_pipe_end(&pipe);
 	if (progress)
 		progress(user, i, i);
 	memset(payload_buf, 0, sizeof(payload_buf));
+	place_pending(db);
+	sort_tree(&db->entries);
+	attach_parts(db, parts);
+	drop_stale_packs(db);
+	patch_sort(db);
+	patch_mark_all(db);
+	db_write_index(db);
+done:
 	db_tsort(db);
-	fix_virtual(db->entries);
+	fix_virtual(NULL, db->entries);
 	db->dir = NULL;
 	return 1;
 }
@@ -1231,36 +5180,75 @@ bool db_open(struct db *db, const struct dbcrypt *c)
 }
 
 
-void db_close(struct db *db)
+/*
+ * free_tree frees what the entries have outside the slabs.
+ */
+
+static void free_tree(struct db_entry *e)
 {
-	while (db->entries) {
-		struct db_entry *this = db->entries;
+	const struct db_field *f;
 
-		db->entries = this->next;
-		free_entry(this);
+	for (; e; e = e->next) {
+		free_tree(e->children);
+		free_name(e);
+		for (f = e->fields; f; f = f->next)
+			free_data(f);
+		free(e->parts);
+		free(e->names.bucket);
 	}
+}
+
+
+void db_close(struct db *db)
+{
+	free_tree(db->entries);
+	free_tree(db->pending);
+	db->entries = NULL;
+	db->pending = NULL;
+	db->lru = db->lru_tail = NULL;
+	db->loaded = 0;
+	free(db->names.bucket);
+	slab_free_all(&db->entry_slab);
+	slab_free_all(&db->field_slab);
 	span_free_all(db->erased);
 	span_free_all(db->deleted);
 	span_free_all(db->empty);
+	span_free_all(db->packs);
+	span_free_all(db->retired);
+	free(db->wear);
+	free(db->wear_part);
+	block_cache_clear();
 }
 
 
+/*
+ * A partition with a pad block is not erased, and finding one only takes a few
+ * block reads. Without pads, we look for any block that isn't erased, which
+ * reads the whole partition. This only happens until the device is set up, or
+ * if the pads have been lost.
+ */
+
 bool db_is_erased(void)
 {
+	struct block_pipe pipe;
 	unsigned n = storage_blocks();
 	unsigned i;
+	bool erased = 1;
 
-	/*
-	 * @@@ We should tart at zero because also the presence of pad blocks
-	 * is sufficient to indicate that the Flash is initialized.
-	 */
+	if (secrets_have_pad_block())
+		return 0;
+	block_pipe_begin(&pipe, RESERVED_BLOCKS, n);
 	for (i = RESERVED_BLOCKS; i != n; i++) {
-		enum block_type type = block_read(NULL, NULL, NULL, NULL, i);
+		enum block_type type =
+		    block_pipe_next(&pipe, NULL, NULL, NULL, NULL);
 
-		if (type != bt_error && type != bt_erased)
-		    return 0;
+		if (type != bt_error && type != bt_erased) {
+			erased = 0;
+			break;
+		}
 	}
-	return 1;
+	block_pipe_end(&pipe);
+	return erased;
 }
 
 
@@ -19,10 +19,11 @@
 
 #include "hal.h"
 #include "storage.h"
+#include "slab.h"
 
 
 #define	MAX_NAME_LEN	16	/* maximum length of an entry name */
-#define	MAX_STRING_LEN	64	/* maximum length of user, email, pw */
+#define	MAX_STRING_LEN	64	/* max. length of user, email, pw in the UI */
 #define	MAX_SECRET_LEN	20	/* maximum bytes of HOTP/TOTP secret */
 
 
@@ -63,38 +64,77 @@ enum __attribute__((__packed__)) field_type {
 	ft_comment	= 9,
 	ft_pw2		= 10,
 	ft_dir		= 11,
+	ft_parent	= 12,	// uid of the directory containing the entry
 };
 
 /*
  * Encodings:
  *
- * ID, prev:
- *   Now: <non-NUL characters>
- *   Later: (<non-NUL characters> NUL)+ <non-NUL characters>
+ * ID:
+ *   (<non-NUL characters> NUL)* <non-NUL characters>
+ *   The path of the entry, or only its name if the entry has a parent field.
+ * Prev:
+ *   <non-NUL characters>
+ * Dir:
+ *   Nothing, or a uid (32 bits, little-endian, not zero) entries in the
+ *   directory can use as their parent.
+ * Parent:
+ *   The uid of the directory containing the entry.
  * User, E-Mail, Password:
  * <non-NUL characters>
  * HOTP-Secret, HOTP-Counter, TOTP-Secret:
  * <bytes>
  */
 
+#define	DB_FIELD_INLINE	32	/* field data kept in struct db_field */
+
 struct db_field {
 	enum field_type type;
-	uint8_t		len;
-	void		*data;
+	uint16_t	len;
+	void		*data;	/* "buf" if len <= DB_FIELD_INLINE */
 	struct db_field	*next;
+	uint8_t		buf[DB_FIELD_INLINE];
 };
 
 struct db;
 
+/* continuation block of an entry that does not fit into a single block */
+struct db_part {
+	uint16_t	block;
+	uint16_t	seq;
+};
+
+/* hash table of the names of the entries in a directory (see db_lookup) */
+struct db_names {
+	struct db_entry	**bucket;
+	unsigned	size;	/* number of buckets, 0 or a power of two */
+	unsigned	n;	/* number of entries */
+};
+
 struct db_entry {
 	struct db	*db;
 	char		*name;
 	uint16_t	seq;
 	unsigned	block;		/* 0 if entry is virtual */
 	bool		defer;		/* defer writing changes to storage */
+	bool		dirty;		/* changed in the current transaction */
+	bool		unsorted;	/* db_commit has to sort the children */
+	bool		lazy;		/* only id, prev, dir, parent loaded */
+	bool		patched;	/* may have changes in patch blocks */
+	bool		packed;		/* block is shared with other entries */
+	uint32_t	chain;		/* links the parts to the entry */
+	unsigned	n_parts;	/* 0 if the entry fits into one block */
+	struct db_part	*parts;
+	unsigned	held;		/* db_entry_hold count, keeps fields */
+	struct db_entry	*lru_prev;	/* loaded entries, most recent first */
+	struct db_entry	*lru_next;
 	struct db_field	*fields;
 	struct db_entry	*next;
+	struct db_entry	*parent;	/* NULL at the top level */
 	struct db_entry	*children;	/* NULL if not a directory */
+	struct db_names	names;		/* of the children, and their number */
+	struct db_entry	*name_next;	/* next in the same hash bucket */
+	char		name_buf[MAX_NAME_LEN + 1]; /* "name", if it fits */
 };
 
 struct db_stats {
@@ -104,11 +144,36 @@ struct db_stats {
 	unsigned	empty;
 	unsigned	invalid;
 	unsigned	error;
-	unsigned	data;
+	unsigned	data;		/* blocks with entries */
+	unsigned	packs;		/* ... of which are packs */
+	unsigned	parts;		/* ... or continuation blocks */
 	unsigned	special;
+	unsigned	fg_erases;	/* erases when allocating a block */
+	unsigned	bg_erases;	/* erases by db_reclaim */
+	unsigned	relocated;	/* entries moved for wear leveling */
+	unsigned	appended;	/* counter changes added to a log */
+	unsigned	patched;	/* changes added to a patch block */
+	unsigned	folded;		/* entries rewritten to drop patches */
+
+	/* only set by db_stats */
+	unsigned	wear_min;	/* erase counts */
+	unsigned	wear_max;
+	unsigned	wear_sum;
+	unsigned	wear_units;	/* erase units outside the reserved area */
+	unsigned	mixed;		/* units with live and dead blocks */
+	unsigned	cache_hits;	/* blocks found in the block cache */
+	unsigned	cache_misses;
 };
 
 struct db_span;
+struct db_wear_part;
+
+#define	DB_INDEX_PARTS	64	/* maximum number of blocks in the index */
+#define	DB_MAX_LOADED	16	/* default of db->max_loaded */
+#define	DB_ERASED_LOW	8	/* default of db->erased_low */
+#define	DB_ERASED_HIGH	32	/* default of db->erased_high */
+#define	DB_PATCH_BLOCKS	4	/* maximum number of patch blocks */
+#define	DB_MAX_PARTS	16	/* maximum continuation blocks per entry */
 
 struct db {
 	const struct dbcrypt *c;
@@ -117,13 +182,42 @@ struct db {
 	struct db_span *erased;
 	struct db_span *deleted;
 	struct db_span *empty;
+	struct db_span *packs;
 	struct db_entry	*entries;
+	struct db_names names;	/* of the top-level entries */
 	struct db_entry *dir;	/* NULL for the root directory */
 	int settings_block;
+	unsigned max_loaded;	/* max. entries with all fields, 0 = any */
+	struct db_entry *lru;	/* most recently loaded or used entry */
+	struct db_entry *lru_tail; /* least recently ... */
+	unsigned loaded;	/* entries in the LRU list */
+	unsigned index_parts;	/* 0 if there is no valid index */
+	uint16_t index_blocks[DB_INDEX_PARTS];
+	unsigned erased_low;	/* start background erasing below this */
+	unsigned erased_high;	/* ... and stop at this */
+	bool reclaiming;	/* background erasing is in progress */
+	uint32_t *wear;		/* erase count per erase unit, NULL if none */
+	unsigned wear_dirty;	/* erases since we last saved the counts */
+	bool wear_balanced;	/* no relocation needed since the last erase */
+	struct db_wear_part *wear_part; /* blocks with the saved counts */
+	uint16_t wear_seq;	/* of the most recently saved counts */
+	int hot_unit;		/* first block of unit for hot blocks */
+	int cold_unit;		/* likewise, for cold blocks */
+	unsigned patch_blocks;	/* number of patch blocks */
+	uint16_t patch_block[DB_PATCH_BLOCKS];	/* oldest first */
+	uint16_t patch_seq[DB_PATCH_BLOCKS];
+	int pack_block;		/* pack to add entries to, -1 if none */
+	unsigned txn;		/* nesting depth of db_begin */
+	bool txn_sort;		/* db_commit has to sort the top level */
+	bool committing;	/* db_commit is writing entries */
+	struct db_span *retired; /* old blocks db_commit has yet to delete */
+	struct db_entry *pending; /* entries waiting for their directory */
+	struct db_slab entry_slab; /* struct db_entry */
+	struct db_slab field_slab; /* struct db_field */
 };
 
 
-extern PSRAM_NOINIT uint8_t payload_buf[STORAGE_BLOCK_SIZE];
+extern PSRAM_NOINIT uint8_t payload_buf[STORAGE_BLOCK_MAX];
 	// @@@ beyond-worst-case size
 
 extern struct db main_db;
@@ -139,6 +233,31 @@ struct db_entry *db_dummy_entry(struct db *db, const char *name,
     const char *prev);
 void db_open_empty(struct db *db, const struct dbcrypt *c);
 
+/*
+ * db_check verifies that the links between entries, and the name tables, are
+ * consistent, and that we have found all the parts of entries. It reports
+ * problems with debug(), and returns 0 if there are any.
+ */
+bool db_check(const struct db *db);
+
+/*
+ * After opening the database, entries only contain the id, prev, dir, and
+ * parent fields. The remaining fields are loaded when needed. db_field_find
+ * and the functions changing an entry do this automatically. Code that walks
+ * de->fields directly has to call db_entry_load first.
+ *
+ * Loading an entry may drop the fields other than id, prev, dir, and parent of
+ * the least recently used entry (see db->max_loaded). Pointers to such fields
+ * therefore should not be kept while accessing other entries, unless the entry
+ * is held with db_entry_hold. Each db_entry_hold is matched by a
+ * db_entry_release, unless the entry is deleted while held.
+ *
+ * db_entry_load returns 0 if the entry could not be loaded.
+ */
+bool db_entry_load(const struct db_entry *de);
+void db_entry_hold(const struct db_entry *de);
+void db_entry_release(const struct db_entry *de);
+
 struct db_field *db_field_find(const struct db_entry *de, enum field_type type);
 bool db_change_field(struct db_entry *de, enum field_type type,
     const void *data, unsigned size);
@@ -161,6 +280,21 @@ bool db_rename(struct db_entry *de, const char *name);
 
 bool db_entry_defer_update(struct db_entry *de, bool defer);
 
+/*
+ * db_begin starts a transaction. Until the matching db_commit, changes to
+ * entries are only made in memory, as if the entries deferred their updates,
+ * and the database is not sorted. db_commit then sorts the database once,
+ * writes all changed entries, and only deletes the old blocks after all the
+ * new ones have been written. Transactions can be nested. Only the outermost
+ * db_commit writes anything.
+ *
+ * db_commit returns 0 if writing an entry failed. Entries that could not be
+ * written keep their changes in memory.
+ */
+
+void db_begin(struct db *db);
+bool db_commit(struct db *db);
+
 struct db_entry *db_new_entry(struct db *db, const char *name);
 
 /*
@@ -191,6 +325,13 @@ bool db_delete_entry(struct db_entry *de);
 bool db_iterate(struct db *db, bool (*fn)(void *user, struct db_entry *de),
     void *user);
 
+/*
+ * db_lookup returns the entry "name", with length "len", in directory "dir"
+ * (NULL for the top level), or NULL if there is no such entry.
+ */
+struct db_entry *db_lookup(const struct db *db, const struct db_entry *dir,
+    const char *name, unsigned len);
+
 /*
  * db_is_descendent returns "true" if "de" is a descendent of "dir", Note that
  * it returns "false" if dir == de. For directory moves, this condition thus
@@ -230,6 +371,21 @@ void db_stats(const struct db *db, struct db_stats *s);
 bool db_open_progress(struct db *db, const struct dbcrypt *c,
     void (*progress)(void *user, unsigned i, unsigned n), void *user);
 bool db_open(struct db *db, const struct dbcrypt *c);
+
+/*
+ * db_write_index stores a snapshot of the database structure, so that the next
+ * db_open can skip scanning the whole partition. It returns 1 if a valid index
+ * exists afterwards.
+ */
+bool db_write_index(struct db *db);
+
+/*
+ * db_reclaim erases one erase unit if the number of erased blocks is low (see
+ * db->erased_low and db->erased_high). It is meant to be called while the
+ * device is idle, so that allocating blocks rarely has to wait for an erase. It
+ * returns 1 if it has erased something, and may be called again.
+ */
+bool db_reclaim(struct db *db);
 void db_close(struct db *db);
 
 bool db_is_erased(void);
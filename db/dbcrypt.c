@@ -30,6 +30,14 @@
 #endif
 
 
+/*
+ * Number of writers (not in the readers list) for which we cache the shared
+ * secret. Databases normally have only a handful of writers, so this avoids
+ * one scalar multiplication per block we decrypt.
+ */
+
+#define	WRITER_CACHE_SIZE	4
+
 struct peer {
 	uint8_t k[crypto_box_BEFORENMBYTES];
 	uint8_t pk[crypto_box_PUBLICKEYBYTES];
@@ -45,7 +53,9 @@ struct dbcrypt {
 	 */
 	struct peer *readers;
 	/*
-	 * "cache" are writers of blocks we decrypt, but who are not in the		 * readers list.
+	 * "cache" are writers of blocks we decrypt, but who are not in the
+	 * readers list. The most recently used writer is at the beginning of
+	 * the list. The list has at most WRITER_CACHE_SIZE entries.
 	 */
 	struct peer *cache;
 };
@@ -61,21 +71,53 @@ struct dbcrypt {
  * There is no information about who can decrypt the record key, nor how many
  * record keys the block contains. The reader therefor has to try all possible
  * combinations until a key fits.
+ *
+ * This is expensive: each attempt opens the secretbox of the whole block. In
+ * format version 2, we therefore add a hint after each encrypted record key.
+ * The hint is encrypted with the same key stream as the record key and
+ * contains the number of readers, followed by zero bytes. A reader can thus
+ * find its slot and the block layout with one short stream operation per
+ * slot, and then opens the secretbox only once. Since the hint is encrypted
+ * with the shared secret of writer and reader, it reveals neither who the
+ * readers are nor how many there are.
+ *
+ * Version 2 is indicated by setting the most significant bit of the writer's
+ * public key, which is ignored by X25519 and is always zero in keys generated
+ * by crypto_scalarmult_base.
+ *
+ * Version 2 blocks can end with a log area, which is not covered by the
+ * secretbox and is left erased when writing the block. The second byte of the
+ * hint is the size of the log area, in units of LOG_UNIT bytes. (The first
+ * version of the v2 format required this byte to be zero, so older code
+ * simply does not find a valid slot in such blocks.)
+ *
+ * The log area contains a sequence of records, each consisting of the length
+ * of the record's data (one byte), followed by a secretbox with the data,
+ * encrypted with the record key. The nonce of the record at offset "pos" in
+ * the log area is the block's nonce with the second and third byte XOR-ed
+ * with pos + 1 (little-endian). A length byte of 0xff marks the end of the
+ * log.
+ *
+ * Since writing to Flash only clears bits, records can be added by writing a
+ * block that is all-ones except for the new record (see db_log_append). A
+ * record that was only partly written does not pass authentication, and is
+ * skipped. If its length byte was damaged, the following records can't be
+ * found anymore, and we consider the log full.
  */
 
+#define	WPK_V2		0x80	/* in the last byte of the writer's pubkey */
+#define	HINT_BYTES	4
+
+#define	SLOT_V1_BYTES	crypto_secretbox_KEYBYTES
+#define	SLOT_V2_BYTES	(crypto_secretbox_KEYBYTES + HINT_BYTES)
+
+#define	LOG_UNIT	16
+#define	LOG_MAX_UNITS	255
+
 #define	BLOCK_OVERHEAD	(crypto_box_PUBLICKEYBYTES +		\
 			    crypto_secretbox_NONCEBYTES +	\
 			    crypto_secretbox_KEYBYTES)
 
-/*
- * MAX_MLEN is the maximum message length given to crypto_secretbox and
- * crypto_secretbox_open. It is the size of the maximum payload plus the
- * required padding.
- */
-
-#define	MAX_MLEN	(STORAGE_BLOCK_SIZE + crypto_secretbox_ZEROBYTES - \
-			    BLOCK_OVERHEAD)
-
 /*
  * secretbox bytes addition to the encrypted payload
  */
@@ -83,6 +125,8 @@ struct dbcrypt {
 #define	BOX_OVERHEAD	(crypto_secretbox_ZEROBYTES -		\
 			    crypto_secretbox_BOXZEROBYTES)
 
+#define	LOG_MIN_UNITS	2	/* don't bother with smaller logs */
+
 /*
  * NaCl's C API applies padding to its input and output buffers, so we can't
  * operate directly on block and plaintext buffers (which have no room for the
@@ -92,25 +136,34 @@ struct dbcrypt {
  * pSRAM ?
  */
 
-static uint8_t in_buf[STORAGE_BLOCK_SIZE + crypto_secretbox_ZEROBYTES];
-static uint8_t out_buf[STORAGE_BLOCK_SIZE + crypto_secretbox_ZEROBYTES];
+static uint8_t in_buf[STORAGE_BLOCK_MAX + crypto_secretbox_ZEROBYTES];
+static uint8_t out_buf[STORAGE_BLOCK_MAX + crypto_secretbox_ZEROBYTES];
+
+/*
+ * The part of in_buf and out_buf we may have used with the current block size.
+ */
+
+static inline unsigned buf_used(void)
+{
+	return storage_block_size() + crypto_secretbox_ZEROBYTES;
+}
 
 
 /* --- Encrypt ------------------------------------------------------------- */
 
 
 static void db_encrypt_payload(void *block, uint8_t *encrypted,
-    const void *content, unsigned length, const uint8_t *rk)
+    const uint8_t *box_end, const void *content, unsigned length,
+    const uint8_t *rk)
 {
-	const uint8_t *block_end = block + STORAGE_BLOCK_SIZE;
 	uint8_t *nonce = block + crypto_box_PUBLICKEYBYTES;
-	unsigned encrypted_bytes = block_end - encrypted;
+	unsigned encrypted_bytes = box_end - encrypted;
 	unsigned mlen = crypto_secretbox_ZEROBYTES - BOX_OVERHEAD +
 	    encrypted_bytes;
 
 	assert(mlen <= sizeof(in_buf));
 	assert(mlen <= sizeof(out_buf));
-	memset(in_buf, 0, sizeof(in_buf));
+	memset(in_buf, 0, mlen);
 	memcpy(in_buf + crypto_secretbox_ZEROBYTES, content, length);
 
 	t0();
@@ -120,12 +173,12 @@ static void db_encrypt_payload(void *block, uint8_t *encrypted,
 
 	memcpy(encrypted, out_buf + crypto_secretbox_BOXZEROBYTES,
 	    mlen - crypto_secretbox_BOXZEROBYTES);
-	assert(encrypted + mlen - crypto_secretbox_BOXZEROBYTES == block_end);
+	assert(encrypted + mlen - crypto_secretbox_BOXZEROBYTES == box_end);
 }
 
 
-bool db_encrypt(const struct dbcrypt *c, void *block, const void *content,
-    unsigned length)
+int db_encrypt(const struct dbcrypt *c, void *block, const void *content,
+    unsigned length, struct db_log *log)
 {
 	/* --- block layout --- */
 
@@ -135,17 +188,42 @@ bool db_encrypt(const struct dbcrypt *c, void *block, const void *content,
 	for (reader = c->readers; reader; reader = reader->next)
 		n_readers++;
 	assert(n_readers);
+	assert(n_readers <= DB_MAX_READERS);
 
-	const uint8_t *block_end = block + STORAGE_BLOCK_SIZE;
+	const uint8_t *block_end = block + storage_block_size();
 	uint8_t *wpk = block;	/* writer's pubkey */
 	uint8_t *nonce = wpk + crypto_box_PUBLICKEYBYTES;
 	uint8_t *reader_list = nonce + crypto_secretbox_NONCEBYTES;
-	unsigned reader_list_bytes = n_readers * crypto_secretbox_KEYBYTES;
+	unsigned reader_list_bytes = n_readers * SLOT_V2_BYTES;
 	uint8_t *encrypted = reader_list + reader_list_bytes;
-	unsigned encrypted_bytes = block_end - encrypted;
+	unsigned encrypted_bytes;
+
+	/* small blocks may not have room for many readers or a large payload */
+	if (encrypted + BOX_OVERHEAD + length > block_end) {
+		debug("db_encrypt: %u bytes and %u readers don't fit\n",
+		    length, n_readers);
+		return -1;
+	}
+	encrypted_bytes = block_end - encrypted;
+
+	/* --- log area --- */
+
+	unsigned log_units = 0;
+
+	if (log) {
+		log_units = (encrypted_bytes - length - BOX_OVERHEAD) /
+		    LOG_UNIT;
+		if (log_units > LOG_MAX_UNITS)
+			log_units = LOG_MAX_UNITS;
+		if (log_units < LOG_MIN_UNITS)
+			log_units = 0;
+		log->offset = storage_block_size() - log_units * LOG_UNIT;
+		log->size = log_units * LOG_UNIT;
+		log->used = 0;
+		log->len = 0;
+	}
 
-	assert(encrypted + BOX_OVERHEAD <= block_end);
-	assert(encrypted_bytes >= length + BOX_OVERHEAD);
+	uint8_t *box_end = (uint8_t *) block_end - log_units * LOG_UNIT;
 
 	/* --- generate nonce and record key --- */
 
@@ -156,43 +234,205 @@ bool db_encrypt(const struct dbcrypt *c, void *block, const void *content,
 
 	/* --- encrypt --- */
 
-	db_encrypt_payload(block, encrypted, content, length, rk);
+	db_encrypt_payload(block, encrypted, box_end, content, length, rk);
+	memset(box_end, 0xff, log_units * LOG_UNIT);
 
 	/* --- populate the rest of the block --- */
 
 	memcpy(wpk, c->pk, crypto_box_PUBLICKEYBYTES);
+	wpk[crypto_box_PUBLICKEYBYTES - 1] |= WPK_V2;
 
 	uint8_t *b = reader_list;
 	uint8_t nonce2[crypto_secretbox_NONCEBYTES];
 	uint8_t i = 0;
 
 	for (reader = c->readers; reader; reader = reader->next) {
-		memset(in_buf, 0, crypto_secretbox_ZEROBYTES);
+		uint8_t *hint = in_buf + crypto_secretbox_ZEROBYTES +
+		    crypto_secretbox_KEYBYTES;
+
+		memset(in_buf, 0, crypto_secretbox_ZEROBYTES + SLOT_V2_BYTES);
 		memcpy(in_buf + crypto_secretbox_ZEROBYTES, rk,
 		    crypto_secretbox_KEYBYTES);
+		hint[0] = n_readers;
+		hint[1] = log_units;
 		memcpy(nonce2, nonce, crypto_secretbox_NONCEBYTES);
 		i++;
 		nonce2[0] ^= i;
 
 		t0();
 		if (crypto_stream_xor(out_buf, in_buf,
-		    crypto_secretbox_ZEROBYTES + crypto_secretbox_KEYBYTES,
+		    crypto_secretbox_ZEROBYTES + SLOT_V2_BYTES,
 		    nonce2, reader->k))
 			DIE("crypto_stream_xor failed");
 		t1("db_encrypt:crypto_stream_xor\n");
 
-		memcpy(b, out_buf + crypto_secretbox_ZEROBYTES,
-		    crypto_secretbox_KEYBYTES);
-		b += crypto_secretbox_KEYBYTES;
+		memcpy(b, out_buf + crypto_secretbox_ZEROBYTES, SLOT_V2_BYTES);
+		b += SLOT_V2_BYTES;
 	}
 	assert(b == encrypted);
 
 	/* --- clean up --- */
 
 	memset(rk, 0, sizeof(rk));
-	memset(in_buf, 0, sizeof(in_buf));
-	memset(out_buf, 0, sizeof(out_buf));
+	memset(in_buf, 0, buf_used());
+	memset(out_buf, 0, buf_used());
+
+	return box_end - encrypted - BOX_OVERHEAD;
+}
+
 
+/* --- Shared secrets of writers ------------------------------------------- */
+
+
+/*
+ * find_shared returns the shared public-key encryption secret of the writer
+ * "wpk" and us. We first look in the readers list, then in the cache, and only
+ * calculate the secret if we haven't seen the writer recently.
+ *
+ * The cache is not part of the (logical) state of the dbcrypt context, so we
+ * update it even if we only have a "const" pointer to the context.
+ */
+
+static const uint8_t *find_shared(const struct dbcrypt *c, const uint8_t *wpk)
+{
+	struct dbcrypt *cc = (struct dbcrypt *) c;
+	struct peer **anchor, **last = NULL;
+	struct peer *p;
+	unsigned n = 0;
+
+	for (p = c->readers; p; p = p->next)
+		if (!memcmp(p->pk, wpk, crypto_box_PUBLICKEYBYTES))
+			return p->k;
+
+	for (anchor = &cc->cache; *anchor; anchor = &(*anchor)->next) {
+		p = *anchor;
+		if (!memcmp(p->pk, wpk, crypto_box_PUBLICKEYBYTES)) {
+			/* move to the front of the list */
+			*anchor = p->next;
+			p->next = cc->cache;
+			cc->cache = p;
+			return p->k;
+		}
+		last = anchor;
+		n++;
+	}
+
+	if (n < WRITER_CACHE_SIZE) {
+		p = alloc_type(struct peer);
+	} else {
+		/* recycle the least recently used entry */
+		p = *last;
+		*last = NULL;
+	}
+	memcpy(p->pk, wpk, crypto_box_PUBLICKEYBYTES);
+
+	t0();
+	if (crypto_box_beforenm(p->k, p->pk, c->sk)) {
+		debug("crypto_box_beforenm failed\n");
+		memset(p, 0, sizeof(*p));
+		free(p);
+		return NULL;
+	}
+	t1("find_shared:crypto_box_beforenm\n");
+
+	p->next = cc->cache;
+	cc->cache = p;
+	return p->k;
+}
+
+
+/* --- Log area ------------------------------------------------------------ */
+
+
+static void log_nonce(uint8_t *nonce2, const void *block, unsigned pos)
+{
+	memcpy(nonce2, block + crypto_box_PUBLICKEYBYTES,
+	    crypto_secretbox_NONCEBYTES);
+	nonce2[1] ^= pos + 1;
+	nonce2[2] ^= (pos + 1) >> 8;
+}
+
+
+/*
+ * Walk the records and collect the ones we can authenticate in log->buf, if
+ * there is room. log->used is the offset of the end of the log, or the size
+ * of the log area if we can't tell where the log ends.
+ */
+
+static void log_read(struct db_log *log, const void *block,
+    const uint8_t *rk)
+{
+	const uint8_t *log_area = block + log->offset;
+	uint8_t nonce2[crypto_secretbox_NONCEBYTES];
+	unsigned pos = 0;
+
+	while (pos != log->size && log_area[pos] != 0xff) {
+		unsigned len = log_area[pos];
+		unsigned mlen = crypto_secretbox_ZEROBYTES + len;
+
+		if (len > DB_MAX_RECORD ||
+		    pos + 1 + BOX_OVERHEAD + len > log->size) {
+			debug("log_read: bad record at %u\n", pos);
+			pos = log->size;
+			break;
+		}
+		log_nonce(nonce2, block, pos);
+		memset(in_buf, 0, crypto_secretbox_BOXZEROBYTES);
+		memcpy(in_buf + crypto_secretbox_BOXZEROBYTES,
+		    log_area + pos + 1, BOX_OVERHEAD + len);
+
+		t0();
+		if (crypto_secretbox_open(out_buf, in_buf, mlen, nonce2, rk)) {
+			debug("log_read: bad record at %u\n", pos);
+		} else {
+			t1("log_read:crypto_secretbox_open\n");
+			if (log->buf && log->len + 1 + len <= log->buf_size) {
+				log->buf[log->len] = len;
+				memcpy(log->buf + log->len + 1,
+				    out_buf + crypto_secretbox_ZEROBYTES, len);
+				log->len += 1 + len;
+			}
+		}
+		memset(in_buf, 0, mlen);
+		memset(out_buf, 0, mlen);
+		pos += 1 + BOX_OVERHEAD + len;
+	}
+	log->used = pos;
+}
+
+
+static bool log_write(void *out, const void *block, const struct db_log *log,
+    const uint8_t *rk, const void *record, unsigned len)
+{
+	const uint8_t *log_area = block + log->offset;
+	uint8_t nonce2[crypto_secretbox_NONCEBYTES];
+	unsigned mlen = crypto_secretbox_ZEROBYTES + len;
+	uint8_t *p = out + log->offset + log->used;
+	unsigned i;
+
+	assert(len <= DB_MAX_RECORD);
+	if (log->used + 1 + BOX_OVERHEAD + len > log->size)
+		return 0;
+	/* we need the space to be erased, also after a partial write */
+	for (i = 0; i != 1 + BOX_OVERHEAD + len; i++)
+		if (log_area[log->used + i] != 0xff)
+			return 0;
+
+	log_nonce(nonce2, block, log->used);
+	memset(in_buf, 0, crypto_secretbox_ZEROBYTES);
+	memcpy(in_buf + crypto_secretbox_ZEROBYTES, record, len);
+
+	t0();
+	if (crypto_secretbox(out_buf, in_buf, mlen, nonce2, rk))
+		DIE("crypto_secretbox failed");
+	t1("log_write:crypto_secretbox\n");
+
+	memset(out, 0xff, storage_block_size());
+	*p = len;
+	memcpy(p + 1, out_buf + crypto_secretbox_BOXZEROBYTES,
+	    BOX_OVERHEAD + len);
+	memset(in_buf, 0, mlen);
+	memset(out_buf, 0, mlen);
 	return 1;
 }
 
@@ -201,12 +441,11 @@ bool db_encrypt(const struct dbcrypt *c, void *block, const void *content,
 
 
 static int db_decrypt_payload(void *content, unsigned size, const void *block,
-    const uint8_t *encrypted, const uint8_t *rk)
+    const uint8_t *encrypted, const uint8_t *box_end, const uint8_t *rk)
 {
 	int length = -1; /* -1 means that we could not decrypt the block */
-	const uint8_t *block_end = block + STORAGE_BLOCK_SIZE;
 	const uint8_t *nonce = block + crypto_box_PUBLICKEYBYTES;
-	unsigned encrypted_bytes = block_end - encrypted;
+	unsigned encrypted_bytes = box_end - encrypted;
 
 	/* --- decrypt the payload --- */
 
@@ -235,84 +474,90 @@ static int db_decrypt_payload(void *content, unsigned size, const void *block,
 	/* --- clean up --- */
 
 cleanup:
-	memset(in_buf, 0, sizeof(in_buf));
-	memset(out_buf, 0, sizeof(out_buf));
+	memset(in_buf, 0, buf_used());
+	memset(out_buf, 0, buf_used());
 
 	return length;
 }
 
 
-static int db_try_decrypt(void *content, unsigned size, const void *block,
-    const uint8_t *encrypted, unsigned i, const uint8_t *ek,
-    const uint8_t *shared)
+/*
+ * db_decrypt_slot decrypts the first "bytes" bytes of the reader slot "i",
+ * which begins at "ek", and stores the result in "out".
+ */
+
+static bool db_decrypt_slot(uint8_t *out, unsigned bytes, const void *block,
+    unsigned i, const uint8_t *ek, const uint8_t *shared)
 {
-	int length = -1; /* means that we could not decrypt the block */
 	const uint8_t *nonce = block + crypto_box_PUBLICKEYBYTES;
-	uint8_t rk[crypto_box_PUBLICKEYBYTES];
 	uint8_t nonce2[crypto_secretbox_NONCEBYTES];
-
-	/* --- decrypt the record key --- */
+	bool ok;
 
 	memcpy(nonce2, nonce, crypto_secretbox_NONCEBYTES);
 	nonce2[0] ^= i + 1;
 	memset(in_buf, 0, crypto_secretbox_ZEROBYTES);
-	memcpy(in_buf + crypto_secretbox_ZEROBYTES, ek,
-	    crypto_secretbox_KEYBYTES);
+	memcpy(in_buf + crypto_secretbox_ZEROBYTES, ek, bytes);
 
 	t0();
-	if (crypto_stream_xor(out_buf, in_buf,
-	    crypto_secretbox_ZEROBYTES + crypto_secretbox_KEYBYTES, nonce2,
-	    shared)) {
-		debug("crypto_stream_xor failed\b");
-		goto cleanup;
+	ok = !crypto_stream_xor(out_buf, in_buf,
+	    crypto_secretbox_ZEROBYTES + bytes, nonce2, shared);
+	if (ok) {
+		t1("db_decrypt:crypto_stream_xor\n");
+		memcpy(out, out_buf + crypto_secretbox_ZEROBYTES, bytes);
+	} else {
+		debug("crypto_stream_xor failed\n");
 	}
-	t1("db_decrypt:crypto_stream_xor\n");
 
-	memcpy(rk, out_buf + crypto_secretbox_ZEROBYTES,
-	    crypto_secretbox_KEYBYTES);
+	memset(in_buf, 0, crypto_secretbox_ZEROBYTES + bytes);
+	memset(out_buf, 0, crypto_secretbox_ZEROBYTES + bytes);
+
+	return ok;
+}
+
+
+static int db_try_decrypt(void *content, unsigned size, const void *block,
+    const uint8_t *encrypted, unsigned i, const uint8_t *ek,
+    const uint8_t *shared)
+{
+	int length = -1; /* means that we could not decrypt the block */
+	uint8_t rk[crypto_secretbox_KEYBYTES];
+
+	/* --- decrypt the record key --- */
+
+	if (!db_decrypt_slot(rk, SLOT_V1_BYTES, block, i, ek, shared))
+		return -1;
 
 	/* --- decrypt the payload --- */
 
-	length = db_decrypt_payload(content, size, block, encrypted, rk);
+	length = db_decrypt_payload(content, size, block, encrypted,
+	    block + storage_block_size(), rk);
 
 	/* --- clean up --- */
 
-cleanup:
 	memset(rk, 0, sizeof(rk));
 
 	return length;
 }
 
 
-int db_decrypt(const struct dbcrypt *c, void *content, unsigned size,
-    const void *block)
+/*
+ * Version 1: try all possible layouts and record keys.
+ */
+
+static int db_decrypt_v1(void *content, unsigned size, const void *block,
+    const uint8_t *shared)
 {
 	int length = -1; /* means that we could not decrypt the block */
 
 	/* --- block layout --- */
 
-	const uint8_t *block_end = block + STORAGE_BLOCK_SIZE;
-	const uint8_t *wpk = block;	/* writer's pubkey */
-	const uint8_t *nonce = wpk + crypto_box_PUBLICKEYBYTES;
-	const uint8_t *reader_list = nonce + crypto_secretbox_NONCEBYTES;
+	const uint8_t *block_end = block + storage_block_size();
+	const uint8_t *reader_list = block + crypto_box_PUBLICKEYBYTES +
+	    crypto_secretbox_NONCEBYTES;
 	unsigned n_readers;
 
-	/* --- shared public-key encryption secret --- */
-
-	uint8_t shared[crypto_secretbox_KEYBYTES];
-
-	t0();
-	if (crypto_box_beforenm(shared, wpk, c->sk)) {
-		debug("crypto_box_beforenm failed\n");
-		return -1;
-	}
-	t1("db_decrypt:crypto_box_beforenm\n");
-
-	/* --- try all possible layouts and record keys --- */
-
 	for (n_readers = 1; n_readers <= DB_MAX_READERS; n_readers++) {
-		unsigned reader_list_bytes =
-		    n_readers * crypto_secretbox_KEYBYTES;
+		unsigned reader_list_bytes = n_readers * SLOT_V1_BYTES;
 		const uint8_t *encrypted = reader_list + reader_list_bytes;
 		unsigned encrypted_bytes = block_end - encrypted;
 
@@ -332,8 +577,6 @@ int db_decrypt(const struct dbcrypt *c, void *content, unsigned size,
 		unsigned i;
 
 		for (i = 0; i != n_readers; i++) {
-			/* @@@ should first search the reader list and the
-			   cache of share public-key encryption secrets  */
 			/* @@@ cache decrypted record keys ? */
 
 			/* --- decrypt the payload --- */
@@ -344,22 +587,152 @@ int db_decrypt(const struct dbcrypt *c, void *content, unsigned size,
 			if (length != -1) {
 				debug("db_decrypt: found at %u / %u\n",
 				    i, n_readers);
-				goto done;
+				return length;
 			}
 
-			b += crypto_secretbox_KEYBYTES;
+			b += SLOT_V1_BYTES;
+		}
+	}
+
+	return length;
+}
+
+
+/*
+ * Version 2: use the hint to find our slot and the block layout. We only
+ * attempt to open the secretbox if the hint looks valid.
+ */
+
+static int db_decrypt_v2(void *content, unsigned size, const void *block,
+    const uint8_t *shared, struct db_log *log, uint8_t *rk)
+{
+	int length = -1; /* means that we could not decrypt the block */
+
+	/* --- block layout --- */
+
+	const uint8_t *block_end = block + storage_block_size();
+	const uint8_t *reader_list = block + crypto_box_PUBLICKEYBYTES +
+	    crypto_secretbox_NONCEBYTES;
+
+	/* --- find our slot --- */
+
+	uint8_t slot[SLOT_V2_BYTES];
+	const uint8_t *hint = slot + crypto_secretbox_KEYBYTES;
+	unsigned i;
+
+	for (i = 0; i != DB_MAX_READERS; i++) {
+		const uint8_t *b = reader_list + i * SLOT_V2_BYTES;
+		const uint8_t *encrypted, *box_end;
+		unsigned n_readers;
+
+		if (b + SLOT_V2_BYTES + BOX_OVERHEAD > block_end)
+			break;
+		if (!db_decrypt_slot(slot, SLOT_V2_BYTES, block, i, b, shared))
+			break;
+
+		n_readers = hint[0];
+		if (n_readers <= i || n_readers > DB_MAX_READERS)
+			continue;
+		if (hint[2] || hint[3])
+			continue;
+		encrypted = reader_list + n_readers * SLOT_V2_BYTES;
+		if (encrypted + BOX_OVERHEAD + hint[1] * LOG_UNIT > block_end)
+			continue;
+		box_end = block_end - hint[1] * LOG_UNIT;
+
+		/* --- decrypt the payload --- */
+
+		length = db_decrypt_payload(content, size, block, encrypted,
+		    box_end, slot);
+		if (length != -1) {
+			debug("db_decrypt: found at %u / %u\n", i, n_readers);
+			break;
 		}
 	}
 
+	/* --- read the log --- */
+
+	if (length != -1 && hint[1] && log) {
+		log->offset = storage_block_size() - hint[1] * LOG_UNIT;
+		log->size = hint[1] * LOG_UNIT;
+		log_read(log, block, slot);
+	}
+	if (length != -1 && rk)
+		memcpy(rk, slot, crypto_secretbox_KEYBYTES);
+
 	/* --- clean up --- */
 
-done:
-	memset(shared, 0, sizeof(shared));
+	memset(slot, 0, sizeof(slot));
 
 	return length;
 }
 
 
+/*
+ * If "rk" is not NULL, we also return the record key. Only version 2 blocks
+ * can have a log, so we don't need the key of version 1 blocks.
+ */
+
+static int decrypt_block(const struct dbcrypt *c, void *content,
+    unsigned size, const void *block, struct db_log *log, uint8_t *rk)
+{
+	uint8_t wpk[crypto_box_PUBLICKEYBYTES];	/* writer's pubkey */
+	const uint8_t *shared;
+	bool v2;
+
+	if (log) {
+		log->offset = storage_block_size();
+		log->size = 0;
+		log->used = 0;
+		log->len = 0;
+	}
+	memcpy(wpk, block, crypto_box_PUBLICKEYBYTES);
+	v2 = wpk[crypto_box_PUBLICKEYBYTES - 1] & WPK_V2;
+	wpk[crypto_box_PUBLICKEYBYTES - 1] &= ~WPK_V2;
+
+	/* --- shared public-key encryption secret --- */
+
+	shared = find_shared(c, wpk);
+	if (!shared)
+		return -1;
+
+	/* --- decrypt the payload, depending on the format version --- */
+
+	if (v2)
+		return db_decrypt_v2(content, size, block, shared, log, rk);
+	else
+		return db_decrypt_v1(content, size, block, shared);
+}
+
+
+int db_decrypt(const struct dbcrypt *c, void *content, unsigned size,
+    const void *block, struct db_log *log)
+{
+	return decrypt_block(c, content, size, block, log, NULL);
+}
+
+
+/* --- Add a record to the log --------------------------------------------- */
+
+
+bool db_log_append(const struct dbcrypt *c, void *out, const void *block,
+    const void *record, unsigned len)
+{
+	uint8_t rk[crypto_secretbox_KEYBYTES];
+	struct db_log log = { .buf = NULL };
+	bool ok = 0;
+
+	/* we use "out" for the decrypted content, which we don't need */
+	if (decrypt_block(c, out, storage_block_size(), block, &log, rk) >= 0 &&
+	    log.size)
+		ok = log_write(out, block, &log, rk, record, len);
+	if (!ok)
+		memset(out, 0, storage_block_size());
+	memset(rk, 0, sizeof(rk));
+	return ok;
+}
+
+
 /* --- Retrieve the public key --------------------------------------------- */
 
 
@@ -431,6 +804,7 @@ static void free_peers(struct peer *p)
 		struct peer *next = p->next;
 
 		memset(p, 0, sizeof(*p));
+		free(p);
 		p = next;
 	}
 }
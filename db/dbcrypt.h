@@ -9,12 +9,30 @@
 #define	DBCRYPT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 
 struct dbcrypt;
 
 #define	DB_NONCE_SIZE	24
 #define	DB_MAX_READERS	12
+#define	DB_MAX_RECORD	128	/* maximum data bytes in a log record */
+
+/*
+ * A block can end with a log area, to which records can be added without
+ * rewriting the block (see dbcrypt.c). When decrypting, the data of the valid
+ * records is stored in "buf", each record preceded by its length (one byte).
+ * Records that don't fit into the buffer are dropped.
+ */
+
+struct db_log {
+	unsigned	offset;	/* of the log area in the block */
+	unsigned	size;	/* bytes in the log area, 0 if no log */
+	unsigned	used;	/* bytes no longer erased */
+	uint8_t		*buf;	/* set by the caller, can be NULL */
+	unsigned	buf_size;
+	unsigned	len;	/* bytes stored in "buf" */
+};
 
 
 const void *dbcrypt_pubkey(const struct dbcrypt *c);
@@ -23,15 +41,28 @@ const void *dbcrypt_pubkey(const struct dbcrypt *c);
  * "Content" is all the encrypted data, including status, payload, hash, and
  * reserved bytes.
  *
- * db_encrypt returns 1 if the encryption was successful, 0 otherwise.
+ * db_encrypt returns -1 if the encryption failed, otherwise the length of the
+ * content db_decrypt will return, i.e., "length" plus the zero-padding. If
+ * "log" is not NULL, the space not needed for the content becomes the log
+ * area, and "log" returns its (empty) state.
+ *
  * db_decrypt returns -1 if decrypting failed, the length of the decrypted
- * content otherwise.
+ * content otherwise. If "log" is not NULL, it also returns the state of the
+ * log area.
+ *
+ * db_log_append prepares adding "record", of "len" bytes, to the log area of
+ * "block". It stores a block in "out" that only has the bits of the record
+ * cleared, and can thus be written over the existing block. db_log_append
+ * returns 0 if the block cannot be decrypted, or if the log area does not
+ * exist or has no room for the record.
  */
 
-bool db_encrypt(const struct dbcrypt *c, void *block, const void *content,
-    unsigned length);
+int db_encrypt(const struct dbcrypt *c, void *block, const void *content,
+    unsigned length, struct db_log *log);
 int db_decrypt(const struct dbcrypt *c, void *content, unsigned size,
-    const void *block);
+    const void *block, struct db_log *log);
+bool db_log_append(const struct dbcrypt *c, void *out, const void *block,
+    const void *record, unsigned len);
 
 struct dbcrypt *dbcrypt_init(const void *sk, unsigned size);
 void dbcrypt_add_reader(struct dbcrypt *c, const void *pk, unsigned size);
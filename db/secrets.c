@@ -173,6 +173,93 @@ static void id_hash(void *out, uint32_t pin)
 }
 
 
+/* --- Pad block header ---------------------------------------------------- */
+
+
+/*
+ * Each pad block begins with a header of MASTER_SECRET_BYTES bytes, followed
+ * by the pads. The header contains the sequence number (16 bits), and the
+ * size of the storage blocks of the partition (8 bits, log2 of the size in
+ * bytes). The rest of the header is all-ones. Pad blocks written before the
+ * block size was recorded have 0xff instead of the block size, and use 1 kB
+ * blocks.
+ */
+
+#define	PAD_BLOCK_SHIFT	2	/* offset of the block size */
+#define	LEGACY_SHIFT	10	/* 1 kB blocks */
+
+
+static void pad_header(uint16_t seq)
+{
+	unsigned size = storage_block_size();
+	uint8_t shift = 0;
+
+	memset(io_buf, 0xff, MASTER_SECRET_BYTES);
+	*(uint16_t *) io_buf = seq;
+	while (size >>= 1)
+		shift++;
+	io_buf[PAD_BLOCK_SHIFT] = shift;
+}
+
+
+/*
+ * Pad units begin at the same offset for any block size, and the header is
+ * smaller than the smallest block, so we can find the block size of the
+ * partition by reading the first block of each pad unit with whatever block
+ * size is currently set. If there are no pads, we keep the block size.
+ *
+ * pad_in_unit reads the first block of pad unit "n" into io_buf, and returns
+ * whether it holds a pad block.
+ */
+
+static bool pad_in_unit(unsigned n)
+{
+	unsigned i;
+
+	if (!storage_read_block(io_buf, n * storage_erase_size()))
+		return 0;
+	for (i = 0; i != 2 * MASTER_SECRET_BYTES; i++)
+		if (io_buf[i] != 0xff)
+			return 1;
+	return 0;
+}
+
+
+static void setup_block_size(void)
+{
+	unsigned n;
+
+	for (n = 0; n != PAD_UNITS; n++) {
+		uint8_t shift;
+
+		if (!pad_in_unit(n))
+			continue;
+		shift = io_buf[PAD_BLOCK_SHIFT];
+		if (shift == 0xff)
+			shift = LEGACY_SHIFT;
+		if (shift >= 16 || !storage_set_block_size(1 << shift))
+			debug("bad block size (shift %u)\n", shift);
+		return;
+	}
+}
+
+
+/*
+ * secrets_new writes the first pad block, and only erasing the whole partition
+ * removes all of them. A pad block therefore marks the partition as set up.
+ */
+
+bool secrets_have_pad_block(void)
+{
+	unsigned n;
+
+	for (n = 0; n != PAD_UNITS; n++)
+		if (pad_in_unit(n))
+			return 1;
+	return 0;
+}
+
+
 /* --- Adapt master key ---------------------------------------------------- */
 
 
@@ -240,6 +327,141 @@ found:
 }
 
 
+/* --- Index hints --------------------------------------------------------- */
+
+
+/*
+ * The blocks following the pad block in the same erase unit are used as a log
+ * of hints where to find the database index (see db.c). Each hint is a 16-bit
+ * block number. Unused hints are 0xffff, and the last hint that is used is the
+ * current one. The log is erased together with the old pad when the PIN
+ * changes, and secrets_change copies the current hint to the new log.
+ *
+ * When the log is full, secrets_put_hint starts a new one, by moving the pad
+ * block to the other pad unit.
+ *
+ * If the pad block fills the erase unit, the log is in the HINT_BLOCKS after
+ * the pads instead, and stays when the PIN changes. A new log then simply
+ * erases the old one. If we crash before writing the next hint, the next
+ * db_open scans the partition.
+ */
+
+#define	HINTS_PER_BLOCK	(storage_block_size() / sizeof(uint16_t))
+#define	NO_HINT		0xffff
+
+
+static unsigned hint_log(void)
+{
+	return HINT_BLOCKS ? PAD_BLOCKS : (unsigned) pad_block + 1;
+}
+
+
+static unsigned hint_log_blocks(void)
+{
+	return HINT_BLOCKS ? HINT_BLOCKS : storage_erase_size() - 1;
+}
+
+
+/*
+ * find_hint returns the number of the first unused hint, and the last hint in
+ * *last (NO_HINT if there is none). It returns -1 if the log is full or if we
+ * don't have a pad block.
+ */
+
+static int find_hint(uint16_t *last)
+{
+	const uint16_t *h = (const void *) io_buf;
+	unsigned n_blocks = hint_log_blocks();
+	unsigned i, j;
+
+	*last = NO_HINT;
+	if (pad_block < 0)
+		return -1;
+	for (i = 0; i != n_blocks; i++) {
+		if (!storage_read_block(io_buf, hint_log() + i))
+			return -1;
+		for (j = 0; j != HINTS_PER_BLOCK; j++) {
+			if (h[j] == NO_HINT)
+				return i * HINTS_PER_BLOCK + j;
+			*last = h[j];
+		}
+	}
+	return -1;
+}
+
+
+int secrets_get_hint(void)
+{
+	uint16_t last;
+
+	find_hint(&last);
+	return last == NO_HINT ? -1 : last;
+}
+
+
+bool secrets_hint_space(void)
+{
+	return pad_block >= 0;
+}
+
+
+/*
+ * The new pad block is a copy of the current one, with the next sequence
+ * number. As in secrets_change, it has to be durable before we erase the old
+ * one. If erasing fails, secrets_setup still picks the new block, since its
+ * sequence number is higher.
+ */
+
+static bool new_hint_log(void)
+{
+	unsigned new_block = (pad_block + storage_erase_size()) % PAD_BLOCKS;
+
+	if (HINT_BLOCKS) {
+		if (storage_erase_blocks(hint_log(), storage_erase_size()))
+			return 1;
+		debug("new_hint_log: cannot erase block %u\n", hint_log());
+		return 0;
+	}
+	if (!storage_erase_blocks(new_block, storage_erase_size()) ||
+	    !storage_read_block(io_buf, pad_block)) {
+		debug("new_hint_log: cannot prepare block %u\n", new_block);
+		return 0;
+	}
+	*(uint16_t *) io_buf = pad_seq + 1;
+	if (!storage_write_block(io_buf, new_block) || !storage_sync()) {
+		debug("new_hint_log: cannot write block %u\n", new_block);
+		return 0;
+	}
+	if (!storage_erase_blocks(pad_block, storage_erase_size()))
+		debug("new_hint_log: cannot erase old block %u\n", pad_block);
+	pad_block = new_block;
+	pad_seq++;
+	debug("new_hint_log: block %u, seq %u\n", pad_block, pad_seq);
+	return 1;
+}
+
+
+bool secrets_put_hint(unsigned block)
+{
+	uint16_t *h = (void *) io_buf;
+	uint16_t last;
+	int n;
+
+	assert(block < NO_HINT);
+	if (pad_block < 0)
+		return 0;
+	n = find_hint(&last);
+	if (n < 0) {
+		if (!new_hint_log())
+			return 0;
+		n = 0;
+	}
+	memset(io_buf, 0xff, storage_block_size());
+	h[n % HINTS_PER_BLOCK] = block;
+	return storage_write_block(io_buf, hint_log() + n / HINTS_PER_BLOCK);
+}
+
+
 /* --- Management of secrets ----------------------------------------------- */
 
 
@@ -249,19 +471,22 @@ bool secrets_change(uint32_t old_pin, uint32_t new_pin)
 	int best_seq = -1;
 	unsigned new_block;
 	uint16_t *seq = (void *) io_buf;
+	int hint;
 
 	assert(have_pad);
 	assert(pad_block > -1);
 
+	hint = secrets_get_hint();
+
 	for (n = 0; n < PAD_BLOCKS; n += storage_erase_size())
 		if (n != (unsigned) pad_block &&
 		    storage_read_block(io_buf, pad_block)) {
 			unsigned i;
 
-			for (i = 0; i != STORAGE_BLOCK_SIZE; i++)
+			for (i = 0; i != storage_block_size(); i++)
 				if (io_buf[i] != 0xff)
 					break;
-			if (i == STORAGE_BLOCK_SIZE) {
+			if (i == storage_block_size()) {
 				new_block = n;
 				goto erased;
 			}
@@ -296,11 +521,10 @@ erased:
 	for (i = 0; i != MASTER_SECRET_BYTES; i++)
 		new_pad[i] = master_pattern[i] ^ master_secret[i];
 
-	memset(io_buf, 0xff, MASTER_SECRET_BYTES);
-	*seq = pad_seq + 1;
+	pad_header(pad_seq + 1);
 
 	ok = change_pad(io_buf + MASTER_SECRET_BYTES,
-	    STORAGE_BLOCK_SIZE - MASTER_SECRET_BYTES,
+	    storage_block_size() - MASTER_SECRET_BYTES,
 	    old_id, pad_id, new_pad);
 
 	memset(pad_id, 0, sizeof(pad_id));
@@ -311,7 +535,11 @@ erased:
 		return 0;
 	}
 
-	if (!storage_write_block(io_buf, new_block)) {
+	/*
+	 * The new pad must be durable before we erase the old one, or a crash
+	 * could leave us without any pad.
+	 */
+	if (!storage_write_block(io_buf, new_block) || !storage_sync()) {
 		debug("storage_write_block failed\n");
 		return 0;
 	}
@@ -329,7 +557,11 @@ erased:
 
 	debug("secrets_change: block %u, seq %u\n", pad_block, pad_seq);
 
-	return 1;
+	/* the index is still valid, so we keep using it */
+	if (!HINT_BLOCKS && hint >= 0 && !secrets_put_hint(hint))
+		debug("could not copy hint %d\n", hint);
+
+	return storage_sync();
 }
 
 
@@ -341,12 +573,13 @@ bool secrets_setup(uint8_t *secret, int *block, uint32_t pin)
 	master_hash(master_pattern, pin);
 	id_hash(pad_id, pin);
 
+	/* the pad blocks are an erase unit apart, so we read them one by one */
 	for (n = 0; n < PAD_BLOCKS; n += storage_erase_size()) {
 		/* block layout */
 
 		const uint16_t *seq = (const void *) io_buf;
 		const uint8_t *pads = io_buf + MASTER_SECRET_BYTES;
-		unsigned pads_size = STORAGE_BLOCK_SIZE - MASTER_SECRET_BYTES;
+		unsigned pads_size = storage_block_size() - MASTER_SECRET_BYTES;
 
 		if (!storage_read_block(io_buf, n))
 			continue;
@@ -378,16 +611,15 @@ bool secrets_new(uint32_t pin)
 {
 	/* block layout */
 
-	uint16_t *seq = (void *) io_buf;
 	uint8_t *id = io_buf + MASTER_SECRET_BYTES;
 	uint8_t *pad = id + MASTER_SECRET_BYTES;
 	unsigned n, i;
 
 	/*
 	 * If an empty devvice is detected, it may still have some (useless)
-	 * pads. Try to get rid of them.
+	 * pads or hints. Try to get rid of them.
 	 */
-	for (n = 0; n < PAD_BLOCKS; n += storage_erase_size())
+	for (n = 0; n < RESERVED_BLOCKS; n += storage_erase_size())
 		if (!storage_erase_blocks(n, storage_erase_size()))
 			debug("could not erase %u\n", n);
 
@@ -395,8 +627,8 @@ bool secrets_new(uint32_t pin)
 	 * @@@ For later: optionally generate existing master secret from
 	 * BIP-0039 mnemonic sentence.
 	 */
-	memset(io_buf, 0xff, STORAGE_BLOCK_SIZE);
-	*seq = 0;
+	memset(io_buf, 0xff, storage_block_size());
+	pad_header(0);
 	rnd_bytes(master_secret, MASTER_SECRET_BYTES);
 	master_hash(master_pattern, pin);
 	for (i = 0; i != MASTER_SECRET_BYTES; i++)
@@ -412,7 +644,7 @@ bool secrets_new(uint32_t pin)
 
 	have_pad = 1;
 
-	return 1;
+	return storage_sync();
 }
 
 
@@ -443,6 +675,9 @@ bool secrets_init(void)
 	memset(master_secret, 0, sizeof(master_secret));
 
 	have_pad = 0;
+	pad_block = -1;
+
+	setup_block_size();
 
 	return 1;
 }
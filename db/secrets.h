@@ -24,6 +24,23 @@ bool secrets_setup(uint8_t *secret, int *pad_block, uint32_t pin);
 bool secrets_setup_master(uint32_t pin);
 bool secrets_new(uint32_t pin);
 
+/*
+ * secrets_have_pad_block returns whether the partition contains a pad block,
+ * i.e., whether a PIN has been set. It only reads the first block of each pad
+ * unit.
+ */
+bool secrets_have_pad_block(void);
+
+/*
+ * Hints where to find the database index. secrets_get_hint returns the most
+ * recent hint, or -1 if there is none. secrets_hint_space returns whether
+ * secrets_put_hint can record a new hint. If the hint log is full,
+ * secrets_put_hint starts a new one (see secrets.c).
+ */
+int secrets_get_hint(void);
+bool secrets_hint_space(void);
+bool secrets_put_hint(unsigned block);
+
 void secrets_test_pad(void);
 
 bool secrets_init(void);
@@ -0,0 +1,90 @@
+/*
+ * slab.c - Allocation of many small objects of the same size
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file LICENSE.MIT
+ */
+
+/*
+ * Each chunk begins with a pointer to the next chunk, followed by the objects.
+ * Free objects are linked through their first word. Compared to allocating
+ * each object with malloc, this saves the per-allocation overhead of the heap,
+ * keeps the many small objects from fragmenting it, and lets us release all
+ * the objects with one free(3) per chunk.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "alloc.h"
+#include "slab.h"
+
+
+#define	ALIGN	sizeof(void *)
+
+
+void slab_init(struct db_slab *slab, unsigned size, unsigned per_chunk)
+{
+	assert(per_chunk);
+	memset(slab, 0, sizeof(*slab));
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	slab->size = (size + ALIGN - 1) & ~(ALIGN - 1);
+	slab->per_chunk = per_chunk;
+}
+
+
+static void add_chunk(struct db_slab *slab)
+{
+	uint8_t *chunk = alloc_size(ALIGN + slab->per_chunk * slab->size);
+	uint8_t *p = chunk + ALIGN;
+	unsigned i;
+
+	*(void **) chunk = slab->chunks;
+	slab->chunks = chunk;
+	slab->n_chunks++;
+	for (i = 0; i != slab->per_chunk; i++) {
+		*(void **) p = slab->free;
+		slab->free = p;
+		p += slab->size;
+	}
+}
+
+
+void *slab_alloc(struct db_slab *slab)
+{
+	void *p;
+
+	assert(slab->size);
+	if (!slab->free)
+		add_chunk(slab);
+	p = slab->free;
+	slab->free = *(void **) p;
+	slab->used++;
+	return p;
+}
+
+
+void slab_free(struct db_slab *slab, void *p)
+{
+	assert(slab->used);
+	*(void **) p = slab->free;
+	slab->free = p;
+	slab->used--;
+}
+
+
+void slab_free_all(struct db_slab *slab)
+{
+	while (slab->chunks) {
+		void *next = *(void **) slab->chunks;
+
+		free(slab->chunks);
+		slab->chunks = next;
+	}
+	slab->free = NULL;
+	slab->n_chunks = 0;
+	slab->used = 0;
+}
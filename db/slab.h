@@ -0,0 +1,34 @@
+/*
+ * slab.h - Allocation of many small objects of the same size
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file LICENSE.MIT
+ */
+
+#ifndef SLAB_H
+#define	SLAB_H
+
+/*
+ * A slab allocates objects of one size from chunks that hold "per_chunk"
+ * objects each. Freed objects are kept for reuse, and chunks are only returned
+ * to the heap by slab_free_all, which frees all objects of the slab at once.
+ *
+ * slab_alloc does not clear the object.
+ */
+
+struct db_slab {
+	unsigned	size;		/* object size, aligned */
+	unsigned	per_chunk;
+	void		*chunks;	/* list of chunks */
+	void		*free;		/* list of free objects */
+	unsigned	n_chunks;
+	unsigned	used;		/* objects in use */
+};
+
+
+void slab_init(struct db_slab *slab, unsigned size, unsigned per_chunk);
+void *slab_alloc(struct db_slab *slab);
+void slab_free(struct db_slab *slab, void *p);
+void slab_free_all(struct db_slab *slab);
+
+#endif /* !SLAB_H */
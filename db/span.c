@@ -1,128 +1,269 @@
 /*
- * span.c - Lists of spans (consecutive blocks)
+ * span.c - Sets of blocks
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file LICENSE.MIT
  */
 
+/*
+ * A set has one bit per block, plus one bit per erase unit that is set if all
+ * the blocks of the unit are in the set. The set is allocated when the first
+ * block is added, and its size does not change afterwards. For 2048 blocks
+ * and an erase size of 4, this is 320 bytes per set.
+ *
+ * "first" and "first_unit" are the indices of the first word that may contain
+ * a set bit. Searches start there, and move them past the words they found
+ * empty. Since we mostly take the lowest block (or unit), this keeps searching
+ * O(1) amortized. Wear-aware picking still has to look at all the units in
+ * the set, but skips the empty words in front of them.
+ */
+
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
 
 #include "alloc.h"
+#include "storage.h"
 #include "span.h"
 
 
+#define	BITS	32
+
+
 struct db_span {
-	unsigned start;
-	unsigned len;
-	struct db_span *next;
+	unsigned blocks;
+	unsigned erase_size;
+	unsigned first;		/* first word of "map" that may be non-zero */
+	unsigned first_unit;	/* same, for "units" */
+	uint32_t *map;		/* one bit per block */
+	uint32_t *units;	/* one bit per fully included erase unit */
 };
 
 
-void span_add(struct db_span **spans, unsigned n, unsigned size)
+static inline unsigned words(unsigned bits)
+{
+	return (bits + BITS - 1) / BITS;
+}
+
+
+static inline bool test_bit(const uint32_t *map, unsigned n)
+{
+	return (map[n / BITS] >> (n % BITS)) & 1;
+}
+
+
+static inline void set_bit(uint32_t *map, unsigned n)
 {
-	struct db_span *this;
-
-	while (*spans) {
-		this = *spans;
-		if (this->start + this->len == n) {
-			struct db_span *next = this->next;
-
-			this->len += size;
-			if (!next)
-				return;
-			if (next->start != this->start + this->len)
-				return;
-			this->len += next->len;
-			this->next = next->next;
-			free(next);
-			return;
+	map[n / BITS] |= (uint32_t) 1 << (n % BITS);
+}
+
+
+static inline void clear_bit(uint32_t *map, unsigned n)
+{
+	map[n / BITS] &= ~((uint32_t) 1 << (n % BITS));
+}
+
+
+/*
+ * Return the first set bit at or after bit "n", or -1 if there is none. *first
+ * is the first word that may be non-zero. If we search from there, we advance
+ * it to the word where we found the bit.
+ */
+
+static int find_next(const uint32_t *map, unsigned *first, unsigned n,
+    unsigned bits)
+{
+	unsigned i = n / BITS;
+	bool update;
+	uint32_t w;
+
+	if (i < *first) {
+		i = *first;
+		n = i * BITS;
+	}
+	update = i == *first && !(n % BITS);
+	if (n >= bits)
+		return -1;
+	w = map[i] & (~(uint32_t) 0 << (n % BITS));
+	while (!w) {
+		if (++i == words(bits)) {
+			if (update)
+				*first = i;
+			return -1;
 		}
-		if (this->start == n + size) {
-			this->start -= size;
-			this->len += size;
-			break;
+		w = map[i];
+	}
+	if (update)
+		*first = i;
+	n = i * BITS + __builtin_ctz(w);
+	return n < bits ? (int) n : -1;
+}
+
+
+static struct db_span *span_new(void)
+{
+	unsigned blocks = storage_blocks();
+	unsigned erase_size = storage_erase_size();
+	unsigned map_words = words(blocks);
+	unsigned unit_words = words(blocks / erase_size);
+	struct db_span *s;
+
+	s = alloc_size(sizeof(struct db_span) +
+	    (map_words + unit_words) * sizeof(uint32_t));
+	s->blocks = blocks;
+	s->erase_size = erase_size;
+	s->first = map_words;
+	s->first_unit = unit_words;
+	s->map = (uint32_t *) (s + 1);
+	s->units = s->map + map_words;
+	memset(s->map, 0, (map_words + unit_words) * sizeof(uint32_t));
+	return s;
+}
+
+
+void span_add(struct db_span **spans, unsigned n, unsigned size)
+{
+	struct db_span *s = *spans;
+
+	if (!s)
+		s = *spans = span_new();
+	assert(n + size <= s->blocks);
+	while (size--) {
+		unsigned unit = n / s->erase_size;
+		unsigned i;
+
+		set_bit(s->map, n);
+		if (n / BITS < s->first)
+			s->first = n / BITS;
+		n++;
+
+		/* mark the unit if we just completed it */
+		if (unit >= s->blocks / s->erase_size)
+			continue;
+		for (i = 0; i != s->erase_size; i++)
+			if (!test_bit(s->map, unit * s->erase_size + i))
+				break;
+		if (i == s->erase_size) {
+			set_bit(s->units, unit);
+			if (unit / BITS < s->first_unit)
+				s->first_unit = unit / BITS;
 		}
-		spans = &(*spans)->next;
 	}
-	*spans = this = alloc_type(struct db_span);
-	this->start = n;
-	this->len = size;
-	this->next = NULL;
 }
 
 
-int span_pull_one(struct db_span **spans)
+int span_pull_range(struct db_span **spans, unsigned n, unsigned size)
 {
-	struct db_span *this = *spans;
-	unsigned n;
+	struct db_span *s = *spans;
+	int found;
 
-	if (!this)
+	if (!s)
+		return -1;
+	found = find_next(s->map, &s->first, n, s->blocks);
+	if (found < 0 || (unsigned) found >= n + size)
 		return -1;
-	n = this->start;
-	if (--this->len) {
-		this->start++;
-	} else {
-		*spans = this->next;
-		free(this);
+	clear_bit(s->map, found);
+	clear_bit(s->units, found / s->erase_size);
+	return found;
+}
+
+
+void span_remove(struct db_span **spans, unsigned n, unsigned size)
+{
+	struct db_span *s = *spans;
+
+	if (!s)
+		return;
+	assert(n + size <= s->blocks);
+	while (size--) {
+		clear_bit(s->map, n);
+		clear_bit(s->units, n / s->erase_size);
+		n++;
 	}
-	return n;
 }
 
 
-static inline unsigned round_up(unsigned n, unsigned mod)
+unsigned span_count(const struct db_span *spans, unsigned n, unsigned size)
 {
-	n += mod - 1;
-	return n - n % mod;
+	unsigned count = 0;
+
+	if (!spans)
+		return 0;
+	assert(n + size <= spans->blocks);
+	while (size--)
+		count += test_bit(spans->map, n++);
+	return count;
 }
 
 
-int span_pull_erase_block(struct db_span **spans, unsigned erase_size)
+int span_pick_unit(const struct db_span *spans, const uint32_t *counts,
+    bool whole, bool most, int skip)
 {
-	struct db_span *this;
-	unsigned n;
-
-	while (*spans) {
-		this = *spans;
-		n = round_up(this->start, erase_size);
-		if (this->start + this->len >= n + erase_size)
-			break;
-		spans = &(*spans)->next;
-	}
-	if (!*spans)
+	/* the cursors are only hints, so we can cast away "const" */
+	struct db_span *s = (struct db_span *) spans;
+	unsigned units, best_count = 0;
+	int best = -1;
+	int n = 0;
+
+	if (!spans)
 		return -1;
-	n = round_up(this->start, erase_size);
-	if (n == this->start) {
-		if (this->len == erase_size) {
-			*spans = this;
-			free(this);
+	units = spans->blocks / spans->erase_size;
+	while (1) {
+		unsigned unit;
+
+		if (whole) {
+			n = find_next(s->units, &s->first_unit, n, units);
+			if (n < 0)
+				break;
+			unit = n;
 		} else {
-			this->start += erase_size;
-			this->len -= erase_size;
+			n = find_next(s->map, &s->first, n, s->blocks);
+			if (n < 0)
+				break;
+			unit = n / spans->erase_size;
+			/* blocks after the last whole unit */
+			if (unit >= units)
+				break;
 		}
-	} else {
-		if (this->start + this->len == n + erase_size) {
-			this->len -= erase_size;
-		} else {
-			struct db_span *next;
-
-			next = alloc_type(struct db_span);
-			next->start = n + erase_size;
-			next->len = this->start + this->len - n - erase_size;
-			next->next = this->next;
-			this->len = n - this->start;
-			this->next = next;
+		if ((int) (unit * spans->erase_size) != skip && (best < 0 ||
+		    (most ? counts[unit] > best_count :
+		    counts[unit] < best_count))) {
+			best = unit;
+			best_count = counts[unit];
 		}
+		n = whole ? unit + 1 : (unit + 1) * spans->erase_size;
 	}
-	return n;
+	return best < 0 ? -1 : best * (int) spans->erase_size;
 }
 
 
 void span_free_all(struct db_span *spans)
 {
-	while (spans) {
-		struct db_span *next = spans->next;
+	free(spans);
+}
 
-		free(spans);
-		spans = next;
+
+bool span_iterate(const struct db_span *spans,
+    bool (*fn)(void *user, unsigned start, unsigned len), void *user)
+{
+	unsigned n = 0;
+
+	if (!spans)
+		return 1;
+	while (n != spans->blocks) {
+		unsigned start;
+
+		if (!test_bit(spans->map, n)) {
+			n++;
+			continue;
+		}
+		start = n;
+		while (n != spans->blocks && test_bit(spans->map, n))
+			n++;
+		if (!fn(user, start, n - start))
+			return 0;
 	}
+	return 1;
 }
@@ -1,5 +1,5 @@
 /*
- * span.h - Lists of spans (consecutive blocks)
+ * span.h - Sets of blocks
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file LICENSE.MIT
@@ -8,12 +8,43 @@
 #ifndef SPAN_H
 #define	SPAN_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+
 struct db_span;
 
 
+/*
+ * A set is a pointer to struct db_span, which is NULL for the empty set.
+ * span_add allocates the set when needed, span_free_all frees it.
+ *
+ * span_pull_range removes and returns the lowest block of the set in the given
+ * range, or -1 if there is none. span_remove removes all the blocks in the
+ * range, and span_count counts them.
+ *
+ * span_pick_unit looks for the erase unit with the smallest ("most" = 0) or
+ * the largest ("most" = 1) count in counts[unit] that has at least one block
+ * in the set ("whole" = 0), or whose blocks are all in the set ("whole" = 1).
+ * If several units qualify, it picks the lowest one. The unit starting at block
+ * "skip" is ignored (-1 for none). It returns the first block of the unit, or
+ * -1 if there is no such unit.
+ */
+
 void span_add(struct db_span **spans, unsigned n, unsigned size);
-int span_pull_one(struct db_span **spans);
-int span_pull_erase_block(struct db_span **spans, unsigned erase_size);
+int span_pull_range(struct db_span **spans, unsigned n, unsigned size);
+void span_remove(struct db_span **spans, unsigned n, unsigned size);
+unsigned span_count(const struct db_span *spans, unsigned n, unsigned size);
+int span_pick_unit(const struct db_span *spans, const uint32_t *counts,
+    bool whole, bool most, int skip);
 void span_free_all(struct db_span *spans);
 
+/*
+ * span_iterate calls "fn" for each run of consecutive blocks in the set, in
+ * ascending order. If "fn" returns 0, span_iterate stops and returns 0.
+ * Otherwise, it returns 1.
+ */
+bool span_iterate(const struct db_span *spans,
+    bool (*fn)(void *user, unsigned start, unsigned len), void *user);
+
 #endif /* !SPAN_H */
@@ -7,8 +7,8 @@
 
 /*
  * We emulate the behaviour of Flash memory:
- * - Blocks can only erased in groups of ERASE_SIZE blocks, which is more than
- *   one block.
+ * - Blocks can only erased in groups of STORAGE_ERASE_BYTES, which is more
+ *   than one block (except for 4 kB blocks).
  * - Only erasing writes "one" bits.
  * - Writing (without erasing) only writes zero bits.
  */
@@ -22,35 +22,57 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "storage.h"
 
 
-#define	DEFAULT_FILE_BLOCKS	2048
-#define	ERASE_SIZE		4	/* erasing erases four blocks */
+#define	DEFAULT_FILE_SIZE	(2048 * 1024)	/* bytes */
+#define	MAX_IOV			16	/* blocks per preadv(2) */
 
 
 const char *storage_file = DEFAULT_DB_FILE_NAME;
+enum storage_durability storage_durability = sd_write;
+unsigned storage_crash_after = 0;
 
 static int fd = -1;
+static unsigned block_size = STORAGE_BLOCK_SIZE;
+static unsigned erase_size = STORAGE_ERASE_BYTES / STORAGE_BLOCK_SIZE;
+static off_t file_size;
 static unsigned total_blocks;
-static uint32_t tmp[STORAGE_BLOCK_SIZE / 4];
+static uint32_t tmp[STORAGE_BLOCK_MAX / 4];
+
+
+static bool do_write_block(const void *buf, unsigned n);
+static bool do_sync(void);
+
+
+static void sync_at_exit(void)
+{
+	do_sync();
+}
 
 
 static void create_storage(void)
 {
 	fd = open(storage_file, O_RDWR);
 	if (fd < 0) {
+		unsigned i;
+
 		fd = open(storage_file, O_CREAT | O_RDWR, 0666);
 		if (fd < 0) {
 			perror(storage_file);
 			exit(1);
 		}
-		total_blocks = DEFAULT_FILE_BLOCKS;
-		if (!storage_erase_blocks(0, DEFAULT_FILE_BLOCKS))
-			exit(1);
+		file_size = DEFAULT_FILE_SIZE;
+		total_blocks = file_size / block_size;
+		memset(tmp, 0xff, block_size);
+		for (i = 0; i != total_blocks; i++)
+			do_write_block(tmp, i);
+		do_sync();
 	} else {
 		struct stat st;
 
@@ -58,8 +80,10 @@ static void create_storage(void)
 			perror(storage_file);
 			exit(1);
 		}
-		total_blocks = st.st_size / STORAGE_BLOCK_SIZE;
+		file_size = st.st_size;
+		total_blocks = file_size / block_size;
 	}
+	atexit(sync_at_exit);
 }
 
 
@@ -73,31 +97,260 @@ unsigned storage_blocks(void)
 
 unsigned storage_erase_size(void)
 {
-	return ERASE_SIZE;
+	return erase_size;
 }
 
 
-bool storage_read_block(void *buf, unsigned n)
+unsigned storage_block_size(void)
+{
+	return block_size;
+}
+
+
+bool storage_set_block_size(unsigned size)
+{
+	if (size < STORAGE_BLOCK_MIN || size > STORAGE_BLOCK_MAX ||
+	    (size & (size - 1)))
+		return 0;
+	block_size = size;
+	erase_size = STORAGE_ERASE_BYTES / size;
+	if (fd != -1)
+		total_blocks = file_size / size;
+	return 1;
+}
+
+
+const void *storage_map_block(unsigned n)
 {
+	return NULL;
+}
+
+
+bool storage_sync(void)
+{
+	if (fd == -1 || storage_durability != sd_op)
+		return 1;
+	return do_sync();
+}
+
+
+static void do_readv(const struct iovec *iov, unsigned iovcnt, unsigned n)
+{
+	size_t size = 0;
 	ssize_t got;
+	unsigned i;
 
-	if (fd == -1)
-		create_storage();
-	assert(n < total_blocks);
-	got = pread(fd, buf, STORAGE_BLOCK_SIZE,
-	    (off_t) n * STORAGE_BLOCK_SIZE);
+	for (i = 0; i != iovcnt; i++)
+		size += iov[i].iov_len;
+	assert(n + size / block_size <= total_blocks);
+	got = preadv(fd, iov, iovcnt, (off_t) n * block_size);
 	if (got < 0) {
 		perror(storage_file);
 		exit(1);
 	}
-	if (got != STORAGE_BLOCK_SIZE) {
-		fprintf(stderr, "%s: short write\n", storage_file);
+	if ((size_t) got != size) {
+		fprintf(stderr, "%s: short read\n", storage_file);
 		exit(1);
 	}
+}
+
+
+static void do_read_block(void *buf, unsigned n)
+{
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= block_size,
+	};
+
+	do_readv(&iov, 1, n);
+}
+
+
+bool storage_read_block(void *buf, unsigned n)
+{
+	if (fd == -1)
+		create_storage();
+	do_read_block(buf, n);
+	return 1;
+}
+
+
+bool storage_read_blocks(const struct storage_vec *v, unsigned n_vec)
+{
+	struct iovec iov[MAX_IOV];
+	unsigned i = 0;
+
+	if (fd == -1)
+		create_storage();
+	while (i != n_vec) {
+		unsigned n = v[i].n;
+		unsigned j = 0;
+
+		/* gather a run of consecutive blocks */
+		do {
+			iov[j].iov_base = v[i + j].buf;
+			iov[j].iov_len = block_size;
+			j++;
+		} while (i + j != n_vec && j != MAX_IOV &&
+		    v[i + j].n == n + j);
+		do_readv(iov, j, n);
+		i += j;
+	}
+	return 1;
+}
+
+
+/* --- Asynchronous reads -------------------------------------------------- */
+
+
+/*
+ * Reads submitted with storage_read_submit are serviced by a worker thread,
+ * so that they overlap with whatever the caller does in the meantime (e.g.,
+ * decrypting the previous block).
+ *
+ * The queue contains "queue_len" requests, starting at "queue_head". The
+ * worker has taken the first "queue_taken" of them. Since there is only one
+ * worker, requests complete in order.
+ */
+
+struct read_req {
+	void		*buf;
+	unsigned	n;
+	unsigned	n_blocks;
+	bool		done;
+};
+
+static struct read_req queue[STORAGE_READ_QUEUE];
+static unsigned queue_head = 0;
+static unsigned queue_len = 0;
+static unsigned queue_taken = 0;
+static bool have_worker = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void *read_worker(void *user)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (1) {
+		struct read_req *req;
+
+		while (queue_taken == queue_len)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		req = queue + (queue_head + queue_taken) % STORAGE_READ_QUEUE;
+		queue_taken++;
+		pthread_mutex_unlock(&queue_lock);
+
+		struct iovec iov = {
+			.iov_base	= req->buf,
+			.iov_len	= req->n_blocks * block_size,
+		};
+
+		do_readv(&iov, 1, req->n);
+
+		pthread_mutex_lock(&queue_lock);
+		req->done = 1;
+		pthread_cond_broadcast(&queue_cond);
+	}
+	return NULL;
+}
+
+
+bool storage_read_submit(void *buf, unsigned n, unsigned n_blocks)
+{
+	struct read_req *req;
+
+	if (fd == -1)
+		create_storage();
+	assert(n + n_blocks <= total_blocks);
+	if (!have_worker) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, read_worker, NULL)) {
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_detach(thread);
+		have_worker = 1;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	assert(queue_len < STORAGE_READ_QUEUE);
+	req = queue + (queue_head + queue_len) % STORAGE_READ_QUEUE;
+	req->buf = buf;
+	req->n = n;
+	req->n_blocks = n_blocks;
+	req->done = 0;
+	queue_len++;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 1;
+}
+
+
+bool storage_read_wait(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	assert(queue_len);
+	while (!queue[queue_head].done)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	queue_head = (queue_head + 1) % STORAGE_READ_QUEUE;
+	queue_len--;
+	queue_taken--;
+	pthread_mutex_unlock(&queue_lock);
 	return 1;
 }
 
 
+/*
+ * Before writing, let pending reads complete, so that they return what was
+ * stored when they were submitted.
+ */
+
+static void drain_reads(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (queue_len &&
+	    !queue[(queue_head + queue_len - 1) % STORAGE_READ_QUEUE].done)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+
+/* --- Durability and crash simulation ------------------------------------- */
+
+
+static unsigned writes = 0;
+
+
+/* called before each write or erase */
+
+static void crash_point(void)
+{
+	if (storage_crash_after && writes++ == storage_crash_after) {
+		fprintf(stderr, "%s: simulated crash after %u writes\n",
+		    storage_file, storage_crash_after);
+		_exit(2);
+	}
+}
+
+
+/* called after each write or erase */
+
+static bool written(void)
+{
+	return storage_durability != sd_write || do_sync();
+}
+
+
+/* --- Writing and erasing ------------------------------------------------- */
+
+
+/*
+ * Writes are only made durable with do_sync, so that we can batch several
+ * writes with a single fdatasync(2).
+ */
+
 static bool do_write_block(const void *buf, unsigned n)
 {
 	ssize_t wrote;
@@ -105,16 +358,23 @@ static bool do_write_block(const void *buf, unsigned n)
 	if (fd == -1)
 		create_storage();
 	assert(n < total_blocks);
-	wrote = pwrite(fd, tmp, STORAGE_BLOCK_SIZE,
-	    (off_t) n * STORAGE_BLOCK_SIZE);
+	wrote = pwrite(fd, buf, block_size, (off_t) n * block_size);
 	if (wrote < 0) {
 		perror(storage_file);
 		exit(1);
 	}
-	if (wrote != STORAGE_BLOCK_SIZE) {
+	if (wrote != (ssize_t) block_size) {
 		fprintf(stderr, "%s: short write\n", storage_file);
 		exit(1);
 	}
+	return 1;
+}
+
+
+static bool do_sync(void)
+{
+	if (fd == -1)
+		return 1;
 	if (fdatasync(fd) < 0) {
 		perror(storage_file);
 		exit(1);
@@ -123,47 +383,71 @@ static bool do_write_block(const void *buf, unsigned n)
 }
 
 
-bool storage_write_block(const void *buf, unsigned n)
+/* write a block like Flash would, without syncing */
+
+static bool program_block(const void *buf, unsigned n)
 {
-	ssize_t got;
 	uint32_t *p;
 	const uint32_t *q = buf;
 	bool ret;
 
-	if (fd == -1)
-		create_storage();
-	assert(n < total_blocks);
-
 	/* read the old block, so that we can preserve "1" bits */
-	got = pread(fd, tmp, STORAGE_BLOCK_SIZE,
-	    (off_t) n * STORAGE_BLOCK_SIZE);
-	if (got < 0) {
-		perror(storage_file);
-		exit(1);
-	}
-	if (got != STORAGE_BLOCK_SIZE) {
-		fprintf(stderr, "%s: short write\n", storage_file);
-		exit(1);
-	}
+	do_read_block(tmp, n);
 
 	/* writing can only turn "1"" into "0" */
-	for (p = tmp; p != (void *) tmp + sizeof(tmp); p++)
+	for (p = tmp; p != (void *) tmp + block_size; p++)
 		*p &= *q++;
 
 	ret = do_write_block(tmp, n);
 
-	memset(tmp, 0, sizeof(tmp));
+	memset(tmp, 0, block_size);
 	return ret;
 }
 
 
-bool storage_erase_blocks(unsigned n, unsigned n_blocks)
+bool storage_write_block(const void *buf, unsigned n)
 {
-	assert(!(n % ERASE_SIZE));
-	assert(!(n_blocks % ERASE_SIZE));
-	memset(tmp, 0xff, STORAGE_BLOCK_SIZE);
-	while (n_blocks--)
-		if (!do_write_block(tmp, n++))
+	if (fd == -1)
+		create_storage();
+	assert(n < total_blocks);
+	drain_reads();
+	crash_point();
+	return program_block(buf, n) && written();
+}
+
+
+bool storage_write_blocks(const struct storage_vec *v, unsigned n_vec)
+{
+	unsigned i;
+
+	if (fd == -1)
+		create_storage();
+	drain_reads();
+	for (i = 0; i != n_vec; i++) {
+		assert(v[i].n < total_blocks);
+		crash_point();
+		if (!program_block(v[i].buf, v[i].n))
 			return 0;
-	return 1;
+	}
+	return written();
+}
+
+
+bool storage_erase_blocks(unsigned n, unsigned n_blocks)
+{
+	assert(!(n % erase_size));
+	assert(!(n_blocks % erase_size));
+	drain_reads();
+	memset(tmp, 0xff, block_size);
+	while (n_blocks) {
+		unsigned i;
+
+		/* each erase unit is a separate erase operation */
+		crash_point();
+		for (i = 0; i != erase_size; i++)
+			if (!do_write_block(tmp, n++))
+				return 0;
+		n_blocks -= erase_size;
+	}
+	return written();
 }
@@ -0,0 +1,277 @@
+/*
+ * storage-mmap.c - Storage in a memory-mapped file
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file LICENSE.MIT
+ */
+
+/*
+ * Like storage-file.c, but we map the whole file and access it directly. This
+ * avoids a system call per block, and the block layer can decrypt from the
+ * mapping without copying. Unless storage_durability is sd_write, writes only
+ * reach the file when the kernel writes back the pages, or when we sync.
+ *
+ * We emulate the behaviour of Flash memory:
+ * - Blocks can only erased in groups of STORAGE_ERASE_BYTES, which is more
+ *   than one block (except for 4 kB blocks).
+ * - Only erasing writes "one" bits.
+ * - Writing (without erasing) only writes zero bits.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "storage.h"
+
+
+#define	DEFAULT_FILE_SIZE	(2048 * 1024)	/* bytes */
+
+
+const char *storage_file = DEFAULT_DB_FILE_NAME;
+enum storage_durability storage_durability = sd_write;
+unsigned storage_crash_after = 0;
+
+static uint8_t *map = NULL;
+static size_t map_size;
+static unsigned block_size = STORAGE_BLOCK_SIZE;
+static unsigned erase_size = STORAGE_ERASE_BYTES / STORAGE_BLOCK_SIZE;
+static unsigned total_blocks;
+
+
+static void sync_range(unsigned n, unsigned n_blocks)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t from = (size_t) n * block_size;
+	size_t to = from + (size_t) n_blocks * block_size;
+
+	/* msync(2) wants a page-aligned address */
+	from -= from % page;
+	if (msync(map + from, to - from, MS_SYNC) < 0) {
+		perror(storage_file);
+		exit(1);
+	}
+}
+
+
+static void sync_at_exit(void)
+{
+	if (map)
+		sync_range(0, total_blocks);
+}
+
+
+static void map_storage(void)
+{
+	struct stat st;
+	bool new = 0;
+	int fd;
+
+	fd = open(storage_file, O_RDWR);
+	if (fd < 0) {
+		fd = open(storage_file, O_CREAT | O_RDWR, 0666);
+		if (fd < 0) {
+			perror(storage_file);
+			exit(1);
+		}
+		if (ftruncate(fd, DEFAULT_FILE_SIZE) < 0) {
+			perror(storage_file);
+			exit(1);
+		}
+		new = 1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(storage_file);
+		exit(1);
+	}
+	map_size = st.st_size - st.st_size % STORAGE_ERASE_BYTES;
+	total_blocks = map_size / block_size;
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(storage_file);
+		exit(1);
+	}
+	close(fd);
+	if (new)
+		memset(map, 0xff, map_size);
+	atexit(sync_at_exit);
+}
+
+
+static inline uint8_t *block(unsigned n)
+{
+	if (!map)
+		map_storage();
+	assert(n < total_blocks);
+	return map + (size_t) n * block_size;
+}
+
+
+unsigned storage_blocks(void)
+{
+	if (!map)
+		map_storage();
+	return total_blocks;
+}
+
+
+unsigned storage_erase_size(void)
+{
+	return erase_size;
+}
+
+
+unsigned storage_block_size(void)
+{
+	return block_size;
+}
+
+
+bool storage_set_block_size(unsigned size)
+{
+	if (size < STORAGE_BLOCK_MIN || size > STORAGE_BLOCK_MAX ||
+	    (size & (size - 1)))
+		return 0;
+	block_size = size;
+	erase_size = STORAGE_ERASE_BYTES / size;
+	total_blocks = map_size / size;
+	return 1;
+}
+
+
+const void *storage_map_block(unsigned n)
+{
+	return block(n);
+}
+
+
+bool storage_sync(void)
+{
+	if (map && storage_durability == sd_op)
+		sync_range(0, total_blocks);
+	return 1;
+}
+
+
+/* --- Reading ------------------------------------------------------------- */
+
+
+bool storage_read_block(void *buf, unsigned n)
+{
+	memcpy(buf, block(n), block_size);
+	return 1;
+}
+
+
+bool storage_read_blocks(const struct storage_vec *v, unsigned n_vec)
+{
+	while (n_vec--) {
+		storage_read_block(v->buf, v->n);
+		v++;
+	}
+	return 1;
+}
+
+
+/*
+ * Copying from the mapping is fast, so we read already when the request is
+ * submitted. Users that care should use storage_map_block instead.
+ */
+
+static unsigned pending = 0;
+
+
+bool storage_read_submit(void *buf, unsigned n, unsigned n_blocks)
+{
+	assert(pending < STORAGE_READ_QUEUE);
+	assert(n + n_blocks <= storage_blocks());
+	memcpy(buf, block(n), n_blocks * block_size);
+	pending++;
+	return 1;
+}
+
+
+bool storage_read_wait(void)
+{
+	assert(pending);
+	pending--;
+	return 1;
+}
+
+
+/* --- Crash simulation ---------------------------------------------------- */
+
+
+static unsigned writes = 0;
+
+
+/* called before each write or erase */
+
+static void crash_point(void)
+{
+	if (storage_crash_after && writes++ == storage_crash_after) {
+		fprintf(stderr, "%s: simulated crash after %u writes\n",
+		    storage_file, storage_crash_after);
+		_exit(2);
+	}
+}
+
+
+/* --- Writing and erasing ------------------------------------------------- */
+
+
+static void program_block(const void *buf, unsigned n)
+{
+	uint32_t *p = (void *) block(n);
+	const uint32_t *q = buf;
+	unsigned i;
+
+	crash_point();
+	/* writing can only turn "1"" into "0" */
+	for (i = 0; i != block_size / 4; i++)
+		*p++ &= *q++;
+	if (storage_durability == sd_write)
+		sync_range(n, 1);
+}
+
+
+bool storage_write_block(const void *buf, unsigned n)
+{
+	program_block(buf, n);
+	return 1;
+}
+
+
+bool storage_write_blocks(const struct storage_vec *v, unsigned n_vec)
+{
+	while (n_vec--) {
+		program_block(v->buf, v->n);
+		v++;
+	}
+	return 1;
+}
+
+
+bool storage_erase_blocks(unsigned n, unsigned n_blocks)
+{
+	assert(!(n % erase_size));
+	assert(!(n_blocks % erase_size));
+	assert(n + n_blocks <= storage_blocks());
+	while (n_blocks) {
+		crash_point();
+		memset(block(n), 0xff, STORAGE_ERASE_BYTES);
+		if (storage_durability == sd_write)
+			sync_range(n, erase_size);
+		n += erase_size;
+		n_blocks -= erase_size;
+	}
+	return 1;
+}
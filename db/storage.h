@@ -11,15 +11,56 @@
 #include <stdbool.h>
 
 
+/*
+ * The block size is a property of the storage partition, and can be any power
+ * of two from STORAGE_BLOCK_MIN to STORAGE_BLOCK_MAX bytes. STORAGE_BLOCK_SIZE
+ * is the size used for a new partition unless something else is set. An erase
+ * unit is always STORAGE_ERASE_BYTES, and thus contains more blocks if the
+ * blocks are small.
+ *
+ * All block buffers are STORAGE_BLOCK_MAX bytes. On the BL618, with 4 kB
+ * blocks, they would take about 64 kB of RAM instead of 16 kB, so we only allow
+ * blocks of up to 1 kB there.
+ */
+
 #define	STORAGE_BLOCK_SIZE	1024
+#define	STORAGE_BLOCK_MIN	256
+#ifdef TARGET_m0p
+#define	STORAGE_BLOCK_MAX	1024
+#else
+#define	STORAGE_BLOCK_MAX	4096
+#endif
+#define	STORAGE_ERASE_BYTES	4096
 
 
 #ifndef SDK
 
 #define	DEFAULT_DB_FILE_NAME	"dummy.db"
 
+/*
+ * When writes reach the disk:
+ *
+ * sd_write	after each write or erase (default)
+ * sd_op	when storage_sync is called, i.e., at the end of each database
+ *		operation
+ * sd_exit	when the program exits
+ *
+ * If storage_crash_after is not zero, the program terminates instead of
+ * making write or erase number storage_crash_after + 1, as if the device had
+ * lost power. All earlier writes and erases are preserved, since Flash
+ * operations on the device are synchronous.
+ */
+
+enum storage_durability {
+	sd_write,
+	sd_op,
+	sd_exit,
+};
+
 
 extern const char *storage_file;
+extern enum storage_durability storage_durability;
+extern unsigned storage_crash_after;
 
 #endif /* !SDK */
 
@@ -27,8 +68,64 @@ extern const char *storage_file;
 unsigned storage_blocks(void);
 unsigned storage_erase_size(void);
 
+/*
+ * storage_set_block_size changes how the storage is divided into blocks. The
+ * number of blocks and the erase size change accordingly. This must not be
+ * done while the database is open. The size of an existing partition is
+ * recorded in its pad blocks (see secrets.c).
+ */
+
+unsigned storage_block_size(void);
+bool storage_set_block_size(unsigned size);
+
 bool storage_read_block(void *buf, unsigned n);
 bool storage_write_block(const void *buf, unsigned n);
 bool storage_erase_blocks(unsigned n, unsigned n_blocks);
 
+/*
+ * Vectored transfers: storage_read_blocks and storage_write_blocks transfer
+ * each block v[i].n from/to the buffer v[i].buf, with the same semantics as
+ * storage_read_block and storage_write_block. Backends merge consecutive
+ * blocks into larger transfers where they can. (storage_write_blocks does not
+ * change the buffers.) Both functions return 1 if all blocks were transferred
+ * successfully.
+ */
+
+struct storage_vec {
+	void		*buf;
+	unsigned	n;
+};
+
+bool storage_read_blocks(const struct storage_vec *v, unsigned n_vec);
+bool storage_write_blocks(const struct storage_vec *v, unsigned n_vec);
+
+/*
+ * storage_map_block returns a read-only pointer to the content of block "n",
+ * if the backend keeps the storage in memory, or NULL otherwise. The content
+ * changes when the block is written or erased.
+ *
+ * storage_sync returns after all previous writes and erases have reached
+ * persistent storage.
+ */
+
+const void *storage_map_block(unsigned n);
+bool storage_sync(void);
+
+/*
+ * Asynchronous reads: storage_read_submit queues reading the "n_blocks"
+ * blocks starting at block "n" into "buf", and returns 1 if the request was
+ * accepted. storage_read_wait waits until the oldest request has completed,
+ * and returns 1 if the read was successful. Requests complete in the order in
+ * which they were submitted. At most STORAGE_READ_QUEUE requests can be
+ * pending at any time.
+ *
+ * Backends that cannot read in the background may perform the read already in
+ * storage_read_submit.
+ */
+
+#define	STORAGE_READ_QUEUE	4
+
+bool storage_read_submit(void *buf, unsigned n, unsigned n_blocks);
+bool storage_read_wait(void);
+
 #endif /* !STORAGE_H */
@@ -11,10 +11,12 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "hal.h"
+#include "alloc.h"
 #include "rnd.h"
 #include "timer.h"
 #include "sha.h"
@@ -23,6 +25,7 @@
 #include "bip39dec.h"
 #include "block.h"
 #include "secrets.h"
+#include "pin.h"
 #include "dbcrypt.h"
 #include "db.h"
 #include "rmt.h"
@@ -48,20 +51,12 @@ static void indent(unsigned level)
 }
 
 
-static void dump_entry(const struct db *db, const struct db_entry *de,
-    unsigned level, bool pointers)
+static void dump_fields(const struct db_entry *de, unsigned level,
+    bool pointers)
 {
 	const struct db_field *f;
 
-	indent(level);
-	if (pointers)
-		printf("%p ", de);
-	printf("%s@%u:0x%04x ", de->name, de->block, de->seq);
-	printf("%s", de->db == db ? "db" : "DB MISMATCH");
-	if (pointers)
-		printf("%p\n", de->db);
-	else
-		printf("\n");
+	db_entry_load(de);
 	for (f = de->fields; f; f = f->next) {
 		indent(level);
 		printf("    ");
@@ -101,6 +96,9 @@ static void dump_entry(const struct db *db, const struct db_entry *de,
 		case ft_dir:
 			printf("dir");
 			break;
+		case ft_parent:
+			printf("parent");
+			break;
 		default:
 			printf("%u", f->type);
 			break;
@@ -110,7 +108,7 @@ static void dump_entry(const struct db *db, const struct db_entry *de,
 		else
 			printf(" ");
 		printf("%u", f->len);
-		if (f->data) {
+		if (f->len) {
 			const uint8_t *s;
 
 			for (s = f->data; s != f->data + f->len; s++)
@@ -130,6 +128,22 @@ static void dump_entry(const struct db *db, const struct db_entry *de,
 }
 
 
+static void dump_entry(const struct db *db, const struct db_entry *de,
+    unsigned level, bool pointers)
+{
+	indent(level);
+	if (pointers)
+		printf("%p ", de);
+	printf("%s@%u:0x%04x ", de->name, de->block, de->seq);
+	printf("%s", de->db == db ? "db" : "DB MISMATCH");
+	if (pointers)
+		printf("%p\n", de->db);
+	else
+		printf("\n");
+	dump_fields(de, level, pointers);
+}
+
+
 static void dump_dir(const struct db *db, const struct db_entry *dir,
     unsigned level, bool pointers)
 {
@@ -221,10 +235,9 @@ static struct db_entry *find_entry(const char *name)
 {
 	struct db_entry *e;
 
-	for (e = main_db.dir ? main_db.dir->children : main_db.entries; e;
-	    e = e->next)
-		if (!strcmp(e->name, name))
-			return e;
+	e = db_lookup(&main_db, main_db.dir, name, strlen(name));
+	if (e)
+		return e;
 	fprintf(stderr, "entry \"%s\" not found\n", name);
 	exit(1);
 }
@@ -289,10 +302,7 @@ static void dummy_cd(const char *name)
 	if (name) {
 		struct db_entry *e;
 
-		for (e = main_db.dir ? main_db.dir->children : main_db.entries;
-		    e; e = e->next)
-			if (!strcmp(e->name, name))
-				break;
+		e = db_lookup(&main_db, main_db.dir, name, strlen(name));
 		if (e) {
 			db_chdir(&main_db, e);
 		} else {
@@ -503,13 +513,26 @@ static void show_help(void)
 "db move-before [BEFORE]\n\t\tsecond half of \"db move\"\n"
 "db dump\t\tprint the content of the database\n"
 "db sort\t\tsort the database\n"
-"db open\t\topen the database\n"
-"db stats\tshow block statistics\n"
+"db open [PIN]\topen the database. With the PIN, also use the pad, and thus\n"
+"\t\tthe index\n"
+"db stats\tshow block statistics and erase counts\n"
 "db blocks\tdump block types\n"
 "db new NAME\tcreate a new block\n"
 "db delete NAME\tdelete a block\n"
 "db change NAME\tchange a field in a block\n"
 "db remove NAME\tremove a field from a block\n"
+"db comment NAME BYTES\n\t\tset the comment of an entry to BYTES bytes of\n"
+"\t\ttext\n"
+"db reclaim [LOW HIGH]\n\t\trun the background eraser until it is done,\n"
+"\t\toptionally setting the watermarks first\n"
+"db erases\tshow erase and reclaim statistics\n"
+"db cache\tshow hits and misses of the block cache\n"
+"db loaded N\tkeep the fields of at most N entries (0 for no limit)\n"
+"db index\tshow the number of index blocks, 0 if there is no index\n"
+"db index write\twrite the index, as when turning the device off\n"
+"db fields NAME\tshow the fields of an entry\n"
+"db counter NAME VALUE\n\t\tset the HOTP counter of an entry\n"
+"db defer NAME on|off\n\t\tdefer updates of an entry, or write them\n"
 "down X Y\ttouch the touch screen\n"
 "drag X0 Y0 X1 Y1\n"
 "\t\tdrag gesture\n"
@@ -744,6 +767,13 @@ static bool process_cmd(const char *cmd)
 			db_tsort(&main_db);
 			return 1;
 		}
+		if (!strcmp(op, "check") && args == 1) {
+			if (!db_check(&main_db)) {
+				fprintf(stderr, "database is inconsistent\n");
+				exit(1);
+			}
+			return 1;
+		}
 		if (!strcmp(op, "dump") && args == 1) {
 			dump_db_short(&main_db);
 			return 1;
@@ -836,7 +866,15 @@ static bool process_cmd(const char *cmd)
 		if (!strcmp(op, "open")) {
 			struct dbcrypt *c;
 
+			if (args > 2)
+				goto fail;
 			secrets_init();
+			/* with the pad, we can also use the index */
+			if (args == 2 &&
+			    !secrets_setup_master(pin_encode(name))) {
+				fprintf(stderr, "no pad for PIN %s\n", name);
+				exit(1);
+			}
 			c  = dbcrypt_init(master_secret, sizeof(master_secret));
 			if (!c) {
 				fprintf(stderr, "dbcrypt_init failed\n");
@@ -846,12 +884,87 @@ static bool process_cmd(const char *cmd)
 			return 1;
 		}
 		if (!strcmp(op, "stats")) {
+			struct db_stats st;
+			unsigned mean;
+
+			db_stats(&main_db, &st);
 			printf("total %u invalid %u data %u\n",
-			    main_db.stats.total, main_db.stats.invalid,
-			    main_db.stats.data);
+			    st.total, st.invalid, st.data);
 			printf("erased %u deleted %u empty %u\n",
-			    main_db.stats.erased, main_db.stats.deleted,
-			    main_db.stats.empty);
+			    st.erased, st.deleted, st.empty);
+			mean = st.wear_units ?
+			    st.wear_sum * 10 / st.wear_units : 0;
+			printf("wear min %u max %u mean %u.%u\n",
+			    st.wear_min, st.wear_max, mean / 10, mean % 10);
+			return 1;
+		}
+		if (!strcmp(op, "reclaim")) {
+			unsigned low, high;
+
+			switch (sscanf(arg, "reclaim %u %u", &low, &high)) {
+			case 2:
+				main_db.erased_low = low;
+				main_db.erased_high = high;
+				break;
+			case EOF:
+			case 0:
+				if (args == 1)
+					break;
+				/* fall through */
+			default:
+				goto fail;
+			}
+			while (db_reclaim(&main_db));
+			return 1;
+		}
+		if (!strcmp(op, "erases") && args == 1) {
+			struct db_stats st;
+			unsigned erases, live;
+
+			db_stats(&main_db, &st);
+			erases = st.fg_erases + st.bg_erases;
+			live = erases ? st.relocated * 10 / erases : 0;
+			printf("foreground %u background %u\n",
+			    st.fg_erases, st.bg_erases);
+			printf("relocated %u live/unit %u.%u mixed %u\n",
+			    st.relocated, live / 10, live % 10, st.mixed);
+			printf("appended %u patched %u folded %u\n",
+			    st.appended, st.patched, st.folded);
+			return 1;
+		}
+		if (!strcmp(op, "index")) {
+			switch (args) {
+			case 1:
+				printf("index %u\n", main_db.index_parts);
+				return 1;
+			case 2:
+				if (strcmp(name, "write"))
+					goto fail;
+				if (!db_write_index(&main_db))
+					printf("failed\n");
+				return 1;
+			default:
+				goto fail;
+			}
+		}
+		if (!strcmp(op, "fields") && args == 2) {
+			dump_fields(find_entry(name), 0, 0);
+			return 1;
+		}
+		if (!strcmp(op, "cache") && args == 1) {
+			struct db_stats st;
+
+			db_stats(&main_db, &st);
+			printf("cache hits %u misses %u\n",
+			    st.cache_hits, st.cache_misses);
+			return 1;
+		}
+		if (!strcmp(op, "loaded") && args == 2) {
+			unsigned max;
+
+			if (sscanf(name, "%u", &max) != 1)
+				goto fail;
+			main_db.max_loaded = max;
 			return 1;
 		}
 		if (!strcmp(arg, "blocks")) {
@@ -914,6 +1027,55 @@ static bool process_cmd(const char *cmd)
 				printf("failed\n");
 			return 1;
 		}
+		arg2 = cmd_arg("comment", arg);
+		if (arg2) {
+			struct db_entry *de;
+			unsigned len, i;
+			char *tmp;
+
+			if (sscanf(arg2, "%s %u", name, &len) != 2 || !len)
+				goto fail;
+			de = find_entry(name);
+			tmp = alloc_size(len);
+			for (i = 0; i != len; i++)
+				tmp[i] = 'a' + i % 26;
+			if (db_change_field(de, ft_comment, tmp, len))
+				printf("%u\n", de->block);
+			else
+				printf("failed\n");
+			free(tmp);
+			return 1;
+		}
+		arg2 = cmd_arg("counter", arg);
+		if (arg2) {
+			struct db_entry *de;
+			uint64_t counter;
+
+			if (sscanf(arg2, "%s %" SCNu64, name, &counter) != 2)
+				goto fail;
+			de = find_entry(name);
+			if (db_change_field(de, ft_hotp_counter, &counter,
+			    sizeof(counter)))
+				printf("%u\n", de->block);
+			else
+				printf("failed\n");
+			return 1;
+		}
+		arg2 = cmd_arg("defer", arg);
+		if (arg2) {
+			struct db_entry *de;
+			char on[4];
+
+			if (sscanf(arg2, "%s %3s", name, on) != 2 ||
+			    (strcmp(on, "on") && strcmp(on, "off")))
+				goto fail;
+			de = find_entry(name);
+			if (db_entry_defer_update(de, !strcmp(on, "on")))
+				printf("%u\n", de->block);
+			else
+				printf("failed\n");
+			return 1;
+		}
 		arg2 = cmd_arg("remove", arg);
 		if (arg2) {
 			struct db_entry *de = find_entry(arg2);
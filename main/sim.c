@@ -356,6 +356,9 @@ static void usage(const char *name)
 "\n"
 "-2  double the pixel size\n"
 "-4  cuadruple the pixel size and leave a gap between pixels\n"
+"-b bytes\n"
+"    block size for new databases, a power of two from %u to %u\n"
+"    (default: %u). Existing databases use the size they were created with.\n"
 "-C  receive user interaction from a script\n"
 "-D  set the global debugging flag (use changes during development)\n"
 "-d database\n"
@@ -367,16 +370,24 @@ static void usage(const char *name)
 "    set the screenshot file name. if present, %%u is converted to the\n"
 "    screenshot number (starts at 0). The usual printf conversion\n"
 "    specifications can be used. (default: %s)\n"
-    , name, "", name, DEFAULT_DB_FILE_NAME, DEFAULT_SCREENSHOT_NAME);
+"-S write|op|exit\n"
+"    make writes durable after each write (default), after each database\n"
+"    operation, or only at exit\n"
+"-X writes\n"
+"    simulate a crash (terminate) after the specified number of Flash\n"
+"    writes and erases\n"
+    , name, "", name, STORAGE_BLOCK_MIN, STORAGE_BLOCK_MAX,
+    STORAGE_BLOCK_SIZE, DEFAULT_DB_FILE_NAME, DEFAULT_SCREENSHOT_NAME);
 	exit(1);
 }
 
 
 int main(int argc, char **argv)
 {
+	char *end;
 	int c, i;
 
-	while ((c = getopt(argc, argv, "+24CDd:qR:s:")) != EOF)
+	while ((c = getopt(argc, argv, "+24b:CDd:qR:s:S:X:")) != EOF)
 		switch (c) {
 		case '2':
 			zoom = 2;
@@ -384,6 +395,11 @@ int main(int argc, char **argv)
 		case '4':
 			zoom = 4;
 			break;
+		case 'b':
+			if (!storage_set_block_size(strtoul(optarg, &end, 0)) ||
+			    *end)
+				usage(*argv);
+			break;
 		case 'C':
 			scripting = 1;
 			break;
@@ -403,6 +419,21 @@ int main(int argc, char **argv)
 		case 's':
 			screenshot_name = optarg;
 			break;
+		case 'S':
+			if (!strcmp(optarg, "write"))
+				storage_durability = sd_write;
+			else if (!strcmp(optarg, "op"))
+				storage_durability = sd_op;
+			else if (!strcmp(optarg, "exit"))
+				storage_durability = sd_exit;
+			else
+				usage(*argv);
+			break;
+		case 'X':
+			storage_crash_after = strtoul(optarg, &end, 0);
+			if (*end || !storage_crash_after)
+				usage(*argv);
+			break;
 		default:
 			usage(*argv);
 		}
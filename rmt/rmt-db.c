@@ -42,9 +42,28 @@ static PSRAM_NOINIT uint8_t buf[MAX_REQ_LEN];
 static uint64_t generation;
 static const struct db_entry *de;
 static const struct db_field *f;
+static unsigned shown;	/* fields already sent by RDOP_SHOW */
 static volatile bool async_reset = 0;
 
 
+/*
+ * Other entries may be loaded between polls, and this can drop the fields of
+ * "de" (see db_entry_load). We therefore find our place again each time.
+ */
+
+static const struct db_field *show_next(void)
+{
+	const struct db_field *next;
+	unsigned i = 0;
+
+	if (!db_entry_load(de))
+		return NULL;
+	for (next = de->fields; next && i != shown; next = next->next)
+		i++;
+	return next;
+}
+
+
 static bool rmt_db_reset(void)
 {
 	debug("rmt_db_reset: from state %u (%s)\n",
@@ -88,27 +107,23 @@ void rmt_db_poll(void)
 			break;
 		case RDOP_SHOW:
 			f = NULL;
-			for (de = main_db.entries; de; de = de->next)
-				if (strlen(de->name) == (size_t) got - 1 &&
-				    !strncmp(de->name, (const char *) buf + 1,
-				    got - 1))
-					break;
+			de = db_lookup(&main_db, NULL, (const char *) buf + 1,
+			    got - 1);
 			if (!de) {
 				op = RDOP_NOT_FOUND;
 				break;
 			}
+			db_entry_load(de);
 			f = de->fields;
+			shown = 0;
 			break;
 		case RDOP_REVEAL:
 			if (got < 2) {
 				op = RDOP_INVALID;
 				return;
 			}
-			for (de = main_db.entries; de; de = de->next)
-				if (strlen(de->name) == (size_t) got - 2 &&
-				    !strncmp(de->name, (const char *) buf + 1,
-				    got - 2))
-					break;
+			de = db_lookup(&main_db, NULL, (const char *) buf + 1,
+			    got - 2);
 			if (!de) {
 				op = RDOP_NOT_FOUND;
 				break;
@@ -116,6 +131,7 @@ void rmt_db_poll(void)
 
 			uint8_t type = buf[got - 1];
 
+			db_entry_load(de);
 			for (f = de->fields; f; f = f->next)
 				if (f->type == type)
 					break;
@@ -217,13 +233,16 @@ void rmt_db_poll(void)
 				    "\000DB changed", 10))
 					return;
 				state = RDS_END;
+				break;
 			}
+			f = show_next();
 			while (f) {
 				switch (f->type) {
 				case ft_end:
 				case ft_id:
 				case ft_prev:
 				case ft_dir:	// @@@ decide handling later
+				case ft_parent:
 					break;
 				case ft_user:
 				case ft_email:
@@ -245,6 +264,7 @@ void rmt_db_poll(void)
 					ABORT();
 				}
 				f = f->next;
+				shown++;
 			}
 			if (!f)
 				state = RDS_END;
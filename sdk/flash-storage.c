@@ -5,6 +5,7 @@
  * A copy of the license can be found in the file LICENSE.MIT
  */
 
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
@@ -22,53 +23,182 @@
 
 /*
  * @@@ the W25Q128JVEJQ Flash in M1s has 4 kB sectors, so each "block" erase
- * erases four blocks. The Flash memories we consider for the real device also
- * have a minimum erase size of 4 kB.
+ * erases several blocks (unless the blocks are 4 kB, too). The Flash memories
+ * we consider for the real device also have a minimum erase size of 4 kB.
  */
-#define	ERASE_SIZE		4
+
+static unsigned block_size = STORAGE_BLOCK_SIZE;
 
 
 unsigned storage_blocks(void)
 {
-	return FLASH_STORAGE_SIZE / STORAGE_BLOCK_SIZE;
+	return FLASH_STORAGE_SIZE / block_size;
 }
 
 
 unsigned storage_erase_size(void)
 {
-	return ERASE_SIZE;
+	return STORAGE_ERASE_BYTES / block_size;
 }
 
 
-bool storage_read_block(void *buf, unsigned n)
+unsigned storage_block_size(void)
+{
+	return block_size;
+}
+
+
+bool storage_set_block_size(unsigned size)
+{
+	if (size < STORAGE_BLOCK_MIN || size > STORAGE_BLOCK_MAX ||
+	    (size & (size - 1)))
+		return 0;
+	block_size = size;
+	return 1;
+}
+
+
+/*
+ * @@@ We could read through the memory-mapped Flash window, but would then
+ * have to invalidate the cache after each write or erase.
+ */
+
+const void *storage_map_block(unsigned n)
+{
+	return NULL;
+}
+
+
+bool storage_sync(void)
 {
-	uint32_t addr = FLASH_STORAGE_BASE + n * STORAGE_BLOCK_SIZE;
+	/* bflb_flash_write and bflb_flash_erase return when done */
+	return 1;
+}
+
+
+static bool read_blocks(void *buf, unsigned n, unsigned n_blocks)
+{
+	uint32_t addr = FLASH_STORAGE_BASE + n * block_size;
 	int ret;
 
-	assert(n < FLASH_STORAGE_SIZE / STORAGE_BLOCK_SIZE);
-	ret = bflb_flash_read(addr, buf, STORAGE_BLOCK_SIZE);
+	assert(n + n_blocks <= storage_blocks());
+	ret = bflb_flash_read(addr, buf, n_blocks * block_size);
 //debug("read (%d 0x%08lx) %d\n", n, (unsigned long) addr, ret);
 	return !ret;
 }
 
 
-bool storage_write_block(const void *buf, unsigned n)
+static bool write_blocks(const void *buf, unsigned n, unsigned n_blocks)
 {
-	uint32_t addr = FLASH_STORAGE_BASE + n * STORAGE_BLOCK_SIZE;
+	uint32_t addr = FLASH_STORAGE_BASE + n * block_size;
 
 /* @@@ we probably need to disable interrupts while erasing / writing Flash */
-	assert(n < FLASH_STORAGE_SIZE / STORAGE_BLOCK_SIZE);
-	return !bflb_flash_write(addr, (void *) buf, STORAGE_BLOCK_SIZE);
+	assert(n + n_blocks <= storage_blocks());
+	return !bflb_flash_write(addr, (void *) buf, n_blocks * block_size);
+}
+
+
+bool storage_read_block(void *buf, unsigned n)
+{
+	return read_blocks(buf, n, 1);
+}
+
+
+bool storage_write_block(const void *buf, unsigned n)
+{
+	return write_blocks(buf, n, 1);
+}
+
+
+/*
+ * run_length returns the number of vector elements, starting at v, that access
+ * consecutive blocks and consecutive memory, and can thus be transferred with
+ * a single Flash command.
+ */
+
+static unsigned run_length(const struct storage_vec *v, unsigned n_vec)
+{
+	unsigned i;
+
+	for (i = 1; i != n_vec; i++)
+		if (v[i].n != v->n + i ||
+		    v[i].buf != v->buf + i * block_size)
+			break;
+	return i;
+}
+
+
+bool storage_read_blocks(const struct storage_vec *v, unsigned n_vec)
+{
+	bool ok = 1;
+
+	while (n_vec) {
+		unsigned n = run_length(v, n_vec);
+
+		if (!read_blocks(v->buf, v->n, n))
+			ok = 0;
+		v += n;
+		n_vec -= n;
+	}
+	return ok;
+}
+
+
+bool storage_write_blocks(const struct storage_vec *v, unsigned n_vec)
+{
+	bool ok = 1;
+
+	while (n_vec) {
+		unsigned n = run_length(v, n_vec);
+
+		if (!write_blocks(v->buf, v->n, n))
+			ok = 0;
+		v += n;
+		n_vec -= n;
+	}
+	return ok;
 }
 
 
 bool storage_erase_blocks(unsigned n, unsigned n_blocks)
 {
-	uint32_t addr = FLASH_STORAGE_BASE + n * STORAGE_BLOCK_SIZE;
+	uint32_t addr = FLASH_STORAGE_BASE + n * block_size;
+
+	assert(n < storage_blocks());
+	assert(!(n % storage_erase_size()));
+	assert(!(n_blocks % storage_erase_size()));
+	return !bflb_flash_erase(addr, n_blocks * block_size);
+}
+
+
+
+/*
+ * bflb_flash_read blocks until the data has been read, so we read already
+ * when the request is submitted, and just remember the result.
+ */
+
+static bool read_ok[STORAGE_READ_QUEUE];
+static unsigned read_head = 0;
+static unsigned read_len = 0;
 
-	assert(n < FLASH_STORAGE_SIZE / STORAGE_BLOCK_SIZE);
-	assert(!(n % ERASE_SIZE));
-	assert(!(n_blocks % ERASE_SIZE));
-	return !bflb_flash_erase(addr, n_blocks * STORAGE_BLOCK_SIZE);
+
+bool storage_read_submit(void *buf, unsigned n, unsigned n_blocks)
+{
+	assert(read_len < STORAGE_READ_QUEUE);
+	read_ok[(read_head + read_len) % STORAGE_READ_QUEUE] =
+	    read_blocks(buf, n, n_blocks);
+	read_len++;
+	return 1;
 }
 
+
+bool storage_read_wait(void)
+{
+	bool ok;
+
+	assert(read_len);
+	ok = read_ok[read_head];
+	read_head = (read_head + 1) % STORAGE_READ_QUEUE;
+	read_len--;
+	return ok;
+}
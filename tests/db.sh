@@ -13,11 +13,16 @@ PK=AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA====
 run()
 {
 	local debug=
+	local fail=false
 
 	if [ "$1" = -D ]; then
 		debug=-D
 		shift
 	fi
+	if [ "$1" = -f ]; then
+		fail=true
+		shift
+	fi
 
 	local title=$1
 	local s="../sim $debug -q -d "$dir/_db" -C"
@@ -28,6 +33,8 @@ run()
 	for n in "$@"; do
 		s="$s '$n'"
 	done
+	# -f: the simulator has to fail
+	$fail && s="! $s 2>/dev/null"
 	if ! eval $s 2>&1 >_out; then
 		echo "FAILED" 1>&2
 		exit 1
@@ -46,7 +53,7 @@ run()
 
 json()
 {
-	"$top/tools/accenc.py" /dev/stdin $PK >"$dir/_db" || exit
+	"$top/tools/accenc.py" "$@" /dev/stdin $PK >"$dir/_db" || exit
 }
 
 
@@ -85,6 +92,7 @@ done
 empty erased "db open" "db stats" "db blocks" <<EOF
 total 2048 invalid 0 data 0
 erased 2039 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
 D8
 EOF
 
@@ -94,6 +102,7 @@ empty new "db open" "db new blah" "db stats" "db blocks" <<EOF
 9
 total 2048 invalid 0 data 1
 erased 2038 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
 D8 D9
 EOF
 
@@ -104,6 +113,7 @@ empty new-delete "db open" "db new blah" "db delete blah" "db stats" \
 9
 total 2048 invalid 0 data 0
 erased 2038 deleted 1 empty 0
+wear min 0 max 0 mean 0.0
 D8 X9
 EOF
 
@@ -115,6 +125,7 @@ empty new-change "db open" "db new blah" "db change blah" "db stats" \
 10
 total 2048 invalid 0 data 1
 erased 2037 deleted 1 empty 0
+wear min 0 max 0 mean 0.0
 D8 X9 D10
 EOF
 
@@ -127,6 +138,7 @@ EOF
 run existing "db open" "db stats" "db blocks" <<EOF
 total 2048 invalid 0 data 1
 erased 2038 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
 D8 D9
 EOF
 
@@ -139,6 +151,7 @@ EOF
 run existing-delete "db open" "db delete id" "db stats" "db blocks" <<EOF
 total 2048 invalid 0 data 0
 erased 2038 deleted 1 empty 0
+wear min 0 max 0 mean 0.0
 D8 X9
 EOF
 
@@ -149,10 +162,11 @@ json <<EOF
 EOF
 
 run existing-change "db open" "db change id" "db stats" "db blocks" <<EOF
-10
+9
 total 2048 invalid 0 data 1
-erased 2037 deleted 1 empty 0
-D8 X9 D10
+erased 2037 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
+D8 D9 D10
 EOF
 
 # --- Remove field from existing entry ----------------------------------------
@@ -162,10 +176,63 @@ json <<EOF
 EOF
 
 run existing-remove "db open" "db remove id" "db stats" "db blocks" <<EOF
-10
+9
 total 2048 invalid 0 data 1
-erased 2037 deleted 1 empty 0
-D8 X9 D10
+erased 2037 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
+D8 D9 D10
+EOF
+
+# --- Long field: entry spanning two blocks -----------------------------------
+
+empty chain "db open" "db new blah" "db comment blah 900" "db stats" \
+    "db blocks" <<EOF
+9
+10
+total 2048 invalid 0 data 2
+erased 2036 deleted 1 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 D10 D11
+EOF
+
+# --- Long field: only rewrite the block that changes -------------------------
+
+empty chain-part "db open" "db new blah" "db comment blah 900" \
+    "db comment blah 910" "db stats" "db blocks" <<EOF
+9
+10
+10
+total 2048 invalid 0 data 2
+erased 2035 deleted 2 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 D10 X11 D12
+EOF
+
+# --- Long field: find all blocks when scanning -------------------------------
+
+run chain-scan "db open" "db stats" "db blocks" <<EOF
+total 2048 invalid 0 data 2
+erased 2035 deleted 2 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 D10 X11 D12
+EOF
+
+# --- Long field: report a missing part ---------------------------------------
+
+dd if=/dev/zero of="$dir/_db" bs=1024 seek=12 count=1 conv=notrunc \
+    2>/dev/null
+
+run chain-lost "db open" "db blocks" "db fields blah" <<EOF
+D8 X9 D10 X11 X12
+    id 4 "blah"
+EOF
+
+run -f chain-lost-check "db open" "db check" </dev/null
+
+# --- Long field: an entry with a missing part can still be deleted -----------
+
+run chain-lost-delete "db open" "db delete blah" "db check" "db blocks" <<EOF
+D8 X9 X10 X11 X12
 EOF
 
 # --- Replace obsolete entry, base --------------------------------------------
@@ -201,6 +268,22 @@ b -
 a b
 EOF
 
+# --- Move entry: write each changed entry once ------------------------------
+
+json <<EOF
+[ { "id":"a" }, { "id":"b" }, { "id":"c" } ]
+EOF
+
+run move "db open" "db move c a" "db dump" "db stats" "db blocks" <<EOF
+c -
+a c
+b c
+total 2048 invalid 0 data 2
+erased 2034 deleted 3 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 X10 D11 X12 D13
+EOF
+
 # --- Directory: one entry ----------------------------------------------------
 
 json <<EOF
@@ -240,6 +323,21 @@ c -
 	d -
 EOF
 
+# --- Directory: entries referring to the directory by uid --------------------
+
+json <<EOF
+[ { "id":"a" }, { "id":"x", "parent":7 }, { "id":"b", "dir":7 },
+  { "id":["b", "y"] }, { "id":"z", "parent":8 } ]
+EOF
+
+run dir-uid "db open" "db dump" <<EOF
+a -
+b -
+	x -
+	y -
+z -
+EOF
+
 # --- Directory: two directories, add to 1st ----------------------------------
 
 json <<EOF
@@ -288,3 +386,282 @@ c -
 	a -
 	d -
 EOF
+
+# --- Index: written when opening, then used to open --------------------------
+
+json <<EOF
+[ { "id":"a", "user":"u" }, { "id":"b" } ]
+EOF
+
+run index-write "db open 1234" "db index" "db stats" "db blocks" <<EOF
+index 1
+total 2048 invalid 0 data 2
+erased 2036 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
+D8 D9 D10 D11
+EOF
+
+# opening from the index writes nothing, so we see the same blocks
+
+run index-reopen "db open 1234" "db index" "db stats" "db blocks" "db dump" \
+    "db fields a" <<EOF
+index 1
+total 2048 invalid 0 data 2
+erased 2036 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
+D8 D9 D10 D11
+a -
+b -
+    id 1 "a"
+    user 1 "u"
+EOF
+
+# --- Index: start a new hint log when the old one is full --------------------
+
+json <<EOF
+[ { "id":"a" }, { "id":"b" } ]
+EOF
+
+# each index we write uses one of the 1536 hints
+
+set -- "db open 1234"
+i=0
+while [ $i -lt 800 ]; do
+	set -- "$@" "db move a" "db index write" "db move b" "db index write"
+	i=`expr $i + 1`
+done
+
+run index-hints "$@" "db index" "db stats" <<EOF
+index 1
+total 2048 invalid 0 data 1
+erased 3 deleted 2033 empty 0
+wear min 0 max 1 mean 0.7
+EOF
+
+run index-hints-reopen "db open 1234" "db index" "db stats" "db dump" <<EOF
+index 1
+total 2048 invalid 0 data 1
+erased 3 deleted 2033 empty 0
+wear min 0 max 1 mean 0.7
+a -
+b a
+EOF
+
+# --- HOTP counter: appends keep the index valid ------------------------------
+
+empty counter-append "db open 1234" "db new x" "db counter x 1" \
+    "db index write" "db counter x 2" "db counter x 3" "db erases" "db index" \
+    "db blocks" <<EOF
+12
+10
+10
+10
+foreground 0 background 0
+relocated 0 live/unit 0.0 mixed 1
+appended 2 patched 0 folded 0
+index 1
+D8 X9 D10 D11 X12
+EOF
+
+run counter-index "db open 1234" "db index" "db fields x" "db blocks" <<EOF
+index 1
+    id 1 "x"
+    hotp_counter 8 03 00 00 00 00 00 00 00
+D8 X9 D10 D11 X12
+EOF
+
+# --- HOTP counter: find the last value when scanning -------------------------
+
+run counter-scan "db open" "db fields x" "db blocks" <<EOF
+    id 1 "x"
+    hotp_counter 8 03 00 00 00 00 00 00 00
+D8 X9 D10 X11 X12
+EOF
+
+# --- Block cache: reload an entry we wrote without decrypting it -------------
+
+json <<EOF
+[ { "id":"a" }, { "id":"b" } ]
+EOF
+
+run cache-reload "db open" "db loaded 1" "db new c" "db counter c 1" \
+    "db fields a" "db fields c" "db cache" <<EOF
+11
+12
+    id 1 "a"
+    id 1 "c"
+    hotp_counter 8 01 00 00 00 00 00 00 00
+cache hits 1 misses 1
+EOF
+
+# --- Block cache: appending to the log makes us decrypt the block again ------
+
+run cache-append "db open" "db loaded 1" "db fields c" "db fields a" \
+    "db fields c" "db counter c 2" "db fields a" "db fields c" "db cache" <<EOF
+    id 1 "c"
+    hotp_counter 8 01 00 00 00 00 00 00 00
+    id 1 "a"
+    id 1 "c"
+    hotp_counter 8 01 00 00 00 00 00 00 00
+12
+    id 1 "a"
+    id 1 "c"
+    hotp_counter 8 02 00 00 00 00 00 00 00
+cache hits 2 misses 3
+EOF
+
+# --- Pack: small entries share a block ---------------------------------------
+
+empty pack-new "db open" "db new a" "db new b" "db new c" "db new d" \
+    "db stats" "db blocks" <<EOF
+9
+10
+11
+12
+total 2048 invalid 0 data 1
+erased 2035 deleted 3 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 X10 X11 D12
+EOF
+
+# --- Pack: deleting a member rewrites the pack -------------------------------
+
+run pack-delete "db open" "db delete b" "db dump" "db stats" "db blocks" <<EOF
+a -
+c -
+d -
+total 2048 invalid 0 data 1
+erased 2034 deleted 4 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 X10 X11 X12 D13
+EOF
+
+# --- Pack: a member that grows too large leaves the pack ---------------------
+
+run pack-grow "db open" "db comment c 130" "db stats" "db blocks" <<EOF
+14
+total 2048 invalid 0 data 2
+erased 2032 deleted 5 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 X10 X11 X12 X13 D14 D15
+EOF
+
+# --- Pack: find the members and the entry that left when scanning ------------
+
+run pack-scan "db open" "db dump" "db fields a" "db fields c" "db fields d" \
+    "db stats" "db blocks" <<EOF
+a -
+c -
+d -
+    id 1 "a"
+    id 1 "c"
+    Comment 130 "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz"
+    id 1 "d"
+total 2048 invalid 0 data 2
+erased 2032 deleted 5 empty 0
+wear min 0 max 0 mean 0.0
+D8 X9 X10 X11 X12 X13 D14 D15
+EOF
+
+# --- Pack: don't compact a pack with a deferred member -----------------------
+
+# "db remove" records the change in a patch block (16). Moving the pack would
+# have to write the deferred change, so reclaim must leave unit 12-15 alone.
+# Once the update is written, the pack moves, and the unit is erased.
+
+empty pack-defer "db open" "db new a" "db new b" "db new c" "db new d" \
+    "db change a" "db remove a" "db defer a on" "db reclaim 2040 2047" \
+    "db reclaim" "db blocks" "db defer a off" "db reclaim" "db stats" \
+    "db blocks" "db erases" <<EOF
+9
+10
+11
+12
+13
+13
+13
+D8 X9 X10 X11 X12 D13 D16
+14
+total 2048 invalid 0 data 1
+erased 2034 deleted 3 empty 0
+wear min 0 max 1 mean 0.0
+D8 X9 X10 X11 D16 D20
+foreground 0 background 1
+relocated 1 live/unit 1.0 mixed 1
+appended 0 patched 1 folded 0
+EOF
+
+run pack-defer-scan "db open" "db dump" "db fields a" "db blocks" <<EOF
+a -
+b -
+c -
+d -
+    id 1 "a"
+D8 X9 X10 X11 D16 D20
+EOF
+
+# --- Block size: 256-byte blocks need several blocks for the erase counts ----
+
+json -b 256 <<EOF
+[ { "id":"a" }, { "id":"b" } ]
+EOF
+
+set -- "db open 1234"
+i=0
+while [ $i -lt 1250 ]; do
+	set -- "$@" "db move a" "db move b"
+	i=`expr $i + 1`
+done
+
+run small-wear "$@" "db reclaim 8150 8170" "db index write" "db stats" \
+    "db erases" <<EOF
+total 8192 invalid 0 data 1
+erased 8120 deleted 32 empty 0
+wear min 0 max 1 mean 0.3
+foreground 0 background 158
+relocated 1 live/unit 0.0 mixed 2
+appended 0 patched 0 folded 0
+EOF
+
+run small-wear-index "db open 1234" "db index" "db stats" <<EOF
+index 1
+total 8192 invalid 0 data 1
+erased 8120 deleted 32 empty 0
+wear min 0 max 1 mean 0.3
+EOF
+
+# scanning deletes the index, since there is no hint without the PIN
+
+run small-wear-scan "db open" "db index" "db stats" "db dump" <<EOF
+index 0
+total 8192 invalid 0 data 1
+erased 8120 deleted 33 empty 0
+wear min 0 max 1 mean 0.3
+a -
+b a
+EOF
+
+# --- Block size: 4 kB blocks keep the index hints in a unit of their own -----
+
+json -b 4096 <<EOF
+[ { "id":"a", "user":"u" }, { "id":"b" } ]
+EOF
+
+run large-index "db open 1234" "db index" "db stats" "db blocks" <<EOF
+index 1
+total 512 invalid 0 data 2
+erased 505 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
+D3 D4 D5 D6
+EOF
+
+run large-index-reopen "db open 1234" "db index" "db stats" "db blocks" \
+    "db fields a" <<EOF
+index 1
+total 512 invalid 0 data 2
+erased 505 deleted 0 empty 0
+wear min 0 max 0 mean 0.0
+D3 D4 D5 D6
+    id 1 "a"
+    user 1 "u"
+EOF
@@ -43,11 +43,11 @@ run()
 		s="$s 'db $n'"
 	done
 	if $gdb; then
-		eval gdb --args $s "'db sort' 'db dump'" </dev/tty
+		eval gdb --args $s "'db sort' 'db check' 'db dump'" </dev/tty
 		exit
 	fi
 	# @@@ should also fail if fail=true but the command had exit status 0.
-	if ! eval $s "'db sort' 'db dump'" >_out 2>&1; then
+	if ! eval $s "'db sort' 'db check' 'db dump'" >_out 2>&1; then
 		if $fail; then
 			sed -i 's/^.*Assertion //;/^Aborted/d' _out
 		else
@@ -17,7 +17,7 @@ run()
 	for n in "$@"; do
 		s="$s 'db $n'"
 	done
-	if ! eval $s "'db sort' 'db dump'" 2>&1 >_out; then
+	if ! eval $s "'db sort' 'db check' 'db dump'" 2>&1 >_out; then
 		echo "FAILED" 1>&2
 		exit 1
 	else
@@ -154,3 +154,36 @@ EOF
 
 run "empty" <<EOF
 EOF
+
+# --- Scaling (long backward chain) -------------------------------------------
+
+#
+# Each entry is the "prev" of the one before it, so sorting reverses the whole
+# directory. The entries are called e10000, e10001, ... so that their
+# alphabetical order is also their numerical order.
+#
+
+scaling()
+{
+	local n=$1
+	local last=$((10000 + $1 - 1))
+	local i=10000
+
+	set --
+	while [ $i -lt $last ]; do
+		set -- "$@" "add e$i e$((i + 1))"
+		i=$((i + 1))
+	done
+	set -- "$@" "add e$last"
+
+	echo "e$last -" >_expected
+	while [ $i -gt 10000 ]; do
+		i=$((i - 1))
+		echo "e$i e$((i + 1))"
+	done >>_expected
+
+	run "scaling ($n entries)" "$@" <_expected
+	rm -f _expected
+}
+
+scaling 3000
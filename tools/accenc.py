@@ -13,17 +13,19 @@ from nacl.secret import SecretBox
 from nacl.public import PublicKey, PrivateKey, Box
 import hashlib
 
-BLOCK_SIZE = 1024
+BLOCK_SIZE = 1024	# default, see db/storage.h
 NONCE_SIZE = 24
 NONCE_PAD = 8
 PAYLOAD_SIZE = 956
 HASH_SIZE = 20
 HASH_PAD = 12
 PAD_BYTES = 32
+HINT_SIZE = 4		# reader hint, see db/dbcrypt.c
+WPK_V2 = 0x80		# format version 2, in the last byte of the writer's key
 
-STORAGE_BLOCKS = 2048	# total number of blocks, including pad block
-PAD_BLOCKS = 8		# blocks reserved for pads
-RESERVED_BLOCKS = PAD_BLOCKS
+STORAGE_BYTES = 2048 * 1024
+ERASE_BYTES = 4096
+PAD_UNITS = 2		# erase units reserved for pads
 
 
 #
@@ -31,21 +33,36 @@ RESERVED_BLOCKS = PAD_BLOCKS
 #
 
 keys = ( "id", "prev", "user", "email", "pw", "hotp_secret",
-    "hotp_counter", "totp_secret", "comment", "pw2", "dir" )
+    "hotp_counter", "totp_secret", "comment", "pw2", "dir", "parent" )
 
 debug = False
 
 
+# Fields longer than 255 bytes are split into chunks. All but the last chunk
+# have FT_MORE set in their type (see fw/db/db.c)
+
+FT_MORE = 0x80
+
+
+def item(code, s):
+	b = b''
+	while len(s) > 255:
+		b += struct.pack("BB", code | FT_MORE, 255) + s[:255]
+		s = s[255:]
+	return b + struct.pack("BB", code, len(s)) + s
+
+
 def encode(key, code, v):
+	# directory uids (see fw/db/db.h)
+	if key == "parent" or (key == "dir" and isinstance(v, int)):
+		return item(code, struct.pack("<I", v))
 	if key == "id" and isinstance(v, list):
-		s = '\000'.join(v)
-		return struct.pack("BB", code, len(s)) + s.encode()
+		return item(code, '\000'.join(v).encode())
 	if key == "id" or key == "prev" or key == "dir" or key == "user" or \
 	    key == "email" or key == "pw" or key == "pw2" or key == "comment":
-		return struct.pack("BB", code, len(v)) + v.encode()
+		return item(code, v.encode())
 	if key == "hotp_secret" or key == "totp_secret":
-		s = base64.b32decode(v)
-		return struct.pack("BB", code, len(s)) + s
+		return item(code, base64.b32decode(v))
 	if key == "hotp_counter":
 		return struct.pack("<BBQ", code, 8, int(v))
 	raise Exception("unknown key " + key)
@@ -132,8 +149,11 @@ def write_new(data, writer, readers):
 		print("Nonce", nonce.hex(), file = sys.stderr)
 		print("RK", rk.hex(), file = sys.stderr)
 		print("Readers", len(readers), file = sys.stderr)
-	blob = bytes(writer.public_key) + nonce
+	wpk = bytearray(bytes(writer.public_key))
+	wpk[-1] |= WPK_V2
+	blob = bytes(wpk) + nonce
 
+	hint = struct.pack("B", len(readers)) + b'\000' * (HINT_SIZE - 1)
 	i = 0
 	for rd in readers:
 		nonce2 = bytearray(nonce)
@@ -141,7 +161,7 @@ def write_new(data, writer, readers):
 		nonce2[0] ^= i
 		shared = bytes(Box(writer, rd))
 		box = SecretBox(shared)
-		ek = box.encrypt(rk, bytes(nonce2))[Box.NONCE_SIZE +
+		ek = box.encrypt(rk + hint, bytes(nonce2))[Box.NONCE_SIZE +
 		    SecretBox.MACBYTES:]
 		blob += ek
 		if debug:
@@ -161,11 +181,27 @@ def write_new(data, writer, readers):
 	sys.stdout.buffer.write(blob)
 
 
-if len(sys.argv) < 2:
-	print("usage:", sys.argv[0], "db.json [writer [reader ...]]",
-	    file = sys.stderr)
+def usage():
+	print("usage:", sys.argv[0],
+	    "[-b block_size] db.json [writer [reader ...]]", file = sys.stderr)
 	sys.exit(1)
 
+
+if len(sys.argv) > 2 and sys.argv[1] == "-b":
+	BLOCK_SIZE = int(sys.argv[2])
+	if BLOCK_SIZE < 256 or BLOCK_SIZE > 4096 or \
+	    BLOCK_SIZE & (BLOCK_SIZE - 1):
+		usage()
+	del sys.argv[1:3]
+if len(sys.argv) < 2:
+	usage()
+
+STORAGE_BLOCKS = STORAGE_BYTES // BLOCK_SIZE
+PAD_BLOCKS = PAD_UNITS * ERASE_BYTES // BLOCK_SIZE
+# blocks of 4 kB have an extra erase unit for the index hints (see db/block.h)
+HINT_BLOCKS = 1 if BLOCK_SIZE == ERASE_BYTES else 0
+RESERVED_BLOCKS = PAD_BLOCKS + HINT_BLOCKS
+
 s = ""
 with open(sys.argv[1]) as file:
 	for line in file:
@@ -175,13 +211,16 @@ db = json.loads(s)
 
 if len(sys.argv) == 2:
 	writer = None
+	if BLOCK_SIZE != 1024:
+		print("the old format only has 1 kB blocks", file = sys.stderr)
+		sys.exit(1)
 else:
 	writer = PrivateKey(base64.b32decode(sys.argv[2]))
 	if len(sys.argv) == 3:
 		readers = [ writer.public_key ]
 	else:
-		readers = map(lambda x: PublicKey(base64.b32decode(x)),
-		    sys.argv[3:])
+		readers = list(map(lambda x: PublicKey(base64.b32decode(x)),
+		    sys.argv[3:]))
 
 #
 # Note: the pads shouldn't normally have to leave the device, and the device
@@ -193,8 +232,9 @@ DEVICE_SECRET = b'\000' * 32
 MASTER_SECRET = b'\000' * 32
 PIN = 0xffff1234
 
-b = struct.pack("<H", 0)
-b += b'\xff' * (PAD_BYTES - 2)
+# header: sequence number, log2 of the block size (see db/secrets.c)
+b = struct.pack("<HB", 0, BLOCK_SIZE.bit_length() - 1)
+b += b'\xff' * (PAD_BYTES - 3)
 b += id_hash(DEVICE_SECRET, PIN)
 b += master_hash(DEVICE_SECRET, PIN)
 sys.stdout.buffer.write(b + b'\xff' * (BLOCK_SIZE - len(b)))
@@ -17,6 +17,7 @@
 #include "timer.h"
 #include "gfx.h"
 #include "wi_list.h"
+#include "block.h"
 #include "db.h"
 #include "settings.h"
 #include "pin.h"
@@ -46,6 +47,8 @@ static unsigned sp = 0;
 static struct timer idle_timer;
 static struct timer long_timer; /* for long touch screen press */
 static unsigned idle_s;
+static unsigned last_input = 0;	/* time of the last user input */
+static bool touching = 0;
 
 
 /* --- Helper functions ---------------------------------------------------- */
@@ -178,6 +181,10 @@ void turn_off(void)
 	is_on = 0;
 	// @@@ hal_...
 	ui_empty_stack();
+	/* make the next unlock fast */
+	if (main_db.c)
+		db_write_index(&main_db);
+	block_cache_clear();
 	ui_switch(&ui_off, NULL);
 }
 
@@ -197,6 +204,7 @@ void button_event(bool down)
 	static unsigned debounce  = 0;
 
 	debug("button %u (%u < %u)\n", down, debounce, (unsigned) now);
+	last_input = now;
 	if (now < debounce)
 		return;
 	if (!down) {
@@ -285,6 +293,8 @@ void touch_down_event(unsigned x, unsigned y)
 		y = GFX_HEIGHT - 1;
 	if (e && e->touch_down)
 		e->touch_down(current_ctx(), x, y);
+	touching = 1;
+	last_input = now;
 	touch_start_ms = now;
 	touch_start_x = touch_last_x = x;
 	touch_start_y = touch_last_y = y;
@@ -374,6 +384,8 @@ void touch_up_event(void)
 	const struct ui_events *e = current_events();
 
 //	debug("mouse up\n");
+	touching = 0;
+	last_input = now;
 	timer_cancel(&long_timer);
 	if (touch_is_long) {
 		assert(!touch_dragging);
@@ -418,6 +430,9 @@ void touch_up_event(void)
 /* --- Timer ticks --------------------------------------------------------- */
 
 
+#define	RECLAIM_IDLE_MS	500	/* erase only after this long without input */
+
+
 void tick_event(void)
 {
 	const struct ui_events *e = current_events();
@@ -425,6 +440,8 @@ void tick_event(void)
 	if (e && e->tick)
 		e->tick(current_ctx());
 	poll_demo_mbox();
+	if (main_db.c && !touching && now - last_input >= RECLAIM_IDLE_MS)
+		db_reclaim(&main_db);
 }
 
 
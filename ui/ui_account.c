@@ -25,6 +25,7 @@
 #include "wi_icons.h"
 #include "ui_overlay.h"
 #include "ui_confirm.h"
+#include "ui_notice.h"
 #include "ui_entry.h"
 #include "ui_field.h"
 #include "ui_accounts.h"
@@ -35,6 +36,7 @@
 
 #define	TITLE_FG		GFX_YELLOW
 #define	TIMER_FG		GFX_HEX(0x8080ff)
+#define	DAMAGED_FG		GFX_RED
 
 
 struct ui_account_ctx {
@@ -43,7 +45,9 @@ struct ui_account_ctx {
 	void (*resume_action)(struct ui_account_ctx *c);
 	char buf[MAX_NAME_LEN + 1];
 	int64_t last_tick;
-	struct db_field *field_ref;	/* for passing a field with context */
+	enum field_type field_type;	/* field with context, ft_end if none */
+	const struct db_entry *held;	/* entry we hold while open */
+	bool damaged;			/* we could not load the entry */
 };
 
 static void render_account(const struct wi_list *l,
@@ -188,6 +192,9 @@ static void ui_account_tap(void *ctx, unsigned x, unsigned y)
 	char *p = s;
 	uint32_t code;
 
+	/* don't offer to add fields to what we could not load */
+	if (c->damaged)
+		return;
 	if (list_is_empty(&c->list)) {
 		int i;
 
@@ -212,6 +219,7 @@ static void ui_account_tap(void *ctx, unsigned x, unsigned y)
 	entry = wi_list_pick(&c->list, x, y);
 	if (!entry)
 		return;
+	db_entry_load(c->selected_account);
 	for (f = c->selected_account->fields; f; f = f->next)
 		switch (f->type) {
 		case ft_hotp_secret:
@@ -267,23 +275,17 @@ static void changed_account_name(struct ui_account_ctx *c)
 }
 
 
-static bool name_is_different(void *user, struct db_entry *de)
-{
-	struct ui_account_ctx *c = user;
-
-	return de == c->selected_account || strcmp(de->name, c->buf);
-}
-
-
 static int validate_name_change(void *user, const char *s)
 {
 	struct ui_account_ctx *c = user;
+	const struct db_entry *de;
 
 	/*
 	 * We don't use "s" but instead c->buf. Not very pretty, but it keeps
 	 * things simple.
 	 */
-	return db_iterate(&main_db, name_is_different, c);
+	de = db_lookup(&main_db, main_db.dir, c->buf, strlen(c->buf));
+	return !de || de == c->selected_account;
 }
 
 
@@ -373,12 +375,18 @@ static void add_field(void *user)
 static void edit_field(void *user)
 {
 	struct ui_account_ctx *c = user;
-	struct db_field *f = c->field_ref;
+	const struct db_field *f =
+	    db_field_find(c->selected_account, c->field_type);
 	struct ui_field_edit_params prm = {
 		.de	= c->selected_account,
-		.type	= f->type,
+		.type	= c->field_type,
 	};
 
+	/* saving would cut the field to what the editor can hold */
+	if (f && !ui_field_editable(f)) {
+		notice(nt_error, "Too long to edit");
+		return;
+	}
 	ui_switch(&ui_field_edit, &prm);
 }
 
@@ -387,11 +395,18 @@ static void confirm_field_deletion(void *user, bool confirm)
 {
 	struct ui_account_ctx *c = user;
 	struct db_entry *de = c->selected_account;
-	struct db_field *f = c->field_ref;
+	struct db_field *f;
 	struct db_field *f2 = NULL;
 
 	if (!confirm)
 		return;
+	/*
+	 * The page is closed while we ask for confirmation, so the fields of
+	 * the entry may have been dropped (see db_entry_load).
+	 */
+	f = db_field_find(de, c->field_type);
+	if (!f)
+		return;
 	if (f->type == ft_pw)
 		f2 = db_field_find(de, ft_pw2);
 	if (f2) {
@@ -410,14 +425,13 @@ static void confirm_field_deletion(void *user, bool confirm)
 static void delete_field(void *user)
 {
 	struct ui_account_ctx *c = user;
-	struct db_field *f = c->field_ref;
 	struct ui_confirm_params prm = {
 		.action	= "remove field",
 		.fn	= confirm_field_deletion,
 		.user	= c,
 	};
 
-	switch (f->type) {
+	switch (c->field_type) {
 	case ft_user:
 		prm.name = "user name";
 		break;
@@ -480,7 +494,7 @@ static void fields_overlay(struct ui_account_ctx *c, struct db_field *f)
 			prm.n_buttons = f ? 4 : 1;
 		}
 	}
-	c->field_ref = f;
+	c->field_type = f ? f->type : ft_end;
 	for (i = 0; i != prm.n_buttons; i++)
 		buttons[i].user = c;
 	ui_call(&ui_overlay, &prm);
@@ -491,7 +505,7 @@ static void ui_account_long(void *ctx, unsigned x, unsigned y)
 {
 	struct ui_account_ctx *c = ctx;
 
-	if (y < LIST_Y0) {
+	if (y < LIST_Y0 || c->damaged) {
 		account_overlay(c);
 	} else {
 		struct wi_list_entry *entry = wi_list_pick(&c->list, x, y);
@@ -527,12 +541,22 @@ static void ui_account_open(void *ctx, void *params)
 	c->resume_action = NULL;
 	c->last_tick = -1;
 
+	/* the list points to the fields, so they have to stay */
+	db_entry_hold(de);
+	c->held = de;
+
 	gfx_rect_xy(&main_da, 0, TOP_H, GFX_WIDTH, TOP_LINE_WIDTH, GFX_WHITE);
 	text_text(&main_da, GFX_WIDTH / 2, TOP_H / 2, de->name, &FONT_TOP,
 	    GFX_CENTER, GFX_CENTER, TITLE_FG);
 
+	/*
+	 * If some blocks of the entry are missing or corrupt, we can't show its
+	 * fields, but the user can still delete it.
+	 */
+	c->damaged = !db_entry_load(de);
+
 	wi_list_begin(&c->list, &style);
-	for (i = 0; i != field_types; i++) {
+	for (i = 0; !c->damaged && i != field_types; i++) {
 		f = db_field_find(de, order2ft[i]);
 		if (!f)
 			continue;
@@ -540,6 +564,7 @@ static void ui_account_open(void *ctx, void *params)
 		case ft_id:
 		case ft_prev:
 		case ft_dir:
+		case ft_parent:
 			break;
 		case ft_user:
 			add_string(c, "User", f->data, f->len, f);
@@ -577,7 +602,11 @@ static void ui_account_open(void *ctx, void *params)
 	}
 	wi_list_end(&c->list);
 
-	if (list_is_empty(&c->list)) {
+	if (c->damaged) {
+		text_text(&main_da, GFX_WIDTH / 2, (GFX_HEIGHT + LIST_Y0) / 2,
+		    "Damaged", &FONT_TOP, GFX_CENTER, GFX_CENTER, DAMAGED_FG);
+		lists[0] = NULL;
+	} else if (list_is_empty(&c->list)) {
 		wi_icons_draw_fn fn[] = {
 			ui_overlay_sym_add,
 		    	ui_overlay_sym_folder,
@@ -600,6 +629,11 @@ static void ui_account_close(void *ctx)
 	struct ui_account_ctx *c = ctx;
 
 	wi_list_destroy(&c->list);
+	/* we are also closed when calling another page, and when resuming */
+	if (c->held) {
+		db_entry_release(c->held);
+		c->held = NULL;
+	}
 }
 
 
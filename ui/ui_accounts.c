@@ -83,17 +83,9 @@ static void new_entry_name(struct ui_accounts_ctx *c)
 }
 
 
-static bool name_is_different(void *user, struct db_entry *de)
-{
-	const char *s = user;
-
-	return strcmp(de->name, s);
-}
-
-
 static int validate_new_entry(void *user, const char *s)
 {
-	return db_iterate(&main_db, name_is_different, (void *) s);
+	return !db_lookup(&main_db, main_db.dir, s, strlen(s));
 }
 
 
@@ -255,23 +247,21 @@ static void changed_dir_name(struct ui_accounts_ctx *c)
 }
 
 
-static bool dir_name_is_different(void *user, struct db_entry *de)
-{
-	struct ui_accounts_ctx *c = user;
-
-	return de == main_db.dir || strcmp(de->name, c->buf);
-}
-
-
 static int validate_dir_name_change(void *user, const char *s)
 {
 	struct ui_accounts_ctx *c = user;
+	const struct db_entry *de;
 
 	/*
 	 * We don't use "s" but instead c->buf. Not very pretty, but it keeps
 	 * things simple.
+	 *
+	 * The folder we rename is main_db.dir, so its siblings are in the
+	 * parent directory.
 	 */
-	return db_iterate(&main_db, dir_name_is_different, c);
+	de = db_lookup(&main_db, db_dir_parent(&main_db), c->buf,
+	    strlen(c->buf));
+	return !de || de == main_db.dir;
 }
 
 
@@ -374,10 +364,8 @@ static bool move_prohibited(const struct db_entry *de)
 		return 1;
 	if (db_is_descendent(de, db->dir))
 		return 1;
-	for (e = db->dir ? db->dir->children : db->entries; e; e = e->next)
-		if (e != de && !strcmp(de->name, e->name))
-			return 1;
-	return 0;
+	e = db_lookup(db, db->dir, de->name, strlen(de->name));
+	return e && e != de;
 }
 
 
@@ -135,11 +135,28 @@ static void field_edited(struct ui_field_edit_ctx *c)
 }
 
 
+bool ui_field_editable(const struct db_field *f)
+{
+	switch (f->type) {
+	case ft_hotp_secret:
+	case ft_totp_secret:
+		return f->len <= MAX_SECRET_LEN;
+	case ft_hotp_counter:
+		return f->len == sizeof(uint64_t);
+	default:
+		return f->len <= MAX_STRING_LEN;
+	}
+}
+
+
 static void copy_string(char *to, const struct db_field *from)
 {
 	if (from) {
-		memcpy(to, from->data, from->len);
-		to[from->len] = 0;
+		unsigned len =
+		    from->len > MAX_STRING_LEN ? MAX_STRING_LEN : from->len;
+
+		memcpy(to, from->data, len);
+		to[len] = 0;
 	} else {
 		*to = 0;
 	}
@@ -196,6 +213,7 @@ static void ui_field_edit_open(void *ctx, void *params)
 	c->de = p->de;
 	c->type = p->type;
 
+	db_entry_load(p->de);
 	for (f = p->de->fields; f; f = f->next)
 		if (f->type == p->type)
 			break;
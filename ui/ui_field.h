@@ -21,4 +21,10 @@ struct ui_field_edit_params {
 
 bool ui_field_more(const struct db_entry *de);
 
+/*
+ * ui_field_editable returns whether the editor can hold the whole field.
+ * Fields created elsewhere, e.g., with accenc.py, can be longer.
+ */
+bool ui_field_editable(const struct db_field *f);
+
 #endif /* !UI_FIELD_H */
@@ -144,6 +144,20 @@ static void ui_storage_open(void *ctx, void *params)
 		wi_list_add(&c->list, "Empty", tmp, NULL);
 	}
 
+	if (s.wear_max) {
+		unsigned mean = s.wear_sum * 10 / s.wear_units;
+
+		p = tmp;
+		format(add_char, &p, "%u", s.wear_min);
+		wi_list_add(&c->list, "Min. erases", tmp, NULL);
+		p = tmp;
+		format(add_char, &p, "%u.%u", mean / 10, mean % 10);
+		wi_list_add(&c->list, "Mean erases", tmp, NULL);
+		p = tmp;
+		format(add_char, &p, "%u", s.wear_max);
+		wi_list_add(&c->list, "Max. erases", tmp, NULL);
+	}
+
 	/*
 	 * "Invalid" includes blocks that were encrypted with a different key.
 	 */